@@ -0,0 +1,65 @@
+﻿#include "AutoPlayScheduler.h"
+
+#include <algorithm>
+#include <chrono>
+
+AutoPlayScheduler *AutoPlayScheduler::create() {
+    AutoPlayScheduler *scheduler = new AutoPlayScheduler();
+    scheduler->autorelease();
+    return scheduler;
+}
+
+AutoPlayScheduler::AutoPlayScheduler() : _nextSequence(0) {
+}
+
+long long AutoPlayScheduler::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// std::push_heap是大顶堆，比较反过来使最早到期的在堆顶
+bool AutoPlayScheduler::LaterEntry::operator()(const Entry &lhs, const Entry &rhs) const {
+    if (lhs.dueMicroseconds != rhs.dueMicroseconds) {
+        return lhs.dueMicroseconds > rhs.dueMicroseconds;
+    }
+    return lhs.sequence > rhs.sequence;
+}
+
+void AutoPlayScheduler::schedule(int pitch, int velocity, double delaySeconds) {
+    Entry entry;
+    entry.dueMicroseconds = now() + (long long)(std::max(0.0, delaySeconds) * 1000000);
+    entry.sequence = _nextSequence++;
+    entry.pitch = pitch;
+    entry.velocity = velocity;
+    _heap.push_back(entry);
+    std::push_heap(_heap.begin(), _heap.end(), LaterEntry());
+}
+
+const std::vector<int> &AutoPlayScheduler::popDue() {
+    _due.clear();
+    const long long current = now();
+    while (!_heap.empty() && _heap.front().dueMicroseconds <= current) {
+        const Entry &entry = _heap.front();
+        _due.push_back(entry.pitch);
+        _due.push_back(entry.velocity);
+        _due.push_back((int)((current - entry.dueMicroseconds) / 1000));
+        std::pop_heap(_heap.begin(), _heap.end(), LaterEntry());
+        _heap.pop_back();
+    }
+    return _due;
+}
+
+double AutoPlayScheduler::getNextDueDelay() const {
+    if (_heap.empty()) {
+        return -1;
+    }
+    return std::max(0LL, _heap.front().dueMicroseconds - now()) / 1000000.0;
+}
+
+int AutoPlayScheduler::getPendingCount() const {
+    return (int)_heap.size();
+}
+
+void AutoPlayScheduler::clear() {
+    _heap.clear();
+    _due.clear();
+}
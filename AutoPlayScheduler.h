@@ -0,0 +1,63 @@
+﻿#ifndef __AUTO_PLAY_SCHEDULER_H__
+#define __AUTO_PLAY_SCHEDULER_H__
+
+#include <vector>
+
+#include "cocos2d.h"
+
+USING_NS_CC;
+
+/**
+ * 自动弹奏的按键调度
+ *
+ * 按到期时间保存待发出的按键（最小堆），每帧调用一次popDue取出所有已经到期的按键，
+ * 和弦里的多个音符在同一帧一起发出，不会每帧只发一个而越拖越晚。
+ * 到期时间用单调时钟按微秒计算，只在主线程上使用。
+ */
+class AutoPlayScheduler : public Ref {
+public:
+    static AutoPlayScheduler *create();
+
+    /**
+     * delaySeconds秒之后按下（velocity > 0）或松开（velocity为0）pitch
+     */
+    void schedule(int pitch, int velocity, double delaySeconds);
+
+    /**
+     * 取出所有已经到期的按键，按到期时间排序（同时到期的按加入顺序）：
+     * {pitch, velocity, 超过到期时间的毫秒数, pitch, velocity, ...}
+     * 返回的数组在下一次调用前有效
+     */
+    const std::vector<int> &popDue();
+
+    /**
+     * 距离下一个按键到期还有多少秒，没有待发出的按键时返回-1
+     */
+    double getNextDueDelay() const;
+
+    int getPendingCount() const;
+
+    void clear();
+
+private:
+    struct Entry {
+        long long dueMicroseconds;
+        unsigned int sequence;
+        int pitch;
+        int velocity;
+    };
+
+    struct LaterEntry {
+        bool operator()(const Entry &lhs, const Entry &rhs) const;
+    };
+
+    AutoPlayScheduler();
+
+    static long long now();
+
+    std::vector<Entry> _heap;
+    std::vector<int> _due;
+    unsigned int _nextSequence;
+};
+
+#endif // __AUTO_PLAY_SCHEDULER_H__
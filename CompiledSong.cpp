@@ -0,0 +1,481 @@
+﻿#include "CompiledSong.h"
+#include "TempoMap.h"
+#include "NotePairing.h"
+#include "WanakaMidi.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#if CC_TARGET_PLATFORM != CC_PLATFORM_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+USING_NS_WANAKA;
+
+static const char kMagic[4] = {'W', 'N', 'K', 'S'};
+static const char *kCacheDirectory = "compiled_songs/";
+static const char *kCacheExtension = ".wks";
+
+struct CompiledSong::Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t contentHash;
+    int32_t ticksPerQuarter;
+    int32_t endTick;
+    int32_t noteCount;
+    int32_t tempoCount;
+    int32_t measureCount;
+    uint32_t notesOffset;
+    uint32_t temposOffset;
+    uint32_t measuresOffset;
+};
+
+static_assert(sizeof(CompiledSong::Note) == 12, "CompiledSong::Note is written to disk as is");
+static_assert(sizeof(CompiledSong::Tempo) == 16, "CompiledSong::Tempo is written to disk as is");
+static_assert(sizeof(CompiledSong::Measure) == 8, "CompiledSong::Measure is written to disk as is");
+
+inline static size_t align8(size_t offset) {
+    return (offset + 7) & ~(size_t)7;
+}
+
+CompiledSong::CompiledSong() : _mapped(nullptr), _mappedSize(0), _header(nullptr), _notes(nullptr), _tempos(nullptr), _measures(nullptr), _tempoMap(nullptr) {
+}
+
+CompiledSong::~CompiledSong() {
+    CC_SAFE_RELEASE(_tempoMap);
+    unmap();
+}
+
+CompiledSong *CompiledSong::createFromCache(const std::string &sourcePath) {
+    uint64_t hash = 0;
+    if (!hashSourceFile(sourcePath, &hash)) {
+        return nullptr;
+    }
+    CompiledSong *song = new CompiledSong();
+    if (song->initWithFile(getCachePath(sourcePath), hash)) {
+        song->autorelease();
+        return song;
+    }
+    CC_SAFE_DELETE(song);
+    return nullptr;
+}
+
+CompiledSong *CompiledSong::createFromMidi(Wanaka::Midi *midi, const std::string &sourcePath) {
+    if (midi == nullptr) {
+        return nullptr;
+    }
+    uint64_t hash = 0;
+    const bool hashed = hashSourceFile(sourcePath, &hash);
+    std::vector<char> data;
+    compile(midi, hash, &data);
+
+    CompiledSong *song = new CompiledSong();
+    // LOGIC: 写入成功后也从文件映射，之后的读取与从缓存打开时走同一条路径；写不了缓存时直接用内存里的数据
+    const std::string cachePath = getCachePath(sourcePath);
+    if ((hashed && writeFile(cachePath, data) && song->initWithFile(cachePath, hash)) || song->initWithData(data, hash)) {
+        song->autorelease();
+        return song;
+    }
+    CC_SAFE_DELETE(song);
+    return nullptr;
+}
+
+std::string CompiledSong::getCachePath(const std::string &sourcePath) {
+    char name[32] = {0};
+    snprintf(name, sizeof(name), "%016llx", (unsigned long long)hashData(sourcePath.data(), sourcePath.size()));
+    return FileUtils::getInstance()->getWritablePath() + kCacheDirectory + name + kCacheExtension;
+}
+
+uint64_t CompiledSong::hashData(const void *data, size_t size, uint64_t seed) {
+    uint64_t hash = 14695981039346656037ULL ^ seed;
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool CompiledSong::hashSourceFile(const std::string &sourcePath, uint64_t *hash) {
+    Data data = FileUtils::getInstance()->getDataFromFile(sourcePath);
+    if (data.isNull()) {
+        return false;
+    }
+    *hash = hashData(data.getBytes(), data.getSize());
+    return true;
+}
+
+// LOGIC: 与WaterfallLayer::init一样按NotePairing的规则在每个音轨内配对；
+// 手的规则与Waterfall.lua相同，只有一个音轨时按C4区分左右手，否则第一个音轨是右手。
+void CompiledSong::compile(Wanaka::Midi *midi, uint64_t contentHash, std::vector<char> *data) {
+    const int ticksPerQuarter = midi->getTicksPerQuauter();
+    const int trackCount = (int)midi->getTracks().size();
+    std::vector<Note> notes;
+    int endTick = 0;
+
+    for (int i = 0; i < trackCount; i++) {
+        Vector<BaseEvent *> &events = midi->getTracks()[i]->getEvents();
+        if (!events.empty()) {
+            endTick = std::max(endTick, events.back()->getTick());
+        }
+
+        std::vector<Note> slots;
+        std::vector<int> startTicks;
+        NotePairing pairing;
+        for (int j = 0; j < events.size(); j++) {
+            BaseEvent *baseEvent = events.at(j);
+            if (baseEvent->getType() != kEventTypePitch) {
+                continue;
+            }
+            PitchEvent *pitchEvent = static_cast<PitchEvent *>(baseEvent);
+            const int pitch = pitchEvent->getPitch();
+
+            if (pitchEvent->isOn()) {
+                if (pairing.noteOn(pitch) < 0) {
+                    continue;
+                }
+                Note note;
+                note.startTick = pitchEvent->getTick();
+                note.endTick = note.startTick;
+                note.pitch = (uint8_t)pitch;
+                note.track = (uint8_t)pitchEvent->getTrack();
+                note.finger = (int8_t)pitchEvent->getFinger();
+                if (trackCount == 1) {
+                    note.hand = pitch < 48 ? kHandLeft : kHandRight;
+                } else {
+                    note.hand = pitchEvent->getTrack() == 0 ? kHandRight : kHandLeft;
+                }
+                slots.push_back(note);
+                startTicks.push_back(note.startTick);
+            } else {
+                const int slot = pairing.noteOff(pitch);
+                if (slot >= 0) {
+                    slots[slot].endTick = pitchEvent->getTick();
+                }
+            }
+        }
+        std::vector<int> paired;
+        pairing.getPairedNotes(startTicks, &paired);
+        for (int j = 0; j < (int)paired.size(); j++) {
+            notes.push_back(slots[paired[j]]);
+        }
+    }
+    std::stable_sort(notes.begin(), notes.end(), [](const Note &lhs, const Note &rhs) {
+        return lhs.startTick < rhs.startTick;
+    });
+
+    std::vector<Tempo> tempos;
+    std::vector<Measure> measures;
+    collectTimeline(midi, endTick, &tempos, &measures);
+
+    Header header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.contentHash = contentHash;
+    header.ticksPerQuarter = ticksPerQuarter;
+    header.endTick = endTick;
+    header.noteCount = (int32_t)notes.size();
+    header.tempoCount = (int32_t)tempos.size();
+    header.measureCount = (int32_t)measures.size();
+    header.notesOffset = (uint32_t)align8(sizeof(Header));
+    header.temposOffset = (uint32_t)align8(header.notesOffset + notes.size() * sizeof(Note));
+    header.measuresOffset = (uint32_t)align8(header.temposOffset + tempos.size() * sizeof(Tempo));
+
+    data->assign(header.measuresOffset + measures.size() * sizeof(Measure), 0);
+    memcpy(&(*data)[0], &header, sizeof(Header));
+    if (!notes.empty()) {
+        memcpy(&(*data)[header.notesOffset], &notes[0], notes.size() * sizeof(Note));
+    }
+    memcpy(&(*data)[header.temposOffset], &tempos[0], tempos.size() * sizeof(Tempo));
+    if (!measures.empty()) {
+        memcpy(&(*data)[header.measuresOffset], &measures[0], measures.size() * sizeof(Measure));
+    }
+}
+
+// LOGIC: 速度和拍号事件可能在任何音轨上，收集后按tick稳定排序，同一个tick上以后出现的为准。
+// Midi的第一个速度和拍号放在最前面作为tick 0的默认值，tick 0上的事件会覆盖它们。
+void CompiledSong::collectTimeline(Wanaka::Midi *midi, int endTick, std::vector<Tempo> *tempos, std::vector<Measure> *measures) {
+    const int ticksPerQuarter = midi->getTicksPerQuauter();
+    std::vector<Tempo> tempoEvents;
+    std::vector<Measure> signatures;
+
+    Tempo firstTempo;
+    firstTempo.tick = 0;
+    firstTempo.microsecondsPerQuarter = midi->getFirstTempo() > 0 ? (int32_t)(60000000 / midi->getFirstTempo()) : 500000;
+    firstTempo.microseconds = 0;
+    tempoEvents.push_back(firstTempo);
+    if (midi->getTimeBeats() > 0 && midi->getTimeBeatType() > 0) {
+        Measure signature;
+        signature.tick = 0;
+        signature.beats = (int16_t)midi->getTimeBeats();
+        signature.beatType = (int16_t)midi->getTimeBeatType();
+        signatures.push_back(signature);
+    }
+
+    for (int i = 0; i < (int)midi->getTracks().size(); i++) {
+        Vector<BaseEvent *> &events = midi->getTracks()[i]->getEvents();
+        for (int j = 0; j < events.size(); j++) {
+            BaseEvent *baseEvent = events.at(j);
+            if (baseEvent->getType() == kEventTypeTempo) {
+                TempoEvent *tempoEvent = static_cast<TempoEvent *>(baseEvent);
+                if (tempoEvent->getTempo() > 0) {
+                    Tempo tempo;
+                    tempo.tick = tempoEvent->getTick();
+                    tempo.microsecondsPerQuarter = (int32_t)(60000000 / tempoEvent->getTempo());
+                    tempo.microseconds = 0;
+                    tempoEvents.push_back(tempo);
+                }
+            } else if (baseEvent->getType() == kEventTypeTimeSignature) {
+                TimeSignatureEvent *signatureEvent = static_cast<TimeSignatureEvent *>(baseEvent);
+                if (signatureEvent->getTimeBeats() > 0 && signatureEvent->getTimeBeatType() > 0) {
+                    Measure signature;
+                    signature.tick = signatureEvent->getTick();
+                    signature.beats = (int16_t)signatureEvent->getTimeBeats();
+                    signature.beatType = (int16_t)signatureEvent->getTimeBeatType();
+                    signatures.push_back(signature);
+                }
+            }
+        }
+    }
+
+    std::stable_sort(tempoEvents.begin(), tempoEvents.end(), [](const Tempo &lhs, const Tempo &rhs) {
+        return lhs.tick < rhs.tick;
+    });
+    tempos->clear();
+    for (int i = 0; i < (int)tempoEvents.size(); i++) {
+        Tempo tempo = tempoEvents[i];
+        if (!tempos->empty()) {
+            const Tempo &last = tempos->back();
+            if (last.tick == tempo.tick) {
+                tempos->back().microsecondsPerQuarter = tempo.microsecondsPerQuarter;
+                continue;
+            }
+            tempo.microseconds = last.microseconds + (double)(tempo.tick - last.tick) * last.microsecondsPerQuarter / ticksPerQuarter;
+        }
+        tempos->push_back(tempo);
+    }
+
+    // 每个小节一项，拍号在小节中间改变时从改变处开始新的小节
+    std::stable_sort(signatures.begin(), signatures.end(), [](const Measure &lhs, const Measure &rhs) {
+        return lhs.tick < rhs.tick;
+    });
+    measures->clear();
+    int signature = 0;
+    int tick = 0;
+    while (!signatures.empty() && tick <= endTick) {
+        while (signature + 1 < (int)signatures.size() && signatures[signature + 1].tick <= tick) {
+            signature++;
+        }
+        Measure measure = signatures[signature];
+        measure.tick = tick;
+        measures->push_back(measure);
+        int nextTick = tick + ticksPerQuarter * 4 / measure.beatType * measure.beats;
+        if (signature + 1 < (int)signatures.size()) {
+            nextTick = std::min(nextTick, signatures[signature + 1].tick);
+        }
+        if (nextTick <= tick) {
+            break;
+        }
+        tick = nextTick;
+    }
+}
+
+bool CompiledSong::writeFile(const std::string &path, const std::vector<char> &data) {
+    FileUtils *fileUtils = FileUtils::getInstance();
+    const std::string directory = fileUtils->getWritablePath() + kCacheDirectory;
+    if (!fileUtils->isDirectoryExist(directory) && !fileUtils->createDirectory(directory)) {
+        return false;
+    }
+
+    // 先写临时文件再改名，写到一半退出不会留下损坏的缓存
+    const std::string temporaryPath = path + ".tmp";
+    FILE *file = fopen(temporaryPath.c_str(), "wb");
+    if (file == nullptr) {
+        return false;
+    }
+    const bool written = fwrite(&data[0], 1, data.size(), file) == data.size();
+    if (fclose(file) != 0 || !written) {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+#if CC_TARGET_PLATFORM == CC_PLATFORM_WIN32
+    remove(path.c_str());
+#endif
+    if (rename(temporaryPath.c_str(), path.c_str()) != 0) {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool CompiledSong::initWithFile(const std::string &path, uint64_t contentHash) {
+#if CC_TARGET_PLATFORM != CC_PLATFORM_WIN32
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(Header)) {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    unmap();
+    _mapped = mapped;
+    _mappedSize = (size_t)info.st_size;
+    if (!bindSections(static_cast<const char *>(_mapped), _mappedSize, contentHash)) {
+        CCLOG("CompiledSong: %s is stale or broken", path.c_str());
+        unmap();
+        return false;
+    }
+    return true;
+#else
+    Data data = FileUtils::getInstance()->getDataFromFile(path);
+    if (data.isNull()) {
+        return false;
+    }
+    std::vector<char> buffer(data.getBytes(), data.getBytes() + data.getSize());
+    return initWithData(buffer, contentHash);
+#endif
+}
+
+bool CompiledSong::initWithData(std::vector<char> &data, uint64_t contentHash) {
+    unmap();
+    _buffer.swap(data);
+    if (_buffer.empty() || !bindSections(&_buffer[0], _buffer.size(), contentHash)) {
+        unmap();
+        return false;
+    }
+    return true;
+}
+
+bool CompiledSong::bindSections(const char *data, size_t size, uint64_t contentHash) {
+    if (size < sizeof(Header)) {
+        return false;
+    }
+    const Header *header = reinterpret_cast<const Header *>(data);
+    if (memcmp(header->magic, kMagic, sizeof(kMagic)) != 0 || header->version != kVersion || header->contentHash != contentHash) {
+        return false;
+    }
+    if (header->noteCount < 0 || header->tempoCount < 1 || header->measureCount < 0) {
+        return false;
+    }
+    if (header->notesOffset % 8 != 0 || header->temposOffset % 8 != 0 || header->measuresOffset % 8 != 0) {
+        return false;
+    }
+    if (header->notesOffset + (uint64_t)header->noteCount * sizeof(Note) > size
+        || header->temposOffset + (uint64_t)header->tempoCount * sizeof(Tempo) > size
+        || header->measuresOffset + (uint64_t)header->measureCount * sizeof(Measure) > size) {
+        return false;
+    }
+
+    _header = header;
+    _notes = reinterpret_cast<const Note *>(data + header->notesOffset);
+    _tempos = reinterpret_cast<const Tempo *>(data + header->temposOffset);
+    _measures = reinterpret_cast<const Measure *>(data + header->measuresOffset);
+    return true;
+}
+
+void CompiledSong::unmap() {
+#if CC_TARGET_PLATFORM != CC_PLATFORM_WIN32
+    if (_mapped != nullptr) {
+        munmap(_mapped, _mappedSize);
+    }
+#endif
+    _mapped = nullptr;
+    _mappedSize = 0;
+    _buffer.clear();
+    _header = nullptr;
+    _notes = nullptr;
+    _tempos = nullptr;
+    _measures = nullptr;
+}
+
+uint64_t CompiledSong::getContentHash() const {
+    return _header->contentHash;
+}
+
+int CompiledSong::getTicksPerQuarter() const {
+    return _header->ticksPerQuarter;
+}
+
+int CompiledSong::getEndTick() const {
+    return _header->endTick;
+}
+
+int CompiledSong::getNoteCount() const {
+    return _header->noteCount;
+}
+
+const CompiledSong::Note *CompiledSong::getNotes() const {
+    return _notes;
+}
+
+const CompiledSong::Note &CompiledSong::getNote(int index) const {
+    return _notes[index];
+}
+
+int CompiledSong::getNoteStartTick(int index) const {
+    return _notes[index].startTick;
+}
+
+int CompiledSong::getNoteEndTick(int index) const {
+    return _notes[index].endTick;
+}
+
+int CompiledSong::getNotePitch(int index) const {
+    return _notes[index].pitch;
+}
+
+int CompiledSong::getNoteTrack(int index) const {
+    return _notes[index].track;
+}
+
+int CompiledSong::getNoteFinger(int index) const {
+    return _notes[index].finger;
+}
+
+int CompiledSong::getNoteHand(int index) const {
+    return _notes[index].hand;
+}
+
+int CompiledSong::getTempoCount() const {
+    return _header->tempoCount;
+}
+
+const CompiledSong::Tempo *CompiledSong::getTempos() const {
+    return _tempos;
+}
+
+int CompiledSong::getMeasureCount() const {
+    return _header->measureCount;
+}
+
+const CompiledSong::Measure *CompiledSong::getMeasures() const {
+    return _measures;
+}
+
+int CompiledSong::getMeasureTick(int index) const {
+    return _measures[index].tick;
+}
+
+TempoMap *CompiledSong::getTempoMap() {
+    if (_tempoMap == nullptr) {
+        _tempoMap = TempoMap::createWithSong(this);
+        CC_SAFE_RETAIN(_tempoMap);
+    }
+    return _tempoMap;
+}
+
+bool CompiledSong::isMapped() const {
+    return _mapped != nullptr;
+}
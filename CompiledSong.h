@@ -0,0 +1,157 @@
+﻿#ifndef __COMPILED_SONG_H__
+#define __COMPILED_SONG_H__
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "cocos2d.h"
+
+USING_NS_CC;
+
+namespace Wanaka {
+    class Midi;
+}
+
+class TempoMap;
+
+/**
+ * 预编译的曲子
+ *
+ * 把一首曲子打开时需要的数据（配对好的音符表、速度表、小节网格）存成一个带版本号的平铺二进制文件，
+ * 第一次加载时由Midi生成并写到可写目录，之后直接mmap，瀑布流、判定引擎和音符统计不需要再配对音符。
+ * 缓存文件里记录了源文件（MusicXML或MIDI）内容的哈希，源文件变化或者格式版本变化时缓存失效。
+ */
+class CompiledSong : public Ref {
+public:
+    enum Hand {
+        kHandRight = 0,
+        kHandLeft,
+    };
+
+    // 以下结构体按原样写入文件，只能在末尾追加字段并提升kVersion
+    struct Note {
+        int32_t startTick;
+        int32_t endTick;
+        uint8_t pitch;
+        uint8_t track;
+        int8_t finger;
+        int8_t hand;      // Hand
+    };
+
+    struct Tempo {
+        int32_t tick;
+        int32_t microsecondsPerQuarter;
+        double microseconds;  // tick处距离曲子开始的时间
+    };
+
+    struct Measure {
+        int32_t tick;
+        int16_t beats;
+        int16_t beatType;
+    };
+
+    static const uint32_t kVersion = 3;
+
+    /**
+     * 打开sourcePath对应的缓存，缓存不存在或者已经失效时返回nullptr
+     */
+    static CompiledSong *createFromCache(const std::string &sourcePath);
+
+    /**
+     * 由已经加载好的midi生成，并写入sourcePath对应的缓存
+     */
+    static CompiledSong *createFromMidi(Wanaka::Midi *midi, const std::string &sourcePath);
+
+    static std::string getCachePath(const std::string &sourcePath);
+
+    /**
+     * 由所有音轨的速度和拍号事件整理出速度表和小节网格，小节列到endTick为止。
+     * 没有这些事件时用Midi的第一个速度和拍号
+     */
+    static void collectTimeline(Wanaka::Midi *midi, int endTick, std::vector<Tempo> *tempos, std::vector<Measure> *measures);
+
+    /**
+     * 64位FNV-1a
+     */
+    static uint64_t hashData(const void *data, size_t size, uint64_t seed = 0);
+
+    virtual ~CompiledSong();
+
+    uint64_t getContentHash() const;
+
+    int getTicksPerQuarter() const;
+
+    /**
+     * 所有音轨中最后一个事件的tick
+     */
+    int getEndTick() const;
+
+    /**
+     * 音符按startTick排序，startTick相同时前面音轨的在前
+     */
+    int getNoteCount() const;
+
+    const Note *getNotes() const;
+
+    const Note &getNote(int index) const;
+
+    // 给Lua使用
+    int getNoteStartTick(int index) const;
+
+    int getNoteEndTick(int index) const;
+
+    int getNotePitch(int index) const;
+
+    int getNoteTrack(int index) const;
+
+    int getNoteFinger(int index) const;
+
+    int getNoteHand(int index) const;
+
+    int getTempoCount() const;
+
+    const Tempo *getTempos() const;
+
+    int getMeasureCount() const;
+
+    const Measure *getMeasures() const;
+
+    int getMeasureTick(int index) const;
+
+    /**
+     * 由速度表和小节网格建立的TempoMap，第一次调用时创建，之后共用同一个
+     */
+    TempoMap *getTempoMap();
+
+    /**
+     * 数据是否直接映射自缓存文件
+     */
+    bool isMapped() const;
+
+private:
+    struct Header;
+
+    CompiledSong();
+
+    bool initWithFile(const std::string &path, uint64_t contentHash);
+    bool initWithData(std::vector<char> &data, uint64_t contentHash);
+    bool bindSections(const char *data, size_t size, uint64_t contentHash);
+    void unmap();
+
+    static bool hashSourceFile(const std::string &sourcePath, uint64_t *hash);
+    static void compile(Wanaka::Midi *midi, uint64_t contentHash, std::vector<char> *data);
+    static bool writeFile(const std::string &path, const std::vector<char> &data);
+
+    void *_mapped;
+    size_t _mappedSize;
+    std::vector<char> _buffer;
+
+    const Header *_header;
+    const Note *_notes;
+    const Tempo *_tempos;
+    const Measure *_measures;
+    TempoMap *_tempoMap;
+};
+
+#endif // __COMPILED_SONG_H__
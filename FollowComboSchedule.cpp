@@ -0,0 +1,77 @@
+﻿#include "FollowComboSchedule.h"
+
+// 同时按住的音符一般不会超过双手的手指数
+static const int kReservedHeldNotes = 16;
+
+FollowComboSchedule::FollowComboSchedule() {
+    _firstPoints.push_back(0);
+    _heldNotes.reserve(kReservedHeldNotes);
+}
+
+void FollowComboSchedule::clear() {
+    _pointYs.clear();
+    _firstPoints.clear();
+    _firstPoints.push_back(0);
+    _heldNotes.clear();
+}
+
+void FollowComboSchedule::addNote(float y, float length, int comboLength) {
+    if (comboLength > 0) {
+        //从2分音符开始算起
+        for (int offset = comboLength * 2; offset < length; offset += comboLength) {
+            _pointYs.push_back(y + offset);
+        }
+    }
+    _firstPoints.push_back((int)_pointYs.size());
+}
+
+int FollowComboSchedule::getNoteCount() const {
+    return (int)_firstPoints.size() - 1;
+}
+
+int FollowComboSchedule::getPointCount() const {
+    return (int)_pointYs.size();
+}
+
+void FollowComboSchedule::hold(int note) {
+    if (note < 0 || note >= getNoteCount()) {
+        return;
+    }
+    for (int i = 0; i < (int)_heldNotes.size(); i++) {
+        if (_heldNotes[i].note == note) {
+            return;
+        }
+    }
+
+    HeldNote held;
+    held.note = note;
+    held.nextPoint = _firstPoints[note];
+    _heldNotes.push_back(held);
+}
+
+int FollowComboSchedule::getHeldCount() const {
+    return (int)_heldNotes.size();
+}
+
+int FollowComboSchedule::getHeldNote(int index) const {
+    return _heldNotes[index].note;
+}
+
+bool FollowComboSchedule::advanceHeld(int index, float bottomY) {
+    HeldNote &held = _heldNotes[index];
+    //只要当前的长连击大于bottomY，就满足条件，防止miss
+    if (held.nextPoint < _firstPoints[held.note + 1] && _pointYs[held.nextPoint] <= bottomY) {
+        held.nextPoint++;
+        return true;
+    }
+    return false;
+}
+
+void FollowComboSchedule::releaseHeldAt(int index) {
+    _heldNotes[index] = _heldNotes.back();
+    _heldNotes.pop_back();
+}
+
+void FollowComboSchedule::releaseAllHeld() {
+    _heldNotes.clear();
+}
@@ -0,0 +1,67 @@
+﻿#ifndef __FOLLOW_COMBO_SCHEDULE_H__
+#define __FOLLOW_COMBO_SCHEDULE_H__
+
+#include <vector>
+
+/**
+ * 长按连击计分点表
+ *
+ * 加载时为每个音符计算一次长按连击计分点的Y坐标，所有音符的计分点连续保存在一个数组里。
+ * 被击中的音符记录一个只会向前移动的游标，每帧只需要比较游标处的计分点，
+ * 所以长按计分既不需要分配内存，也不再依赖浮点数相等的查找。
+ */
+class FollowComboSchedule {
+public:
+    FollowComboSchedule();
+
+    /**
+     * 清空计分点和所有按住的音符
+     */
+    void clear();
+
+    /**
+     * 按元素列表的顺序添加一个音符的计分点
+     * @param comboLength 一次连击的长度，从第二次连击（2分音符）开始算起
+     */
+    void addNote(float y, float length, int comboLength);
+
+    int getNoteCount() const;
+
+    /**
+     * 所有音符的计分点数目
+     */
+    int getPointCount() const;
+
+    /**
+     * 开始记录一个被击中的音符，同一个音符只会记录一次
+     */
+    void hold(int note);
+
+    int getHeldCount() const;
+
+    int getHeldNote(int index) const;
+
+    /**
+     * 第index个按住的音符的下一个计分点已经到达bottomY时，移动游标并返回true
+     */
+    bool advanceHeld(int index, float bottomY);
+
+    /**
+     * 移除第index个按住的音符，最后一个音符会移动到index的位置
+     */
+    void releaseHeldAt(int index);
+
+    void releaseAllHeld();
+
+private:
+    struct HeldNote {
+        int note;
+        int nextPoint;
+    };
+
+    std::vector<float> _pointYs;
+    std::vector<int> _firstPoints;     // 第i个音符的计分点是[_firstPoints[i], _firstPoints[i + 1])
+    std::vector<HeldNote> _heldNotes;
+};
+
+#endif // __FOLLOW_COMBO_SCHEDULE_H__
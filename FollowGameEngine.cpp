@@ -1,14 +1,23 @@
 ﻿#include <map>
 #include "FollowGameEngine.h"
+#include "FollowJudgeCore.h"
 #include "FallElementSprite.h"
 #include "Macros.h"
+#include "ProfileTrace.h"
 
 #include "WaterfallLayer.h"
+#include "TempoMap.h"
 
 #pragma execution_character_set("utf-8")
 
 #define STANDARD_TEMPO 60
 #define RATE_OF_TICK_LENGTH 6
+#define TICKS_PER_QUARTER 480
+
+// 连击数使用位图字体，数字只是在图集里取字形，不需要每次重新光栅化
+#ifndef COMBO_NUMBER_BMFONT
+#define COMBO_NUMBER_BMFONT "fonts/combo_number.fnt"
+#endif
 
 static bool game_debug = false;
 
@@ -22,24 +31,49 @@ void FollowGameEngine::setDebugEnabled(bool enabled) {
 
 using namespace std;
 
-static vector<float> getLongPressComboY(FallElementSprite *sprite, int pressComboLength) {
-    vector<float> result;
-    if (sprite != nullptr) {
-        //从2分音符开始算起
-        for (int length = pressComboLength * 2; length < sprite->getLength(); length += pressComboLength) {
-            result.push_back(sprite->getPositionY() + length);
-        }
+// 标准速度下判定区域的像素范围对应的时间（微秒），用作按时间判定时的默认窗口
+static long long rangeToMicroseconds(float range) {
+    return (long long)(range * RATE_OF_TICK_LENGTH * 60000000.0 / (STANDARD_TEMPO * TICKS_PER_QUARTER));
+}
+
+// LOGIC: 瀑布流的像素与时间成正比，按时间判定时用瀑布流的速度表把滚动位置换算成MIDI tick；
+// 没有速度表（按精灵判定）时按6个tick为1个像素换算
+static double yToJudgeTick(Wanaka::WaterfallLayer *layer, float y) {
+    TempoMap *tempoMap = layer != nullptr ? layer->getTempoMap() : nullptr;
+    return tempoMap != nullptr ? tempoMap->yToTick(y) : y * RATE_OF_TICK_LENGTH;
+}
+
+// 按时间判定时音符的tick按瀑布流的速度表分段换算，没有速度表时按一个速度
+static void setJudgeTempoChanges(FollowTimeJudge &timeJudge, TempoMap *tempoMap) {
+    std::vector<double> ticks;
+    std::vector<double> microsecondsPerQuarter;
+    const int count = tempoMap != nullptr ? tempoMap->getSegmentCount() : 0;
+    for (int i = 0; i < count; i++) {
+        ticks.push_back(tempoMap->getSegmentTick(i));
+        microsecondsPerQuarter.push_back(tempoMap->getSegmentMicrosecondsPerQuarter(i));
     }
-    return result;
+    timeJudge.setTempoChanges(count > 0 ? &ticks[0] : nullptr, count > 0 ? &microsecondsPerQuarter[0] : nullptr, count);
 }
 
 bool FollowGameEngine::init() {
+    _judgeElements = nullptr;
+    _judgeLayer = nullptr;
+    for (int i = 0; i < sizeof(_ratingSprites) / sizeof(_ratingSprites[0]); i++) {
+        _ratingSprites[i] = nullptr;
+    }
+    _comboNode = nullptr;
+    _comboLabel = nullptr;
     reset();
     _tempo = STANDARD_TEMPO;
     _perfectRange = 25;  //根据实际测试为了能同步瀑布流，放宽perfect区域 15 -》 25
     _greatRange = 30;
     _missRange = 50;
     _judgeBaselineOffset = 0;
+    _core.setRanges(_perfectRange, _greatRange);
+    _core.setJudgeLineOffset(_judgeBaselineOffset);
+    _core.setJudgeMode(FollowJudgeCore::kJudgeModeScroll);
+    _core.getTimeJudge().setTempo(STANDARD_TEMPO, TICKS_PER_QUARTER);
+    _core.getTimeJudge().setWindows(rangeToMicroseconds(_perfectRange), rangeToMicroseconds(_greatRange));
     _perfectRangeLayer = nullptr;
     _greatRangeLayer = nullptr;
     _missRangeLayer = nullptr;
@@ -53,8 +87,10 @@ bool FollowGameEngine::init() {
     //_longPressComboLength = 30;
     //四分音符是480 tick, 6个tick1个像素，计算八分音符的显示长度
     _longPressComboLength = 480 / 2 / RATE_OF_TICK_LENGTH;
+    _core.setLongPressComboLength(_longPressComboLength);
 
     _gameScoreStrategy = new GameScoreStrategy3();
+    _scoreTable.invalidate();
 
     retainNeededObjects();
 
@@ -66,6 +102,7 @@ FollowGameEngine::~FollowGameEngine() {
         delete _gameScoreStrategy;
     }
     releaseNeededObjects();
+    releaseRatingNodes();
 }
 
 void FollowGameEngine::setScoreMode(ScoreMode scoreMode) {
@@ -76,6 +113,7 @@ void FollowGameEngine::setGameScoreStrategy(GameScoreStrategy *strategy) {
     if (_gameScoreStrategy != nullptr) {
         delete _gameScoreStrategy;
         _gameScoreStrategy = strategy;
+        _scoreTable.invalidate();
     }
 }
 
@@ -98,6 +136,7 @@ void FollowGameEngine::releaseNeededObjects() {
 
 void FollowGameEngine::setUILayer(Layer *ui) {
     _ui = ui;
+    createRatingNodes();
 
     if (game_debug) {
         _scoreLabel = Label::createWithSystemFont("", "", 50);
@@ -184,18 +223,7 @@ void FollowGameEngine::setUILayer(Layer *ui) {
                      Point(100, 300), _perfectRange, 300);
     }
 
-    _maxLongComboPerfectCount = 0;
-    Vector<Node *> &nodes = ((Wanaka::WaterfallLayer *)_ui)->getFallElements();
-    for (int i = 0; i < nodes.size(); i++) {
-        float len = ((FallElementSprite *)nodes.at(i))->getLength();
-        len = len * RATE_OF_TICK_LENGTH;
-        float ticksPerCombo = 240.0;
-        if (len > ticksPerCombo * 2) {
-            for (int ticksAtCombo = ticksPerCombo * 2; ticksAtCombo < len; ticksAtCombo += ticksPerCombo) {
-                _maxLongComboPerfectCount += 1;
-            }
-        }
-    }
+    bindJudgeNotes((Wanaka::WaterfallLayer *)_ui);
 }
 
 void FollowGameEngine::addDebugMenu(const char *label, const ccMenuCallback &addCallback, const ccMenuCallback &subCallback, const Point &pos, int value, int tag) {
@@ -247,247 +275,195 @@ void FollowGameEngine::layoutJudgeRange() {
 }
 
 void FollowGameEngine::reset() {
-    _perfectElements.clear();
-    _greatElements[0].clear();
-    _greatElements[1].clear();
-    _topMissElements.clear();
-    _hitElementsLongPressComboPoint.clear();
+    _core.reset();
 
     _ratingSprite = nullptr;
-    _comboNode = nullptr;
-    _combo = 0;
-    _maxCombo = 0;
-    _score = 0;
-    _totalHits = 0;
-
-    _longPressComboCount = 0;
-    _greatCount = 0;
-    _perfectCount = 0;
-}
-
-// TODO: 此函数名称难以准确说明其用处
-static FallElementSprite *hasPitchAndMark(map<Node *, bool> &nodes, int pitch) {
-    for (auto iter = nodes.begin(); iter != nodes.end(); iter++) {
-        FallElementSprite *sprite = static_cast<FallElementSprite *>(iter->first);
-        if (sprite != nullptr && sprite->getPitch() == pitch && iter->second == false) {
-            iter->second = true;
-            sprite->hit();
-            return sprite;
+    for (int i = 0; i < sizeof(_ratingSprites) / sizeof(_ratingSprites[0]); i++) {
+        if (_ratingSprites[i] != nullptr) {
+            _ratingSprites[i]->stopAllActions();
+            _ratingSprites[i]->setVisible(false);
         }
     }
-    return nullptr;
-}
-
-// LOGIC: 音符起始点在perfect或great区域时对应琴键被按下，即算击中
-std::pair<int, float> FollowGameEngine::getRatingAndDistance(int pitch, Point offset) {
-    std::pair<int, float> result;
-    FallElementSprite *sprite = hasPitchAndMark(_greatElements[1], pitch);
-    if (sprite != nullptr) {
-        result.first = kGreat;
-        result.second = fabs(sprite->getPositionY() - fabs(offset.y));
-        _hitElements[sprite] = kGreat;
-    } else {
-        sprite = hasPitchAndMark(_perfectElements, pitch);
-        if (sprite != nullptr) {
-            result.first = kPerfect;
-            result.second = fabs(sprite->getPositionY() - fabs(offset.y));
-            _hitElements[sprite] = kPerfect;
-        } else {
-            sprite = hasPitchAndMark(_greatElements[0], pitch);
-            if (sprite != nullptr) {
-                result.first = kGreat;
-                result.second = fabs(sprite->getPositionY() - fabs(offset.y));
-                _hitElements[sprite] = kGreat;
-            } else {
-                result.first = kNone;
-                result.second = 0;
-            }
-        }
+    if (_comboNode != nullptr) {
+        _comboNode->stopAllActions();
+        _comboNode->setVisible(false);
     }
-
-    return result;
+    _score = 0;
 }
 
-void FollowGameEngine::onWaterfallDidScroll(Wanaka::WaterfallLayer *layer) {
-    onWaterfallDidScroll(layer->getFallElements(), layer->getScrollOffset());
-}
+void FollowGameEngine::createRatingNodes() {
+    releaseRatingNodes();
 
-void FollowGameEngine::onWaterfallDidScroll(Vector<Node *> &elements, Point offset) {
-    // 6 ticks is a pixel by default.
-    const float bottomY = fabs(offset.y);
-
-    for (int i = 0; i < elements.size(); i++) {
-        FallElementSprite *sprite = static_cast<FallElementSprite *>(elements.at(i));
-        if (sprite != nullptr) {
-            const float y = sprite->getPositionY();
-            //(150, 300] ticks
-            if (y > bottomY + _greatRange + _judgeBaselineOffset && y <= bottomY + _missRange + _judgeBaselineOffset) {
-                // MISS
-                //                if (_topMissElements.find(sprite) == _topMissElements.end()) {
-                //                    _topMissElements[sprite] = false;   //false代表还没有键盘事件
-                //                }
-            } else if (y >= bottomY + _perfectRange + _judgeBaselineOffset && y <= bottomY + _greatRange + _judgeBaselineOffset) {
-                // GREAT
-                if (_greatElements[0].find(sprite) == _greatElements[0].end()) {
-                    auto iter = _topMissElements.find(sprite);
-                    if (iter != _topMissElements.end()) {
-                        _greatElements[0][sprite] = _topMissElements[sprite];
-                        _topMissElements.erase(iter);
-                    } else {
-                        _greatElements[0][sprite] = false;
-                    }
-                }
-            } else if (y > bottomY - _perfectRange + _judgeBaselineOffset && y < bottomY + _perfectRange + _judgeBaselineOffset) {
-                // PERFECT
-                if (_perfectElements.find(sprite) == _perfectElements.end()) {
-                    auto iter = _greatElements[0].find(sprite);
-                    if (iter != _greatElements[0].end()) {
-                        _perfectElements[sprite] = _greatElements[0][sprite];
-                        _greatElements[0].erase(iter);
-                    } else {
-                        _perfectElements[sprite] = false;
-                    }
-                }
-            } else if (y >= bottomY - _greatRange + _judgeBaselineOffset && y <= bottomY - _perfectRange + _judgeBaselineOffset) {
-                // GREAT
-                if (_greatElements[1].find(sprite) == _greatElements[1].end()) {
-                    auto iter = _perfectElements.find(sprite);
-                    if (iter != _perfectElements.end()) {
-                        _greatElements[1][sprite] = _perfectElements[sprite];
-                        _perfectElements.erase(iter);
-                    } else {
-                        _greatElements[1][sprite] = false;
-                    }
-                }
-            } else if (y < bottomY - _greatRange + _judgeBaselineOffset) {
-                // MISS
-                auto iter = _greatElements[1].find(sprite);
-                if (iter != _greatElements[1].end()) {
-                    // TODO: 最后几个音符可能移动不到可以发出miss的区域
-                    if (_greatElements[1][sprite] == false) {
-                        setRating(kMiss);
-                    }
-                    _greatElements[1].erase(iter);
-                } else if (_perfectElements.find(sprite) != _perfectElements.end()) {
-                    _perfectElements.erase(sprite);
-                }
-            }
+    // 评价图片和连击数只在这里创建一次，之后每次评价只是重新播放动画
+    Size uiSize = _ui->getContentSize();
+    const Point ratingPosition(uiSize.width / 2, uiSize.height * 400 / 640);
+    float ratingMinY = ratingPosition.y;
+    for (int i = 0; i < sizeof(_ratingSprites) / sizeof(_ratingSprites[0]); i++) {
+        Sprite *sprite = Sprite::createWithSpriteFrameName(sDefaultFrameNames[i]);
+        if (sprite == nullptr) {
+            continue;
+        }
+        PROFILE_COUNT("engine.spritesCreated", 1);
+        sprite->retain();
+        sprite->setPosition(ratingPosition);
+        sprite->setVisible(false);
+        _ui->addChild(sprite);
+        _ratingSprites[i] = sprite;
+
+        if (i == kPerfect) {
+            ratingMinY = ratingPosition.y - sprite->getContentSize().height / 2;
         }
     }
 
-    auto iter = _hitElements.begin();
-    while (iter != _hitElements.end()) {
-        FallElementSprite *sprite = static_cast<FallElementSprite *>(iter->first);
-        const float y = sprite->getPositionY();
-
-        vector<float> &&longPressComboYs = getLongPressComboY(sprite, _longPressComboLength);
-        for (int i = 0; i < longPressComboYs.size(); i++) {
-            //只要当前的长连击大于bottomY，就满足条件，防止miss
-            // if (fabs(longPressComboYs[i] - bottomY) <= 1){
-            if (longPressComboYs[i] <= bottomY) {
-                // 计算分数
-                if (_hitElementsLongPressComboPoint[sprite].count(longPressComboYs[i]) == 0) {
-                    _hitElementsLongPressComboPoint[sprite].insert(longPressComboYs[i]);
-                    setRating(kPerfect);
-                    GameScoreStrategyContext context;
-                    context.combo = _combo;
-                    context.comboInNote = 0;  // TODO: 这个值什么意思？
-                    context.rateing = kPerfect;
-                    context.toleranceRadius = (_perfectRange + _greatRange) * RATE_OF_TICK_LENGTH;
-                    context.deltaDistance = 0;
-
-                    _score += _gameScoreStrategy->compute(&context);
-                    if (_scoreLabel != nullptr) {
-                        char scoreLabel[50] = {0};
-                        sprintf(scoreLabel, "%d", (int)_score);
-                        _scoreLabel->setString(scoreLabel);
-                    }
-                    _longPressComboCount++;
-                }
-            }
+    _comboLabel = Label::createWithBMFont(COMBO_NUMBER_BMFONT, "0");
+    if (_comboLabel == nullptr) {
+        // 没有打包位图字体时退回系统字体，只是每次更新数字需要重新光栅化
+        _comboLabel = Label::createWithSystemFont("0", COMBO_NUMBER_FONT, 80);
+        _comboLabel->setWidth(_comboLabel->getContentSize().width * 4 + 30);  // 预留4位数字，并避免斜体字右侧字符有部分被裁减掉
+        _comboLabel->setHorizontalAlignment(TextHAlignment::CENTER);
+    }
+    _comboLabel->setAnchorPoint(Point::ANCHOR_MIDDLE);
+    _comboLabel->setPosition(uiSize.width / 2, ratingMinY - _comboLabel->getContentSize().height - 10);
+
+    _comboNode = Node::create();
+    _comboNode->retain();
+    _comboNode->setContentSize(uiSize);
+    _comboNode->setCascadeOpacityEnabled(true);
+    _comboNode->setVisible(false);
+    _comboNode->addChild(_comboLabel);
+    _ui->addChild(_comboNode);
+}
+
+void FollowGameEngine::releaseRatingNodes() {
+    for (int i = 0; i < sizeof(_ratingSprites) / sizeof(_ratingSprites[0]); i++) {
+        if (_ratingSprites[i] != nullptr) {
+            _ratingSprites[i]->removeFromParent();
+            _ratingSprites[i]->release();
+            _ratingSprites[i] = nullptr;
         }
+    }
+    if (_comboNode != nullptr) {
+        _comboNode->removeFromParent();
+        _comboNode->release();
+        _comboNode = nullptr;
+    }
+    _comboLabel = nullptr;
+    _ratingSprite = nullptr;
+}
 
-        // 已击中音符时值全部过去后，移出_hitElements
-        if (sprite != nullptr && y + sprite->getLength() < bottomY) {
-            iter = _hitElements.erase(iter);
+void FollowGameEngine::bindJudgeNotes(Wanaka::WaterfallLayer *layer) {
+    // 瀑布流只为可见的音符绑定精灵，判定使用完整的音符表
+    const WaterfallNoteTable &notes = layer->getNoteTable();
+    if (_judgeLayer != layer || _core.getNoteCount() != notes.getNoteCount()) {
+        // LOGIC: 异步生成的音符表一般在setUILayer之后才准备好，还没有判定过音符时从头开始；
+        // 已经有成绩时（中途换了音符表）保留连击和统计，从当前位置继续判定
+        const bool keepStats = _judgeLayer == layer && _core.hasJudged();
+        _judgeLayer = layer;
+        _judgeElements = nullptr;
+        setJudgeTempoChanges(_core.getTimeJudge(), layer->getTempoMap());
+        if (keepStats) {
+            _core.replaceNotes(notes.getYs(), notes.getLengths(), notes.getPitches(), notes.getTicks(), notes.getNoteCount());
         } else {
-            iter++;
+            _core.setNotes(notes.getYs(), notes.getLengths(), notes.getPitches(), notes.getTicks(), notes.getNoteCount());
         }
+        // 长按计分点和得分表都依赖音符表，每次绑定都要重新计算
+        _maxLongComboPerfectCount = _core.getLongPressPointCount();
+        _scoreTable.invalidate();
     }
 }
 
-void FollowGameEngine::setRating(Rating rating) {
-    // rating
-    if (rating != kNone && _ratingSprite != nullptr) {
-        _ui->removeChild(_ratingSprite, true);
-        _ratingSprite = nullptr;
+void FollowGameEngine::bindJudgeElements(Vector<Node *> &elements) {
+    if (_judgeElements != &elements || _core.getNoteCount() != elements.size()) {
+        _judgeElements = &elements;
+        _judgeLayer = nullptr;
+        setJudgeTempoChanges(_core.getTimeJudge(), nullptr);
+        _core.clearNotes();
+        for (int i = 0; i < elements.size(); i++) {
+            FallElementSprite *sprite = static_cast<FallElementSprite *>(elements.at(i));
+            _core.addNote(sprite->getPositionY(), sprite->getLength(), sprite->getPitch());
+        }
+        _core.commitNotes();
+        _maxLongComboPerfectCount = _core.getLongPressPointCount();
+        _scoreTable.invalidate();
     }
+}
 
-    switch (rating) {
-        case kPerfect:
-            _ratingSprite = Sprite::createWithSpriteFrameName("perfect.png");
-            _combo++;
-            break;
-        case kGreat:
-            _ratingSprite = Sprite::createWithSpriteFrameName("great.png");
-            _combo++;
-            break;
-        case kMiss:
-            _ratingSprite = Sprite::createWithSpriteFrameName("miss.png");
-            _combo = 0;
-            break;
-        case kNone:
-            _combo = 0;
-            break;
-        default:
-            break;
-    }
+void FollowGameEngine::onWaterfallDidScroll(Wanaka::WaterfallLayer *layer) {
+    PROFILE_SCOPE("FollowGameEngine::onWaterfallDidScroll");
+    bindJudgeNotes(layer);
+    // 6 ticks is a pixel by default.
+    scrollJudge(fabs(layer->getScrollOffset().y));
+}
 
-    if (_combo > _maxCombo) {
-        _maxCombo = _combo;
+void FollowGameEngine::onWaterfallDidScroll(Vector<Node *> &elements, Point offset) {
+    PROFILE_SCOPE("FollowGameEngine::onWaterfallDidScroll");
+    bindJudgeElements(elements);
+    scrollJudge(fabs(offset.y));
+}
+
+void FollowGameEngine::scrollJudge(float bottomY) {
+    _core.scrollTo(bottomY, yToJudgeTick(_judgeLayer, bottomY));
+
+    for (int i = 0; i < _core.getEventCount(); i++) {
+        const FollowJudgeEvent &event = _core.getEvent(i);
+        if (event.type == FollowJudgeEvent::kTypeMiss) {
+            setRating(kMiss);
+        } else if (event.type == FollowJudgeEvent::kTypeLongPress) {
+            // 计算分数
+            setRating(kPerfect);
+            GameScoreStrategyContext context;
+            context.combo = event.combo;
+            context.comboInNote = 0;  // TODO: 这个值什么意思？
+            context.rateing = kPerfect;
+            context.toleranceRadius = (_perfectRange + _greatRange) * RATE_OF_TICK_LENGTH;
+            context.deltaDistance = 0;
+
+            _score += _gameScoreStrategy->compute(&context);
+            if (_scoreLabel != nullptr) {
+                char scoreLabel[50] = {0};
+                sprintf(scoreLabel, "%d", (int)_score);
+                _scoreLabel->setString(scoreLabel);
+            }
+        }
     }
+}
 
+void FollowGameEngine::setRating(Rating rating) {
+    PROFILE_SCOPE("FollowGameEngine::setRating");
+    // 连击数由_core统计，这里只负责显示
     if (!_isDisplayRatingResult) {
         return;
     }
 
-    Size uiSize = _ui->getContentSize();
-    if (_ratingSprite != nullptr && rating != kNone) {
-        _ratingSprite->setPosition(uiSize.width / 2, uiSize.height * 400 / 640);
-        _ui->addChild(_ratingSprite);
-
-        _ratingSprite->setScale(0.6f);
+    if (rating != kNone && rating < sizeof(_ratingSprites) / sizeof(_ratingSprites[0])) {
+        if (_ratingSprite != nullptr) {
+            _ratingSprite->stopAllActions();
+            _ratingSprite->setVisible(false);
+        }
 
-        _ratingSprite->runAction(Sequence::create(ScaleTo::create(0.1f, 1.0f), DelayTime::create(0.2f), FadeOut::create(0.2f), nullptr));
+        _ratingSprite = _ratingSprites[rating];
+        if (_ratingSprite != nullptr) {
+            _ratingSprite->setVisible(true);
+            _ratingSprite->setOpacity(0xff);
+            _ratingSprite->setScale(0.6f);
+            _ratingSprite->runAction(Sequence::create(ScaleTo::create(0.1f, 1.0f), DelayTime::create(0.2f), FadeOut::create(0.2f), nullptr));
+        }
     }
 
-    if (!_isDisplayRatingResult) {
+    const int combo = _core.getCombo();
+    if (_comboNode == nullptr || combo <= 0) {
         return;
     }
 
-    if (_comboNode != nullptr) {
-        _ui->removeChild(_comboNode, true);
-        _comboNode = nullptr;
-    }
-
-    if (_combo > 0) {
-        _comboNode = Node::create();
-        _comboNode->setContentSize(uiSize);
-
-        std::stringstream ss;
-        ss << _combo;
-        Label *comboLabel = Label::createWithSystemFont(ss.str().c_str(), COMBO_NUMBER_FONT, 80);
-        comboLabel->setAnchorPoint(Point::ANCHOR_MIDDLE);
-        comboLabel->setWidth(comboLabel->getContentSize().width + 30);  // 避免斜体字右侧字符有部分被裁减掉
-        comboLabel->setPosition(uiSize.width / 2, _ratingSprite->getBoundingBox().getMinY() - comboLabel->getBoundingBox().size.height - 10);
-        _comboNode->addChild(comboLabel);
+    char comboText[16] = {0};
+    snprintf(comboText, sizeof(comboText), "%d", combo);
+    _comboLabel->setString(comboText);
 
-        _ui->addChild(_comboNode);
-
-        _comboNode->setOpacity(0x80);  // TODO: not works?
-        _comboNode->runAction(
-            Sequence::create(Spawn::create(MoveBy::create(0.1f, Point(0, 20)), FadeIn::create(0.1f), nullptr), FadeOut::create(0.3f), Hide::create(), nullptr));  // TODO: fade not works
-    }
+    _comboNode->stopAllActions();
+    _comboNode->setPosition(Point::ZERO);
+    _comboNode->setVisible(true);
+    _comboNode->setOpacity(0x80);
+    _comboNode->runAction(Sequence::create(Spawn::create(MoveBy::create(0.1f, Point(0, 20)), FadeIn::create(0.1f), nullptr), FadeOut::create(0.3f), Hide::create(), nullptr));
 }
 
 void FollowGameEngine::setIsDisplayRatingResult(bool display) {
@@ -501,7 +477,7 @@ bool FollowGameEngine::getIsDisplayRatingResult() {
 void FollowGameEngine::computeScore(double distance, Rating rating) {
     if (fabs(distance) <= 30 && rating != kMiss && rating != kNone) {
         GameScoreStrategyContext context;
-        context.combo = _combo;
+        context.combo = _core.getCombo();
         context.comboInNote = 0;
         context.rateing = rating;
         //这个都转换为对应的tick
@@ -518,47 +494,45 @@ void FollowGameEngine::computeScore(double distance, Rating rating) {
 }
 
 void FollowGameEngine::onKeyDown(int pitch, Point waterfallOffset) {
-    std::pair<int, float> &&result = getRatingAndDistance(pitch, waterfallOffset);
-    Rating rating = (Rating)result.first;
+    const float bottomY = fabs(waterfallOffset.y);
+    applyKeyDownEvent(pitch, _core.keyDown(pitch, bottomY, yToJudgeTick(_judgeLayer, bottomY)));
+}
+
+void FollowGameEngine::onKeyDownAtTime(int pitch, long long timestamp) {
+    if (_core.getJudgeMode() != FollowJudgeCore::kJudgeModeTime) {
+        return;
+    }
+    applyKeyDownEvent(pitch, _core.keyDownAtTime(pitch, timestamp));
+}
+
+void FollowGameEngine::applyKeyDownEvent(int pitch, const FollowJudgeEvent &event) {
+    Rating rating = kNone;
+    if (event.type == FollowJudgeEvent::kTypeHit) {
+        rating = (event.judgement == FollowJudgeCore::kJudgementPerfect) ? kPerfect : kGreat;
+        if (_judgeLayer != nullptr) {
+            _judgeLayer->hitNote(event.note);
+        } else if (_judgeElements != nullptr) {
+            static_cast<FallElementSprite *>(_judgeElements->at(event.note))->hit();
+        }
+    }
+
     setRating(rating);
-    computeScore(result.second, rating);
+    computeScore(event.distance, rating);
 
     if (rating == kGreat || rating == kPerfect) {
         Wanaka::WaterfallLayer *waterfall = dynamic_cast<Wanaka::WaterfallLayer *>(_ui);
         if (waterfall != nullptr) {
             waterfall->hitPitch(pitch);
         }
-        _totalHits++;
-        if (rating == kGreat) {
-            _greatCount++;
-        } else if (rating == kPerfect) {
-            _perfectCount++;
-        }
     }
 
     if (_ratingCallback != nullptr) {
-        _ratingCallback(pitch, result.first, _score);
+        _ratingCallback(pitch, rating, _score);
     }
 }
 
 void FollowGameEngine::onKeyUp(int pitch, Point waterfallOffset) {
-    // 在连击计分点出基准线之前松开已击中音符对应琴键，移出_hitElements
-    auto iter = _hitElements.begin();
-    while (iter != _hitElements.end()) {
-        FallElementSprite *sprite = static_cast<FallElementSprite *>(iter->first);
-        vector<float> &&lpcys = getLongPressComboY(sprite, _longPressComboLength);
-
-        float y = 0.0f;
-        if (lpcys.size() > 0) {
-            y = lpcys.back();
-        }
-
-        if (sprite != nullptr && sprite->getPitch() == pitch && sprite->getPositionY() + sprite->getLength() > fabs(waterfallOffset.y)) {
-            iter = _hitElements.erase(iter);
-        } else {
-            iter++;
-        }
-    }
+    _core.keyUp(pitch, fabs(waterfallOffset.y));
 }
 
 void FollowGameEngine::setRatingCallback(RatingCallback ratingCallback) {
@@ -569,11 +543,9 @@ int FollowGameEngine::getScore() {
     return _score;
 }
 
-unsigned int FollowGameEngine::getTotalScore() {
-    int maxScore = 0;
-
-    //全部的perfect数目
-    for (int i = 0; i < _totalNotes + _maxLongComboPerfectCount; i++) {
+void FollowGameEngine::ensureScoreTable(int count) {
+    // 只在策略或判定范围变化后重新计算，其余情况只追加不够的部分
+    for (int i = _scoreTable.getSize(); i < count; i++) {
         GameScoreStrategyContext context;
         context.combo = i + 1;
         context.comboInNote = 0;
@@ -581,33 +553,83 @@ unsigned int FollowGameEngine::getTotalScore() {
         context.toleranceRadius = (_greatRange + _perfectRange) * RATE_OF_TICK_LENGTH;
         context.deltaDistance = 0;
 
-        maxScore += _gameScoreStrategy->compute(&context);
+        _scoreTable.append(_gameScoreStrategy->compute(&context));
     }
+}
 
-    return maxScore;
+unsigned int FollowGameEngine::getTotalScore() {
+    //全部的perfect数目
+    const int count = _totalNotes + _maxLongComboPerfectCount;
+    ensureScoreTable(count);
+    return (unsigned int)_scoreTable.getSum(count);
+}
+
+unsigned int FollowGameEngine::getRemainingScore() {
+    // 剩下的音符和长按计分点全部perfect，连击数从当前连击继续累加时还能得到的分数
+    const int count = _totalNotes + _maxLongComboPerfectCount;
+    const int judged = _core.getPerfectCount() + _core.getGreatCount() + _core.getMissCount() + _core.getLongPressComboCount();
+    const int remaining = count > judged ? count - judged : 0;
+    const int combo = _core.getCombo();
+    ensureScoreTable(combo + remaining);
+    return (unsigned int)_scoreTable.getSum(combo, combo + remaining);
 }
 
 int FollowGameEngine::getMaxCombo() {
-    return _maxCombo;
+    return _core.getMaxCombo();
 }
 
 int FollowGameEngine::getRightRate() {
-    return (_totalHits * 100 / _totalNotes);
+    return _core.getRightRate(_totalNotes);
 }
 
 void FollowGameEngine::setTempo(int tempo) {
     _tempo = tempo;
+    _core.getTimeJudge().setTempo(tempo, TICKS_PER_QUARTER);
+}
+
+void FollowGameEngine::setJudgeMode(JudgeMode mode) {
+    _core.setJudgeMode(mode == kJudgeModeTime ? FollowJudgeCore::kJudgeModeTime : FollowJudgeCore::kJudgeModeScroll);
+}
+
+FollowGameEngine::JudgeMode FollowGameEngine::getJudgeMode() {
+    return _core.getJudgeMode() == FollowJudgeCore::kJudgeModeTime ? kJudgeModeTime : kJudgeModeScroll;
+}
+
+void FollowGameEngine::setPerfectWindow(long long microseconds) {
+    FollowTimeJudge &timeJudge = _core.getTimeJudge();
+    timeJudge.setWindows(microseconds, timeJudge.getGreatWindow());
+}
+
+void FollowGameEngine::setGreatWindow(long long microseconds) {
+    FollowTimeJudge &timeJudge = _core.getTimeJudge();
+    timeJudge.setWindows(timeJudge.getPerfectWindow(), microseconds);
+}
+
+long long FollowGameEngine::getPerfectWindow() {
+    return _core.getTimeJudge().getPerfectWindow();
+}
+
+long long FollowGameEngine::getGreatWindow() {
+    return _core.getTimeJudge().getGreatWindow();
+}
+
+void FollowGameEngine::syncSongClock(int tick, long long timestamp) {
+    _core.getTimeJudge().syncClock(tick, timestamp);
 }
 
 void FollowGameEngine::setPerfectRange(int range) {
     _perfectRange = range;
     _perfectRange *= (float)_tempo / (float)STANDARD_TEMPO;
+    _core.setRanges(_perfectRange, _greatRange);
+    _scoreTable.invalidate();
     layoutJudgeRange();
 }
 
 void FollowGameEngine::setGreatRange(int range) {
     _greatRange = range;
     _greatRange *= (float)_tempo / (float)STANDARD_TEMPO;
+    _core.setRanges(_perfectRange, _greatRange);
+    _scoreTable.invalidate();
     layoutJudgeRange();
 }
 
@@ -619,6 +641,7 @@ void FollowGameEngine::setMissRange(int range) {
 
 void FollowGameEngine::setJudgeLineOffset(int offset) {
     _judgeBaselineOffset = offset;
+    _core.setJudgeLineOffset(_judgeBaselineOffset);
     layoutJudgeRange();
 }
 
@@ -644,16 +667,12 @@ int FollowGameEngine::getJudgeLineOffset() {
 
 //计算时值得分
 int FollowGameEngine::getDurationScore() {
-    int allLongComboPoints = _perfectCount + _greatCount + _longPressComboCount;
-    int maxLongComboPoints = _maxLongComboPerfectCount + _totalNotes;
-    return allLongComboPoints * 100 / maxLongComboPoints;
+    return _core.getDurationScore(_totalNotes, _maxLongComboPerfectCount);
 }
 
 //计算节奏得分,getGreatRate() * weight +getPerfectRate() * (1 - weight)
 int FollowGameEngine::getRhythmScore(float weight) {
-    int greatScore = _greatCount * 100 / _totalNotes;
-    int perfectScore = _perfectCount * 100 / _totalNotes;
-    return greatScore * weight + perfectScore;
+    return _core.getRhythmScore(_totalNotes, weight);
 }
 
 //计算最大连击数
@@ -662,5 +681,5 @@ unsigned int FollowGameEngine::getTotalCombo() {
 }
 
 float FollowGameEngine::getFinalScore(float rightRatePercent, float durationPercent, float rhythmPercent) {
-    return getRightRate() * rightRatePercent + getDurationScore() * durationPercent + getRhythmScore(0.5f) * rhythmPercent;
+    return _core.getFinalScore(_totalNotes, _maxLongComboPerfectCount, rightRatePercent, durationPercent, rhythmPercent);
 }
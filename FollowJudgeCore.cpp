@@ -0,0 +1,449 @@
+﻿#include "FollowJudgeCore.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+#include "ProfileTrace.h"
+
+#define RATE_OF_TICK_LENGTH 6
+
+// 一帧内产生的事件一般不会太多，预留后每帧都不需要分配内存
+static const int kReservedEvents = 32;
+// 判定窗口内的音符不少于这个数目时才批量划分判定区域
+static const int kBatchClassifyCount = 16;
+
+FollowJudgeCore::FollowJudgeCore() : _judgeWindowHead(0), _judgeWindowTail(0), _lastBottomTick(0), _judgeMode(kJudgeModeScroll), _perfectRange(25), _greatRange(30), _judgeLineOffset(0), _longPressComboLength(480 / 2 / RATE_OF_TICK_LENGTH) {
+    _events.reserve(kReservedEvents);
+    _zones.reserve(kBatchClassifyCount * 4);
+    reset();
+}
+
+void FollowJudgeCore::clearNotes() {
+    _ys.clear();
+    _lengths.clear();
+    _pitches.clear();
+    _ticks.clear();
+    _judgeIndex.reset(0);
+    _comboSchedule.clear();
+    _timeJudge.clear();
+    reset();
+}
+
+void FollowJudgeCore::addNote(float y, float length, int pitch) {
+    addNote(y, length, pitch, (int)(y * RATE_OF_TICK_LENGTH));
+}
+
+void FollowJudgeCore::addNote(float y, float length, int pitch, int tick) {
+    _ys.push_back(y);
+    _lengths.push_back(length);
+    _pitches.push_back(pitch);
+    _ticks.push_back(tick);
+}
+
+void FollowJudgeCore::setNotes(const float *ys, const float *lengths, const int *pitches, const int *ticks, int count) {
+    clearNotes();
+    if (count > 0) {
+        _ys.assign(ys, ys + count);
+        _lengths.assign(lengths, lengths + count);
+        _pitches.assign(pitches, pitches + count);
+        if (ticks != nullptr) {
+            _ticks.assign(ticks, ticks + count);
+        } else {
+            _ticks.resize(count);
+            for (int i = 0; i < count; i++) {
+                _ticks[i] = (int)(ys[i] * RATE_OF_TICK_LENGTH);
+            }
+        }
+    }
+    commitNotes();
+}
+
+void FollowJudgeCore::replaceNotes(const float *ys, const float *lengths, const int *pitches, const int *ticks, int count) {
+    const int combo = _combo;
+    const int maxCombo = _maxCombo;
+    const int totalHits = _totalHits;
+    const int perfectCount = _perfectCount;
+    const int greatCount = _greatCount;
+    const int missCount = _missCount;
+    const int longPressComboCount = _longPressComboCount;
+    const double bottomTick = _lastBottomTick;
+    // reset会清掉歌曲时钟，不恢复的话按时间戳判定的按键在下一次同步时钟之前都不会被判定
+    const bool hasClock = _timeJudge.hasClock();
+    const double clockTick = _timeJudge.getClockTick();
+    const long long clockTimestamp = _timeJudge.getClockTimestamp();
+
+    setNotes(ys, lengths, pitches, ticks, count);
+
+    _combo = combo;
+    _maxCombo = maxCombo;
+    _totalHits = totalHits;
+    _perfectCount = perfectCount;
+    _greatCount = greatCount;
+    _missCount = missCount;
+    _longPressComboCount = longPressComboCount;
+    // LOGIC: 按滚动位置判定时窗口从空开始，下一次scrollTo只会跳过之前的音符；按时间判定要显式跳过，否则之前的音符全部算miss
+    _timeJudge.skipTo(bottomTick);
+    _lastBottomTick = bottomTick;
+    if (hasClock) {
+        _timeJudge.syncClock(clockTick, clockTimestamp);
+    }
+}
+
+void FollowJudgeCore::commitNotes() {
+    const int count = getNoteCount();
+    _judgeIndex.reset(count);
+    // 长按连击计分点只在加载时计算一次
+    _comboSchedule.clear();
+    _timeJudge.clear();
+    for (int i = 0; i < count; i++) {
+        _comboSchedule.addNote(_ys[i], _lengths[i], _longPressComboLength);
+        _timeJudge.addNote(_ticks[i], _pitches[i]);
+    }
+    reset();
+}
+
+int FollowJudgeCore::getNoteCount() const {
+    return (int)_ys.size();
+}
+
+float FollowJudgeCore::getNoteY(int note) const {
+    return _ys[note];
+}
+
+float FollowJudgeCore::getNoteLength(int note) const {
+    return _lengths[note];
+}
+
+int FollowJudgeCore::getNotePitch(int note) const {
+    return _pitches[note];
+}
+
+void FollowJudgeCore::setRanges(float perfectRange, float greatRange) {
+    _perfectRange = perfectRange;
+    _greatRange = greatRange;
+}
+
+void FollowJudgeCore::setJudgeLineOffset(float offset) {
+    _judgeLineOffset = offset;
+}
+
+void FollowJudgeCore::setLongPressComboLength(int length) {
+    _longPressComboLength = length;
+}
+
+void FollowJudgeCore::setJudgeMode(JudgeMode mode) {
+    if (_judgeMode != mode) {
+        _judgeMode = mode;
+        _judgeIndex.clear();
+        _timeJudge.reset();
+        _judgeWindowHead = 0;
+        _judgeWindowTail = 0;
+    }
+}
+
+FollowJudgeCore::JudgeMode FollowJudgeCore::getJudgeMode() const {
+    return _judgeMode;
+}
+
+FollowTimeJudge &FollowJudgeCore::getTimeJudge() {
+    return _timeJudge;
+}
+
+void FollowJudgeCore::reset() {
+    _judgeIndex.clear();
+    _timeJudge.reset();
+    _comboSchedule.releaseAllHeld();
+    _judgeWindowHead = 0;
+    _judgeWindowTail = 0;
+    _lastBottomTick = 0;
+    _events.clear();
+
+    _combo = 0;
+    _maxCombo = 0;
+    _totalHits = 0;
+    _perfectCount = 0;
+    _greatCount = 0;
+    _missCount = 0;
+    _longPressComboCount = 0;
+}
+
+void FollowJudgeCore::scrollTo(float bottomY) {
+    scrollTo(bottomY, bottomY * RATE_OF_TICK_LENGTH);
+}
+
+void FollowJudgeCore::scrollTo(float bottomY, double bottomTick) {
+    PROFILE_SCOPE("FollowJudgeCore::scrollTo");
+    _events.clear();
+    _lastBottomTick = bottomTick;
+    if (_judgeMode == kJudgeModeTime) {
+        sweepTimeJudge(bottomTick);
+    } else {
+        sweepJudgeWindow(bottomY);
+    }
+    advanceHeldNotes(bottomY);
+}
+
+int FollowJudgeCore::getEventCount() const {
+    return (int)_events.size();
+}
+
+const FollowJudgeEvent &FollowJudgeCore::getEvent(int index) const {
+    return _events[index];
+}
+
+// LOGIC: 音符已经按Y排好序，[_judgeWindowHead, _judgeWindowTail)是落在判定区域上下边界之间的音符。
+// 每帧只移动两个游标，处理进出判定窗口的音符，再对窗口内的少量音符重新划分区域。往回seek时游标反向移动即可。
+void FollowJudgeCore::sweepJudgeWindow(float bottomY) {
+    const int count = getNoteCount();
+    const float lowY = bottomY - _greatRange + _judgeLineOffset;
+    const float highY = bottomY + _greatRange + _judgeLineOffset;
+    const int oldHead = _judgeWindowHead;
+    const int oldTail = _judgeWindowTail;
+
+    int head = oldHead;
+    while (head < count && _ys[head] < lowY) {
+        head++;
+    }
+    while (head > 0 && _ys[head - 1] >= lowY) {
+        head--;
+    }
+
+    int tail = std::max(oldTail, head);
+    while (tail < count && _ys[tail] <= highY) {
+        tail++;
+    }
+    while (tail > head && _ys[tail - 1] > highY) {
+        tail--;
+    }
+
+    // 从下方离开判定窗口，只有从下方GREAT区域离开且未击中的算miss
+    for (int i = oldHead; i < std::min(oldTail, head); i++) {
+        if (_judgeIndex.moveTo(i, _pitches[i], FollowJudgeIndex::kZoneNone)) {
+            // TODO: 最后几个音符可能移动不到可以发出miss的区域
+            pushEvent(applyJudgement(i, kJudgementMiss, 0));
+        }
+    }
+
+    // 往回seek时从上方离开判定窗口，不算miss
+    for (int i = std::max(oldHead, tail); i < oldTail; i++) {
+        _judgeIndex.moveTo(i, _pitches[i], FollowJudgeIndex::kZoneNone);
+    }
+
+    // LOGIC: 窗口内音符较多时（密集的和弦、快速的段落）先批量划分区域，音符很少时直接逐个划分，省掉一次遍历
+    const int windowCount = tail - head;
+    const bool batched = windowCount >= kBatchClassifyCount;
+    if (batched) {
+        if ((int)_zones.size() < windowCount) {
+            _zones.resize(windowCount);
+        }
+        FollowJudgeIndex::classifyZones(&_ys[head], windowCount, bottomY, _judgeLineOffset, _perfectRange, _greatRange, &_zones[0]);
+    }
+    for (int i = head; i < tail; i++) {
+        const FollowJudgeIndex::Zone zone = batched ? (FollowJudgeIndex::Zone)_zones[i - head] : FollowJudgeIndex::classify((_ys[i] - bottomY) - _judgeLineOffset, _perfectRange, _greatRange);
+        // 只有区域变化的音符才需要更新索引
+        if (_judgeIndex.getZone(i) != zone) {
+            PROFILE_COUNT("judge.zoneTransitions", 1);
+            _judgeIndex.moveTo(i, _pitches[i], zone);
+        }
+    }
+    PROFILE_COUNT("judge.notesScanned", std::abs(head - oldHead) + std::abs(tail - oldTail) + (tail - head));
+
+    _judgeWindowHead = head;
+    _judgeWindowTail = tail;
+}
+
+// 按时间判定时，只在这里检查已经超出great窗口的音符
+void FollowJudgeCore::sweepTimeJudge(double bottomTick) {
+    int note = -1;
+    while (_timeJudge.popMissed(bottomTick, &note)) {
+        pushEvent(applyJudgement(note, kJudgementMiss, 0));
+    }
+}
+
+void FollowJudgeCore::advanceHeldNotes(float bottomY) {
+    int held = 0;
+    while (held < _comboSchedule.getHeldCount()) {
+        const int note = _comboSchedule.getHeldNote(held);
+        while (_comboSchedule.advanceHeld(held, bottomY)) {
+            _combo++;
+            _maxCombo = std::max(_maxCombo, _combo);
+            _longPressComboCount++;
+
+            FollowJudgeEvent event;
+            event.type = FollowJudgeEvent::kTypeLongPress;
+            event.note = note;
+            event.judgement = kJudgementPerfect;
+            event.distance = 0;
+            event.combo = _combo;
+            pushEvent(event);
+        }
+
+        // 已击中音符时值全部过去后，不再计算长按连击
+        if (_ys[note] + _lengths[note] < bottomY) {
+            _comboSchedule.releaseHeldAt(held);
+        } else {
+            held++;
+        }
+    }
+}
+
+FollowJudgeCore::Judgement FollowJudgeCore::getJudgement(FollowJudgeIndex::Zone zone) const {
+    return (zone == FollowJudgeIndex::kZonePerfect) ? kJudgementPerfect : kJudgementGreat;
+}
+
+// LOGIC: 音符起始点在perfect或great区域时对应琴键被按下，即算击中
+FollowJudgeEvent FollowJudgeCore::keyDown(int pitch, float bottomY) {
+    return keyDown(pitch, bottomY, bottomY * RATE_OF_TICK_LENGTH);
+}
+
+FollowJudgeEvent FollowJudgeCore::keyDown(int pitch, float bottomY, double bottomTick) {
+    if (_judgeMode == kJudgeModeTime) {
+        // 没有事件时间戳，只能用当前的滚动位置
+        int note = -1;
+        long long delta = 0;
+        FollowTimeJudge::Result result = _timeJudge.judgeAtTick(pitch, bottomTick, &note, &delta);
+        if (result == FollowTimeJudge::kResultNone) {
+            return applyJudgement(-1, kJudgementNone, 0);
+        }
+        _comboSchedule.hold(note);
+        return applyJudgement(note, result == FollowTimeJudge::kResultPerfect ? kJudgementPerfect : kJudgementGreat, fabs(_ys[note] - bottomY));
+    }
+
+    FollowJudgeIndex::Zone zone = FollowJudgeIndex::kZoneNone;
+    const int note = _judgeIndex.mark(pitch, &zone);
+    if (note < 0) {
+        return applyJudgement(-1, kJudgementNone, 0);
+    }
+    _comboSchedule.hold(note);
+    return applyJudgement(note, getJudgement(zone), fabs(_ys[note] - bottomY));
+}
+
+FollowJudgeEvent FollowJudgeCore::keyDownAtTime(int pitch, long long timestamp) {
+    int note = -1;
+    long long delta = 0;
+    FollowTimeJudge::Result result = FollowTimeJudge::kResultNone;
+    if (_judgeMode == kJudgeModeTime) {
+        result = _timeJudge.judge(pitch, timestamp, &note, &delta);
+    }
+    if (result == FollowTimeJudge::kResultNone) {
+        return applyJudgement(-1, kJudgementNone, 0);
+    }
+
+    _comboSchedule.hold(note);
+    // 换算成瀑布流上的像素距离，与按滚动位置判定的计分保持一致
+    const float distance = fabs(delta / _timeJudge.getMicrosecondsPerTick()) / RATE_OF_TICK_LENGTH;
+    return applyJudgement(note, result == FollowTimeJudge::kResultPerfect ? kJudgementPerfect : kJudgementGreat, distance);
+}
+
+void FollowJudgeCore::keyUp(int pitch, float bottomY) {
+    // 在连击计分点出基准线之前松开已击中音符对应琴键，不再计算长按连击
+    int held = 0;
+    while (held < _comboSchedule.getHeldCount()) {
+        const int note = _comboSchedule.getHeldNote(held);
+        if (_pitches[note] == pitch && _ys[note] + _lengths[note] > bottomY) {
+            _comboSchedule.releaseHeldAt(held);
+        } else {
+            held++;
+        }
+    }
+}
+
+FollowJudgeEvent FollowJudgeCore::applyJudgement(int note, Judgement judgement, float distance) {
+    FollowJudgeEvent event;
+    event.note = note;
+    event.judgement = judgement;
+    event.distance = distance;
+
+    switch (judgement) {
+        case kJudgementPerfect:
+        case kJudgementGreat:
+            event.type = FollowJudgeEvent::kTypeHit;
+            _combo++;
+            _totalHits++;
+            if (judgement == kJudgementPerfect) {
+                _perfectCount++;
+            } else {
+                _greatCount++;
+            }
+            break;
+        case kJudgementMiss:
+            event.type = FollowJudgeEvent::kTypeMiss;
+            _combo = 0;
+            _missCount++;
+            break;
+        default:
+            event.type = FollowJudgeEvent::kTypeNoMatch;
+            _combo = 0;
+            break;
+    }
+
+    _maxCombo = std::max(_maxCombo, _combo);
+    event.combo = _combo;
+    return event;
+}
+
+void FollowJudgeCore::pushEvent(const FollowJudgeEvent &event) {
+    _events.push_back(event);
+}
+
+int FollowJudgeCore::getCombo() const {
+    return _combo;
+}
+
+int FollowJudgeCore::getMaxCombo() const {
+    return _maxCombo;
+}
+
+int FollowJudgeCore::getTotalHits() const {
+    return _totalHits;
+}
+
+int FollowJudgeCore::getPerfectCount() const {
+    return _perfectCount;
+}
+
+int FollowJudgeCore::getGreatCount() const {
+    return _greatCount;
+}
+
+int FollowJudgeCore::getMissCount() const {
+    return _missCount;
+}
+
+int FollowJudgeCore::getLongPressComboCount() const {
+    return _longPressComboCount;
+}
+
+bool FollowJudgeCore::hasJudged() const {
+    return _perfectCount + _greatCount + _missCount + _longPressComboCount > 0;
+}
+
+int FollowJudgeCore::getLongPressPointCount() const {
+    return _comboSchedule.getPointCount();
+}
+
+int FollowJudgeCore::getRightRate(int totalNotes) const {
+    return totalNotes > 0 ? _totalHits * 100 / totalNotes : 0;
+}
+
+//计算时值得分
+int FollowJudgeCore::getDurationScore(int totalNotes, int maxLongComboCount) const {
+    const int allLongComboPoints = _perfectCount + _greatCount + _longPressComboCount;
+    const int maxLongComboPoints = maxLongComboCount + totalNotes;
+    return maxLongComboPoints > 0 ? allLongComboPoints * 100 / maxLongComboPoints : 0;
+}
+
+//计算节奏得分,getGreatRate() * weight +getPerfectRate() * (1 - weight)
+int FollowJudgeCore::getRhythmScore(int totalNotes, float weight) const {
+    if (totalNotes <= 0) {
+        return 0;
+    }
+    const int greatScore = _greatCount * 100 / totalNotes;
+    const int perfectScore = _perfectCount * 100 / totalNotes;
+    return greatScore * weight + perfectScore;
+}
+
+float FollowJudgeCore::getFinalScore(int totalNotes, int maxLongComboCount, float rightRatePercent, float durationPercent, float rhythmPercent) const {
+    return getRightRate(totalNotes) * rightRatePercent + getDurationScore(totalNotes, maxLongComboCount) * durationPercent + getRhythmScore(totalNotes, 0.5f) * rhythmPercent;
+}
@@ -0,0 +1,207 @@
+﻿#ifndef __FOLLOW_JUDGE_CORE_H__
+#define __FOLLOW_JUDGE_CORE_H__
+
+#include <vector>
+
+#include "FollowJudgeIndex.h"
+#include "FollowComboSchedule.h"
+#include "FollowTimeJudge.h"
+
+/**
+ * 判定核心产生的事件
+ */
+struct FollowJudgeEvent {
+    enum Type {
+        kTypeNone = 0,
+        kTypeHit,         // 按键击中音符
+        kTypeMiss,        // 音符没有被击中就离开了判定区域
+        kTypeLongPress,   // 按住的音符经过了一个长按连击计分点
+        kTypeNoMatch,     // 按键没有击中任何音符
+    };
+
+    Type type;
+    int note;         // 音符下标，kTypeNoMatch时为-1
+    int judgement;    // FollowJudgeCore::Judgement
+    float distance;   // 击中时与基准线的距离（像素）
+    int combo;        // 事件发生后的连击数
+};
+
+/**
+ * 跟弹判定核心
+ *
+ * 不依赖cocos2d的节点和渲染，只处理音符表、判定区域、连击和长按计分。
+ * FollowGameEngine把瀑布流元素转换成音符表后交给它处理，离线回放和基准测试也直接使用它。
+ * 所有坐标都是瀑布流上的像素，与时间成正比。按时间判定使用音符和滚动位置对应的MIDI tick，
+ * 不传tick时按6个tick为1个像素换算，只在没有变速时准确。
+ */
+class FollowJudgeCore {
+public:
+    enum Judgement {
+        kJudgementPerfect = 0,
+        kJudgementGreat,
+        kJudgementMiss,
+        kJudgementNone,
+    };
+
+    enum JudgeMode {
+        kJudgeModeScroll = 0,
+        kJudgeModeTime,
+    };
+
+    FollowJudgeCore();
+
+    /**
+     * 删除所有音符，之后按Y从小到大的顺序调用addNote，最后调用commitNotes
+     */
+    void clearNotes();
+
+    void addNote(float y, float length, int pitch);
+
+    /**
+     * @param tick 音符开始的tick，按时间判定时使用
+     */
+    void addNote(float y, float length, int pitch, int tick);
+
+    /**
+     * 音符添加完毕，计算长按连击计分点等加载时的数据
+     */
+    void commitNotes();
+
+    /**
+     * 用按列存放的音符表替换所有音符，相当于clearNotes、逐个addNote再commitNotes
+     * @param ticks 可以为nullptr，这时按Y换算
+     */
+    void setNotes(const float *ys, const float *lengths, const int *pitches, const int *ticks, int count);
+
+    /**
+     * 与setNotes相同，但保留连击、统计数据和歌曲时钟，从上一次scrollTo的位置继续判定，之前的音符不算miss
+     */
+    void replaceNotes(const float *ys, const float *lengths, const int *pitches, const int *ticks, int count);
+
+    int getNoteCount() const;
+
+    float getNoteY(int note) const;
+
+    float getNoteLength(int note) const;
+
+    int getNotePitch(int note) const;
+
+    void setRanges(float perfectRange, float greatRange);
+
+    void setJudgeLineOffset(float offset);
+
+    /**
+     * 一次长按连击的长度（像素），需要在commitNotes之前设置
+     */
+    void setLongPressComboLength(int length);
+
+    void setJudgeMode(JudgeMode mode);
+
+    JudgeMode getJudgeMode() const;
+
+    FollowTimeJudge &getTimeJudge();
+
+    /**
+     * 清除判定状态和统计数据，音符表保留
+     */
+    void reset();
+
+    /**
+     * 瀑布流滚动到bottomY，产生的事件通过getEventCount/getEvent获取
+     */
+    void scrollTo(float bottomY);
+
+    /**
+     * @param bottomTick bottomY对应的tick，按时间判定时使用
+     */
+    void scrollTo(float bottomY, double bottomTick);
+
+    int getEventCount() const;
+
+    const FollowJudgeEvent &getEvent(int index) const;
+
+    /**
+     * 在bottomY处按下pitch
+     */
+    FollowJudgeEvent keyDown(int pitch, float bottomY);
+
+    FollowJudgeEvent keyDown(int pitch, float bottomY, double bottomTick);
+
+    /**
+     * 按时间判定模式下，在timestamp（微秒）时按下pitch
+     */
+    FollowJudgeEvent keyDownAtTime(int pitch, long long timestamp);
+
+    void keyUp(int pitch, float bottomY);
+
+    int getCombo() const;
+
+    int getMaxCombo() const;
+
+    int getTotalHits() const;
+
+    int getPerfectCount() const;
+
+    int getGreatCount() const;
+
+    int getMissCount() const;
+
+    int getLongPressComboCount() const;
+
+    /**
+     * 是否已经判定过音符（击中、miss或长按连击）
+     */
+    bool hasJudged() const;
+
+    /**
+     * 所有音符的长按连击计分点数目
+     */
+    int getLongPressPointCount() const;
+
+    // 以下得分与FollowGameEngine中的同名方法一致，totalNotes为需要弹奏的音符总数
+    int getRightRate(int totalNotes) const;
+
+    int getDurationScore(int totalNotes, int maxLongComboCount) const;
+
+    int getRhythmScore(int totalNotes, float weight) const;
+
+    float getFinalScore(int totalNotes, int maxLongComboCount, float rightRatePercent, float durationPercent, float rhythmPercent) const;
+
+private:
+    void sweepJudgeWindow(float bottomY);
+    void sweepTimeJudge(double bottomTick);
+    void advanceHeldNotes(float bottomY);
+    FollowJudgeCore::Judgement getJudgement(FollowJudgeIndex::Zone zone) const;
+    FollowJudgeEvent applyJudgement(int note, Judgement judgement, float distance);
+    void pushEvent(const FollowJudgeEvent &event);
+
+    std::vector<float> _ys;
+    std::vector<float> _lengths;
+    std::vector<int> _pitches;
+    std::vector<int> _ticks;
+
+    FollowJudgeIndex _judgeIndex;
+    FollowComboSchedule _comboSchedule;
+    FollowTimeJudge _timeJudge;
+    int _judgeWindowHead;
+    int _judgeWindowTail;
+    double _lastBottomTick;
+    std::vector<FollowJudgeEvent> _events;
+    std::vector<unsigned char> _zones;    // 判定窗口内音符这一帧的区域
+
+    JudgeMode _judgeMode;
+    float _perfectRange;
+    float _greatRange;
+    float _judgeLineOffset;
+    int _longPressComboLength;
+
+    int _combo;
+    int _maxCombo;
+    int _totalHits;
+    int _perfectCount;
+    int _greatCount;
+    int _missCount;
+    int _longPressComboCount;
+};
+
+#endif // __FOLLOW_JUDGE_CORE_H__
@@ -0,0 +1,197 @@
+﻿#include "FollowJudgeIndex.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FOLLOW_JUDGE_SSE2 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FOLLOW_JUDGE_NEON 1
+#endif
+
+static bool isValidPitch(int pitch) {
+    return pitch >= 0 && pitch < FollowJudgeIndex::kPitchCount;
+}
+
+// 各区域边界的开闭与之前的判定保持一致
+FollowJudgeIndex::Zone FollowJudgeIndex::classify(float delta, float perfectRange, float greatRange) {
+    if (delta >= perfectRange && delta <= greatRange) {
+        return kZoneGreatTop;
+    } else if (delta > -perfectRange && delta < perfectRange) {
+        return kZonePerfect;
+    } else if (delta >= -greatRange && delta <= -perfectRange) {
+        return kZoneGreatBottom;
+    }
+    return kZoneNone;
+}
+
+// LOGIC: 三个区域各用一组比较得到掩码，再按greatTop、perfect、greatBottom的优先级选出区域，与classify的if顺序一致。
+// 4个音符一组，剩下不足4个的逐个处理。
+void FollowJudgeIndex::classifyZones(const float *ys, int count, float bottomY, float baselineOffset, float perfectRange, float greatRange, unsigned char *zones) {
+    int i = 0;
+#if defined(FOLLOW_JUDGE_SSE2)
+    const __m128 bottom = _mm_set1_ps(bottomY);
+    const __m128 offset = _mm_set1_ps(baselineOffset);
+    const __m128 perfect = _mm_set1_ps(perfectRange);
+    const __m128 negativePerfect = _mm_set1_ps(-perfectRange);
+    const __m128 great = _mm_set1_ps(greatRange);
+    const __m128 negativeGreat = _mm_set1_ps(-greatRange);
+    const __m128i greatTopZone = _mm_set1_epi32(kZoneGreatTop);
+    const __m128i perfectZone = _mm_set1_epi32(kZonePerfect);
+    const __m128i greatBottomZone = _mm_set1_epi32(kZoneGreatBottom);
+    for (; i + 4 <= count; i += 4) {
+        const __m128 delta = _mm_sub_ps(_mm_sub_ps(_mm_loadu_ps(ys + i), bottom), offset);
+        const __m128i inGreatTop = _mm_castps_si128(_mm_and_ps(_mm_cmpge_ps(delta, perfect), _mm_cmple_ps(delta, great)));
+        const __m128i inPerfect = _mm_castps_si128(_mm_and_ps(_mm_cmpgt_ps(delta, negativePerfect), _mm_cmplt_ps(delta, perfect)));
+        const __m128i inGreatBottom = _mm_castps_si128(_mm_and_ps(_mm_cmpge_ps(delta, negativeGreat), _mm_cmple_ps(delta, negativePerfect)));
+
+        __m128i zone = _mm_and_si128(inGreatBottom, greatBottomZone);
+        zone = _mm_or_si128(_mm_and_si128(inPerfect, perfectZone), _mm_andnot_si128(inPerfect, zone));
+        zone = _mm_or_si128(_mm_and_si128(inGreatTop, greatTopZone), _mm_andnot_si128(inGreatTop, zone));
+
+        __m128i packed = _mm_packs_epi32(zone, zone);
+        packed = _mm_packus_epi16(packed, packed);
+        const int bytes = _mm_cvtsi128_si32(packed);
+        memcpy(zones + i, &bytes, sizeof(bytes));
+    }
+#elif defined(FOLLOW_JUDGE_NEON)
+    const float32x4_t bottom = vdupq_n_f32(bottomY);
+    const float32x4_t offset = vdupq_n_f32(baselineOffset);
+    const float32x4_t perfect = vdupq_n_f32(perfectRange);
+    const float32x4_t negativePerfect = vdupq_n_f32(-perfectRange);
+    const float32x4_t great = vdupq_n_f32(greatRange);
+    const float32x4_t negativeGreat = vdupq_n_f32(-greatRange);
+    const uint32x4_t greatTopZone = vdupq_n_u32(kZoneGreatTop);
+    const uint32x4_t perfectZone = vdupq_n_u32(kZonePerfect);
+    const uint32x4_t greatBottomZone = vdupq_n_u32(kZoneGreatBottom);
+    for (; i + 4 <= count; i += 4) {
+        const float32x4_t delta = vsubq_f32(vsubq_f32(vld1q_f32(ys + i), bottom), offset);
+        const uint32x4_t inGreatTop = vandq_u32(vcgeq_f32(delta, perfect), vcleq_f32(delta, great));
+        const uint32x4_t inPerfect = vandq_u32(vcgtq_f32(delta, negativePerfect), vcltq_f32(delta, perfect));
+        const uint32x4_t inGreatBottom = vandq_u32(vcgeq_f32(delta, negativeGreat), vcleq_f32(delta, negativePerfect));
+
+        uint32x4_t zone = vandq_u32(inGreatBottom, greatBottomZone);
+        zone = vbslq_u32(inPerfect, perfectZone, zone);
+        zone = vbslq_u32(inGreatTop, greatTopZone, zone);
+
+        const uint16x4_t narrow = vmovn_u32(zone);
+        const uint8x8_t packed = vmovn_u16(vcombine_u16(narrow, narrow));
+        const uint32_t bytes = vget_lane_u32(vreinterpret_u32_u8(packed), 0);
+        memcpy(zones + i, &bytes, sizeof(bytes));
+    }
+#endif
+    for (; i < count; i++) {
+        zones[i] = (unsigned char)classify((ys[i] - bottomY) - baselineOffset, perfectRange, greatRange);
+    }
+}
+
+void FollowJudgeIndex::reset(int noteCount) {
+    _zones.assign(noteCount, kZoneNone);
+    _marked.assign(noteCount, 0);
+    for (int zone = 0; zone < kZoneCount; zone++) {
+        for (int pitch = 0; pitch < kPitchCount; pitch++) {
+            _pending[zone][pitch].clear();
+        }
+    }
+}
+
+void FollowJudgeIndex::clear() {
+    reset((int)_zones.size());
+}
+
+int FollowJudgeIndex::getNoteCount() const {
+    return (int)_zones.size();
+}
+
+FollowJudgeIndex::Zone FollowJudgeIndex::getZone(int note) const {
+    return (Zone)_zones[note];
+}
+
+bool FollowJudgeIndex::isMarked(int note) const {
+    return _marked[note] != 0;
+}
+
+bool FollowJudgeIndex::moveTo(int note, int pitch, Zone zone) {
+    const Zone prevZone = (Zone)_zones[note];
+    if (prevZone == zone) {
+        return false;
+    }
+
+    _zones[note] = zone;
+    if (prevZone == kZoneNone) {
+        // 重新进入判定区域的音符（包括往回seek的情况）都当作没有击中
+        _marked[note] = 0;
+    } else if (!_marked[note]) {
+        removePending(prevZone, pitch, note);
+    }
+
+    if (zone == kZoneNone) {
+        return prevZone == kZoneGreatBottom && !_marked[note];
+    }
+
+    if (!_marked[note]) {
+        addPending(zone, pitch, note);
+    }
+    return false;
+}
+
+int FollowJudgeIndex::mark(int pitch, Zone *zone) {
+    if (!isValidPitch(pitch)) {
+        return -1;
+    }
+
+    static const Zone sJudgeOrder[] = {kZoneGreatBottom, kZonePerfect, kZoneGreatTop};
+    for (int i = 0; i < (int)(sizeof(sJudgeOrder) / sizeof(sJudgeOrder[0])); i++) {
+        std::deque<int> &pending = _pending[sJudgeOrder[i]][pitch];
+        if (!pending.empty()) {
+            const int note = pending.front();
+            pending.pop_front();
+            _marked[note] = 1;
+            if (zone != nullptr) {
+                *zone = sJudgeOrder[i];
+            }
+            return note;
+        }
+    }
+    return -1;
+}
+
+void FollowJudgeIndex::addPending(Zone zone, int pitch, int note) {
+    if (!isValidPitch(pitch)) {
+        return;
+    }
+
+    // 正向滚动时音符总是从队尾进入，往回滚动时从队首进入
+    std::deque<int> &pending = _pending[zone][pitch];
+    if (pending.empty() || pending.back() < note) {
+        pending.push_back(note);
+    } else if (pending.front() > note) {
+        pending.push_front(note);
+    } else {
+        pending.insert(std::upper_bound(pending.begin(), pending.end(), note), note);
+    }
+}
+
+void FollowJudgeIndex::removePending(Zone zone, int pitch, int note) {
+    if (!isValidPitch(pitch)) {
+        return;
+    }
+
+    // 音符按顺序离开区域，绝大多数情况下就在队首或者队尾
+    std::deque<int> &pending = _pending[zone][pitch];
+    if (pending.empty()) {
+        return;
+    }
+    if (pending.front() == note) {
+        pending.pop_front();
+    } else if (pending.back() == note) {
+        pending.pop_back();
+    } else {
+        auto iter = std::lower_bound(pending.begin(), pending.end(), note);
+        if (iter != pending.end() && *iter == note) {
+            pending.erase(iter);
+        }
+    }
+}
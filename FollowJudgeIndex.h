@@ -0,0 +1,76 @@
+﻿#ifndef __FOLLOW_JUDGE_INDEX_H__
+#define __FOLLOW_JUDGE_INDEX_H__
+
+#include <deque>
+#include <vector>
+
+/**
+ * 跟弹判定索引
+ *
+ * 按pitch保存各判定区域内还没有被击中的音符，音符用其在Y排序后的元素列表中的下标表示。
+ * 同一个pitch的音符按下标（即时间）先后排列，所以按键时只需要看队首就能完成判定，
+ * 与判定区域内的音符总数无关。
+ */
+class FollowJudgeIndex {
+public:
+    enum Zone {
+        kZoneNone = 0,      // 不在判定区域内（还没到或者已经过去）
+        kZoneGreatTop,      // 基准线上方的great区域
+        kZonePerfect,       // perfect区域
+        kZoneGreatBottom,   // 基准线下方的great区域
+        kZoneCount,
+    };
+
+    static const int kPitchCount = 128;
+
+    /**
+     * 根据音符与基准线的距离delta确定所在的判定区域
+     */
+    static Zone classify(float delta, float perfectRange, float greatRange);
+
+    /**
+     * 对连续的count个音符批量执行classify，delta为(ys[i] - bottomY) - baselineOffset，结果写入zones。
+     * 有SSE2或NEON时一次处理4个音符，结果与逐个调用classify相同
+     */
+    static void classifyZones(const float *ys, int count, float bottomY, float baselineOffset, float perfectRange, float greatRange, unsigned char *zones);
+
+    /**
+     * 清空索引，并为noteCount个音符分配状态
+     */
+    void reset(int noteCount);
+
+    /**
+     * 所有音符回到kZoneNone，并清除击中标记
+     */
+    void clear();
+
+    int getNoteCount() const;
+
+    Zone getZone(int note) const;
+
+    bool isMarked(int note) const;
+
+    /**
+     * 把音符移动到zone区域，O(1)
+     * @return 音符从kZoneGreatBottom离开判定区域（移动到kZoneNone）时还没有被击中，返回true。
+     *         与原来的判定一致，从其他区域直接跳出判定区域的音符不算miss
+     */
+    bool moveTo(int note, int pitch, Zone zone);
+
+    /**
+     * 按kZoneGreatBottom、kZonePerfect、kZoneGreatTop的顺序找到pitch对应的最早的未击中音符并标记为击中
+     * @param zone 输出击中音符所在的区域，可以为nullptr
+     * @return 击中音符的下标，没有则返回-1
+     */
+    int mark(int pitch, Zone *zone);
+
+private:
+    void addPending(Zone zone, int pitch, int note);
+    void removePending(Zone zone, int pitch, int note);
+
+    std::vector<unsigned char> _zones;
+    std::vector<unsigned char> _marked;
+    std::deque<int> _pending[kZoneCount][kPitchCount];
+};
+
+#endif // __FOLLOW_JUDGE_INDEX_H__
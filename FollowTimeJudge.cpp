@@ -0,0 +1,215 @@
+﻿#include "FollowTimeJudge.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const double kMicrosecondsPerMinute = 60000000.0;
+
+FollowTimeJudge::FollowTimeJudge() : _expireCursor(0), _lastExpireUnits(0), _tempo(60), _ticksPerQuarter(480), _perfectWindow(0), _greatWindow(0), _hasClock(false), _clockUnits(0), _clockTimestamp(0) {
+    std::fill(_pitchCursors, _pitchCursors + kPitchCount, 0);
+    setTempoChanges(nullptr, nullptr, 0);
+}
+
+void FollowTimeJudge::clear() {
+    _ticks.clear();
+    _units.clear();
+    _marked.clear();
+    for (int i = 0; i < kPitchCount; i++) {
+        _pitchNotes[i].clear();
+    }
+    reset();
+}
+
+void FollowTimeJudge::addNote(int tick, int pitch) {
+    const int note = (int)_ticks.size();
+    _ticks.push_back(tick);
+    _units.push_back(tickToUnits(tick));
+    _marked.push_back(0);
+    if (pitch >= 0 && pitch < kPitchCount) {
+        _pitchNotes[pitch].push_back(note);
+    }
+}
+
+int FollowTimeJudge::getNoteCount() const {
+    return (int)_ticks.size();
+}
+
+void FollowTimeJudge::reset() {
+    std::fill(_marked.begin(), _marked.end(), 0);
+    std::fill(_pitchCursors, _pitchCursors + kPitchCount, 0);
+    _expireCursor = 0;
+    _lastExpireUnits = 0;
+    _hasClock = false;
+}
+
+void FollowTimeJudge::setTempo(float tempo, int ticksPerQuarter) {
+    if (tempo > 0 && ticksPerQuarter > 0) {
+        _tempo = tempo;
+        _ticksPerQuarter = ticksPerQuarter;
+    }
+}
+
+void FollowTimeJudge::setTempoChanges(const double *ticks, const double *microsecondsPerQuarter, int count) {
+    _segmentTicks.assign(1, 0);
+    _segmentUnits.assign(1, 0);
+    _segmentRatios.assign(1, 1);
+    const double firstMicroseconds = count > 0 && microsecondsPerQuarter[0] > 0 ? microsecondsPerQuarter[0] : 0;
+    for (int i = 1; i < count && firstMicroseconds > 0; i++) {
+        if (microsecondsPerQuarter[i] <= 0) {
+            continue;
+        }
+        const double tick = std::max(ticks[i], _segmentTicks.back());
+        const double units = _segmentUnits.back() + (tick - _segmentTicks.back()) * _segmentRatios.back();
+        const double ratio = microsecondsPerQuarter[i] / firstMicroseconds;
+        if (tick == _segmentTicks.back()) {
+            _segmentRatios.back() = ratio;
+        } else {
+            _segmentTicks.push_back(tick);
+            _segmentUnits.push_back(units);
+            _segmentRatios.push_back(ratio);
+        }
+    }
+    for (int i = 0; i < (int)_ticks.size(); i++) {
+        _units[i] = tickToUnits(_ticks[i]);
+    }
+}
+
+// 分段一般只有几个，直接二分查找；第一个分段之前按第一个速度算
+double FollowTimeJudge::tickToUnits(double tick) const {
+    const int segment = std::max(0, (int)(std::upper_bound(_segmentTicks.begin(), _segmentTicks.end(), tick) - _segmentTicks.begin()) - 1);
+    return _segmentUnits[segment] + (tick - _segmentTicks[segment]) * _segmentRatios[segment];
+}
+
+double FollowTimeJudge::unitsToTick(double units) const {
+    const int segment = std::max(0, (int)(std::upper_bound(_segmentUnits.begin(), _segmentUnits.end(), units) - _segmentUnits.begin()) - 1);
+    return _segmentTicks[segment] + (units - _segmentUnits[segment]) / _segmentRatios[segment];
+}
+
+void FollowTimeJudge::setWindows(long long perfectMicroseconds, long long greatMicroseconds) {
+    _perfectWindow = perfectMicroseconds;
+    _greatWindow = std::max(perfectMicroseconds, greatMicroseconds);
+}
+
+long long FollowTimeJudge::getPerfectWindow() const {
+    return _perfectWindow;
+}
+
+long long FollowTimeJudge::getGreatWindow() const {
+    return _greatWindow;
+}
+
+void FollowTimeJudge::syncClock(double tick, long long timestamp) {
+    _clockUnits = tickToUnits(tick);
+    _clockTimestamp = timestamp;
+    _hasClock = true;
+}
+
+bool FollowTimeJudge::hasClock() const {
+    return _hasClock;
+}
+
+double FollowTimeJudge::getClockTick() const {
+    return unitsToTick(_clockUnits);
+}
+
+long long FollowTimeJudge::getClockTimestamp() const {
+    return _clockTimestamp;
+}
+
+double FollowTimeJudge::getMicrosecondsPerTick() const {
+    return kMicrosecondsPerMinute / (_tempo * _ticksPerQuarter);
+}
+
+double FollowTimeJudge::getTickAt(long long timestamp) const {
+    return unitsToTick(_clockUnits + (timestamp - _clockTimestamp) / getMicrosecondsPerTick());
+}
+
+FollowTimeJudge::Result FollowTimeJudge::judge(int pitch, long long timestamp, int *note, long long *delta) {
+    if (!_hasClock) {
+        return kResultNone;
+    }
+    return judgeAtUnits(pitch, _clockUnits + (timestamp - _clockTimestamp) / getMicrosecondsPerTick(), note, delta);
+}
+
+FollowTimeJudge::Result FollowTimeJudge::judgeAtTick(int pitch, double tick, int *note, long long *delta) {
+    return judgeAtUnits(pitch, tickToUnits(tick), note, delta);
+}
+
+// LOGIC: 以下都在第一个速度下的tick上比较，与时间成正比，窗口用同一个换算系数
+FollowTimeJudge::Result FollowTimeJudge::judgeAtUnits(int pitch, double units, int *note, long long *delta) {
+    if (pitch < 0 || pitch >= kPitchCount) {
+        return kResultNone;
+    }
+
+    const double usPerTick = getMicrosecondsPerTick();
+    const double greatUnits = _greatWindow / usPerTick;
+    const std::vector<int> &notes = _pitchNotes[pitch];
+
+    // 早于great窗口的音符以后也不可能被击中了，游标直接跳过
+    int &cursor = _pitchCursors[pitch];
+    while (cursor < (int)notes.size() && _units[notes[cursor]] < units - greatUnits) {
+        cursor++;
+    }
+
+    for (int i = cursor; i < (int)notes.size() && _units[notes[i]] <= units + greatUnits; i++) {
+        const int candidate = notes[i];
+        if (!_marked[candidate]) {
+            _marked[candidate] = 1;
+            const long long deltaTime = (long long)((units - _units[candidate]) * usPerTick);
+            if (note != nullptr) {
+                *note = candidate;
+            }
+            if (delta != nullptr) {
+                *delta = deltaTime;
+            }
+            return std::llabs(deltaTime) < _perfectWindow ? kResultPerfect : kResultGreat;
+        }
+    }
+    return kResultNone;
+}
+
+bool FollowTimeJudge::popMissed(double tick, int *note) {
+    const double units = tickToUnits(tick);
+    const double greatUnits = _greatWindow / getMicrosecondsPerTick();
+    // LOGIC: 时钟或滚动位置可能往回抖动一帧，只有往回超过great窗口才当作seek处理，否则击中标记会被清掉，同一个音符可以再次击中
+    if (units < _lastExpireUnits - greatUnits) {
+        rewind(units);
+    }
+    _lastExpireUnits = std::max(_lastExpireUnits, units);
+
+    while (_expireCursor < (int)_units.size() && _units[_expireCursor] + greatUnits < units) {
+        const int expired = _expireCursor++;
+        if (!_marked[expired]) {
+            if (note != nullptr) {
+                *note = expired;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void FollowTimeJudge::skipTo(double tick) {
+    const double units = tickToUnits(tick);
+    const double greatUnits = _greatWindow / getMicrosecondsPerTick();
+    _expireCursor = (int)(std::lower_bound(_units.begin(), _units.end(), units - greatUnits) - _units.begin());
+    for (int i = 0; i < kPitchCount; i++) {
+        const std::vector<int> &notes = _pitchNotes[i];
+        _pitchCursors[i] = (int)(std::lower_bound(notes.begin(), notes.end(), _expireCursor) - notes.begin());
+    }
+    _lastExpireUnits = units;
+}
+
+// 往回seek后，判定窗口内已经击中的音符保留标记，与按滚动位置判定一致，只清除窗口之后的音符
+void FollowTimeJudge::rewind(double units) {
+    const double greatUnits = _greatWindow / getMicrosecondsPerTick();
+    const int from = (int)(std::lower_bound(_units.begin(), _units.end(), units - greatUnits) - _units.begin());
+    const int clearFrom = (int)(std::lower_bound(_units.begin(), _units.end(), units + greatUnits) - _units.begin());
+    _expireCursor = std::min(_expireCursor, from);
+    std::fill(_marked.begin() + clearFrom, _marked.end(), 0);
+    for (int i = 0; i < kPitchCount; i++) {
+        const std::vector<int> &notes = _pitchNotes[i];
+        _pitchCursors[i] = (int)(std::lower_bound(notes.begin(), notes.end(), _expireCursor) - notes.begin());
+    }
+    _lastExpireUnits = units;
+}
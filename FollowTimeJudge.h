@@ -0,0 +1,134 @@
+﻿#ifndef __FOLLOW_TIME_JUDGE_H__
+#define __FOLLOW_TIME_JUDGE_H__
+
+#include <vector>
+
+/**
+ * 按时间判定的跟弹判定器
+ *
+ * 不依赖瀑布流的滚动位置，而是用MIDI设备事件自带的时间戳，通过歌曲时钟换算成tick后与音符的起始tick比较。
+ * perfect和great都是以微秒为单位的时间窗口，与渲染帧率和布局无关。
+ * 曲子中途变速时，tick先按速度分段换算成第一个速度下的tick（与时间成正比，与瀑布流的Y一致）再比较。
+ */
+class FollowTimeJudge {
+public:
+    enum Result {
+        kResultNone = 0,
+        kResultPerfect,
+        kResultGreat,
+    };
+
+    static const int kPitchCount = 128;
+
+    FollowTimeJudge();
+
+    /**
+     * 删除所有音符
+     */
+    void clear();
+
+    /**
+     * 按时间顺序添加音符
+     */
+    void addNote(int tick, int pitch);
+
+    int getNoteCount() const;
+
+    /**
+     * 清除所有击中标记，从头开始判定
+     */
+    void reset();
+
+    /**
+     * @param tempo 第一个速度的段落当前演奏的速度（每分钟拍数）
+     */
+    void setTempo(float tempo, int ticksPerQuarter);
+
+    /**
+     * 曲子的速度变化，按tick排序，第一项是第一个速度。之后的分段按与第一个速度的比例换算，演奏速度由setTempo决定。
+     * 不设置时整首曲子按一个速度换算。音符已经添加时会重新换算
+     */
+    void setTempoChanges(const double *ticks, const double *microsecondsPerQuarter, int count);
+
+    void setWindows(long long perfectMicroseconds, long long greatMicroseconds);
+
+    long long getPerfectWindow() const;
+
+    long long getGreatWindow() const;
+
+    /**
+     * 同步歌曲时钟：timestamp（微秒）时歌曲播放到了tick
+     */
+    void syncClock(double tick, long long timestamp);
+
+    bool hasClock() const;
+
+    /**
+     * 上一次syncClock的tick和时间戳
+     */
+    double getClockTick() const;
+
+    long long getClockTimestamp() const;
+
+    /**
+     * 根据歌曲时钟计算timestamp时刻对应的tick
+     */
+    double getTickAt(long long timestamp) const;
+
+    /**
+     * 第一个速度下每个tick的微秒数
+     */
+    double getMicrosecondsPerTick() const;
+
+    /**
+     * 判定timestamp时刻按下的pitch，击中窗口内最早的未击中音符
+     * @param note 输出击中的音符下标
+     * @param delta 输出按键时间与音符时间的差值（微秒）
+     */
+    Result judge(int pitch, long long timestamp, int *note, long long *delta);
+
+    /**
+     * 与judge相同，但直接使用歌曲的tick，用于没有事件时间戳的输入
+     */
+    Result judgeAtTick(int pitch, double tick, int *note, long long *delta);
+
+    /**
+     * 取出一个在tick时已经超出great窗口但没有被击中的音符，需要循环调用直到返回false。
+     * tick比之前调用过的最大值小超过great窗口时（往回seek）会自动回退判定状态，更小的抖动忽略。
+     */
+    bool popMissed(double tick, int *note);
+
+    /**
+     * 从tick继续判定，之前已经超出great窗口的音符不再算miss。替换音符表后从当前位置继续时使用
+     */
+    void skipTo(double tick);
+
+private:
+    double tickToUnits(double tick) const;
+    double unitsToTick(double units) const;
+    Result judgeAtUnits(int pitch, double units, int *note, long long *delta);
+    void rewind(double units);
+
+    std::vector<int> _ticks;
+    std::vector<double> _units;            // 按音符，起始tick换算成第一个速度下的tick
+    std::vector<unsigned char> _marked;
+    std::vector<int> _pitchNotes[kPitchCount];
+    int _pitchCursors[kPitchCount];
+    int _expireCursor;
+    double _lastExpireUnits;
+
+    std::vector<double> _segmentTicks;     // 速度分段的起点tick
+    std::vector<double> _segmentUnits;     // 分段起点换算成第一个速度下的tick
+    std::vector<double> _segmentRatios;    // 分段里每个tick相当于第一个速度下的tick数
+
+    float _tempo;
+    int _ticksPerQuarter;
+    long long _perfectWindow;
+    long long _greatWindow;
+
+    bool _hasClock;
+    double _clockUnits;
+    long long _clockTimestamp;
+};
+
+#endif // __FOLLOW_TIME_JUDGE_H__
@@ -0,0 +1,29 @@
+﻿#include "GameScoreTable.h"
+
+GameScoreTable::GameScoreTable() {
+    invalidate();
+}
+
+void GameScoreTable::invalidate() {
+    _prefixSums.clear();
+    _prefixSums.push_back(0);
+}
+
+int GameScoreTable::getSize() const {
+    return (int)_prefixSums.size() - 1;
+}
+
+void GameScoreTable::append(int score) {
+    _prefixSums.push_back(_prefixSums.back() + score);
+}
+
+long long GameScoreTable::getSum(int count) const {
+    if (count <= 0) {
+        return 0;
+    }
+    return _prefixSums[count < getSize() ? count : getSize()];
+}
+
+long long GameScoreTable::getSum(int from, int to) const {
+    return to > from ? getSum(to) - getSum(from) : 0;
+}
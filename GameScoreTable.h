@@ -0,0 +1,46 @@
+﻿#ifndef __GAME_SCORE_TABLE_H__
+#define __GAME_SCORE_TABLE_H__
+
+#include <vector>
+
+/**
+ * 满分表
+ *
+ * 按连击数保存全部perfect时的得分前缀和，第i项是连击数1~i的得分总和。
+ * 得分只和计分策略、判定范围以及连击数有关，与曲目无关，所以只在策略或判定范围变化时失效，
+ * 需要更多项时在末尾追加即可，查询总分和剩余可得分都是O(1)。
+ */
+class GameScoreTable {
+public:
+    GameScoreTable();
+
+    /**
+     * 清空已计算的得分，计分策略或判定范围变化后调用
+     */
+    void invalidate();
+
+    /**
+     * 已经计算了得分的连击数
+     */
+    int getSize() const;
+
+    /**
+     * 追加连击数为getSize()+1时的得分
+     */
+    void append(int score);
+
+    /**
+     * 连击数1~count的得分总和，count不能超过getSize()
+     */
+    long long getSum(int count) const;
+
+    /**
+     * 连击数from+1~to的得分总和
+     */
+    long long getSum(int from, int to) const;
+
+private:
+    std::vector<long long> _prefixSums;
+};
+
+#endif // __GAME_SCORE_TABLE_H__
@@ -0,0 +1,136 @@
+local KeyLightManager = class("KeyLightManager")
+
+local schedule = cc.Director:getInstance():getScheduler()
+
+--[[
+@brief 键盘灯的状态管理
+       记录每个音高应该亮什么灯和已经发给键盘的灯，每帧最多发送一次，只发送两者不同的音高。
+       同一个音高上重叠的音符各算一次，最后一个松开时才熄灭
+@param device 可选，默认为MidiDevice:getInstance()
+--]]
+function KeyLightManager:ctor(device)
+    self._device  = device or MidiDevice:getInstance()
+    self._holds   = {}    -- [pitch] = {indicatorType, ...} 正在按住的音符，按按下的顺序
+    self._sent    = {}    -- [pitch] = indicatorType 已经发给键盘的灯，熄灭的为nil
+    self._sentCount = 0   -- 已经点亮的灯的数目
+    self._dirty   = {}    -- [pitch] = true 这一帧改变过的音高
+    self._enabled = true
+    self._scheduleId = schedule:scheduleScriptFunc(function(dt)
+        self:flush()
+    end, 0, false)
+end
+
+function KeyLightManager:release()
+    if self._scheduleId then
+        schedule:unscheduleScriptEntry(self._scheduleId)
+        self._scheduleId = nil
+    end
+end
+
+function KeyLightManager:noteOn(pitch, indicatorType)
+    local holds = self._holds[pitch]
+    if not holds then
+        holds = {}
+        self._holds[pitch] = holds
+    end
+    table.insert(holds, indicatorType)
+    self._dirty[pitch] = true
+end
+
+function KeyLightManager:noteOff(pitch, indicatorType)
+    local holds = self._holds[pitch]
+    if not holds or #holds == 0 then return end
+    -- 重叠的音符不一定按按下的顺序松开，优先去掉同一种灯的那个
+    local pos = 1
+    for i = #holds, 1, -1 do
+        if holds[i] == indicatorType then
+            pos = i
+            break
+        end
+    end
+    table.remove(holds, pos)
+    self._dirty[pitch] = true
+end
+
+--[[
+@brief 关闭时所有灯熄灭，但仍然记录按住的音符，打开时直接恢复
+--]]
+function KeyLightManager:setEnabled(enabled)
+    if self._enabled == enabled then return end
+    self._enabled = enabled
+    for pitch in pairs(self._holds) do
+        self._dirty[pitch] = true
+    end
+    for pitch in pairs(self._sent) do
+        self._dirty[pitch] = true
+    end
+end
+
+function KeyLightManager:isEnabled()
+    return self._enabled
+end
+
+--[[
+@brief 清除所有按住的音符并立即熄灭所有灯
+--]]
+function KeyLightManager:reset()
+    self._holds = {}
+    self._sent = {}
+    self._sentCount = 0
+    self._dirty = {}
+    self._device:turnOffAllLights()
+end
+
+function KeyLightManager:getWantedLight(pitch)
+    if not self._enabled then return nil end
+    local holds = self._holds[pitch]
+    return holds and holds[#holds]
+end
+
+-- LOGIC: 先算出要熄灭和要点亮（或换颜色）的音高。需要熄灭的多于之后仍然亮着的时候，
+-- 全部熄灭再重新点亮需要的消息更少，比如和弦结束或关闭灯光时只需要一条消息
+function KeyLightManager:flush()
+    if not next(self._dirty) then return end
+
+    local sent = self._sent
+    local offs, ons = {}, {}
+    for pitch in pairs(self._dirty) do
+        local wanted = self:getWantedLight(pitch)
+        local current = sent[pitch]
+        if wanted ~= current then
+            if wanted then
+                table.insert(ons, pitch)
+                if not current then
+                    self._sentCount = self._sentCount + 1
+                end
+            else
+                table.insert(offs, pitch)
+                self._sentCount = self._sentCount - 1
+            end
+            sent[pitch] = wanted
+        end
+        local holds = self._holds[pitch]
+        if holds and #holds == 0 then
+            self._holds[pitch] = nil
+        end
+    end
+    self._dirty = {}
+
+    local device = self._device
+    if #offs > 0 and 1 + self._sentCount < #offs + #ons then
+        device:turnOffAllLights()
+        for pitch, indicatorType in pairs(sent) do
+            device:turnOnLight(pitch, indicatorType)
+        end
+        return
+    end
+
+    for _, pitch in ipairs(offs) do
+        device:turnOffLight(pitch)
+    end
+    for _, pitch in ipairs(ons) do
+        device:turnOnLight(pitch, sent[pitch])
+    end
+end
+
+return KeyLightManager
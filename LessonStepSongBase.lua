@@ -681,7 +681,14 @@ end
 
 --根据参数调整下落精灵的坐标
 function LessonStepSongBase:adjustFallElementPos(isShowKeyboard)
-    local eleList = self._waterfallLayer:getFallElements()
+    -- 瀑布流只为可见范围内的音符绑定精灵，需要按pitch设置x坐标，之后绑定的精灵也会用这个坐标
+    local waterfallLayer = self._waterfallLayer
+    local setPitchX = nil
+    if waterfallLayer.setPitchPositionX then
+        setPitchX = function(pitch, x) waterfallLayer:setPitchPositionX(pitch, x) end
+    end
+
+    local eleList = waterfallLayer:getFallElements()
     if self._isHaveVideo and not isShowKeyboard then
         local lessonIndex = LessonStepManager.getStepLessonIndex()
         local videoDataPath = LessonManager.getLessonVideoDataConfigByIndex(lessonIndex)
@@ -691,6 +698,15 @@ function LessonStepSongBase:adjustFallElementPos(isShowKeyboard)
         if KBHLPolygon then
             local scale = DESIGN_SIZE_WIDTH / KBHLPolygon.width
             local startPitch = self._KBHLNode._startPitch - 1
+            if setPitchX then
+                for pitch = self._keyboard:getStartPitch(), self._keyboard:getEndPitch() do
+                    local p = KBHLPolygon[pitch - startPitch]
+                    if p then
+                        setPitchX(pitch, (p[1].x + (p[4].x - p[1].x) / 2) * scale)
+                    end
+                end
+                return
+            end
             for k, v in ipairs(eleList) do
                 local p = KBHLPolygon[v:getPitch() - startPitch]
                 local realX = (p[1].x + (p[4].x - p[1].x) / 2) * scale
@@ -698,6 +714,13 @@ function LessonStepSongBase:adjustFallElementPos(isShowKeyboard)
             end
         end
     else
+        if setPitchX then
+            for pitch = self._keyboard:getStartPitch(), self._keyboard:getEndPitch() do
+                local rect = self._keyboard:getKeyRect(pitch)
+                setPitchX(pitch, rect.x + rect.width / 2)
+            end
+            return
+        end
         for k, v in ipairs(eleList) do
             local rect = self._keyboard:getKeyRect(v:getPitch())
             v:setPositionX(rect.x + rect.width / 2)
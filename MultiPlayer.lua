@@ -122,6 +122,16 @@ function MultiPlayer:release()
     -- release playerCore
     self.playerCore:release()
     self.playerCore = nil
+    -- release tempo map
+    if self.tempoMap then
+        self.tempoMap:release()
+        self.tempoMap = nil
+    end
+    -- release compiled song
+    if self.compiledSong then
+        self.compiledSong:release()
+        self.compiledSong = nil
+    end
     -- release midi (auto)
     -- release xml
     self.musicXml:release()
@@ -135,6 +145,8 @@ function MultiPlayer:initMidiData()
     self.musicXml = MusicXmlLoader:loadFromFile(self.config.xmlFile, isXml)
     self.musicXml:retain()
     self.midi = MidiLoader:loadFromXMLData(self.musicXml)
+    self:initCompiledSong()
+    self:initTempoMap()
 
     self.section = {}
     self.section.startTime = 0
@@ -147,9 +159,57 @@ function MultiPlayer:initMidiData()
     self:resetNodeData()
 end
 
+-- 预编译的曲子（导出了CompiledSong时）：第一次打开时生成缓存，之后直接映射缓存文件，瀑布流不用再配对midi事件
+function MultiPlayer:initCompiledSong()
+    local CompiledSong = rawget(_G, "CompiledSong")
+    if not CompiledSong then return end
+    local xmlFile = self.config.xmlFile
+    local song = CompiledSong:createFromCache(xmlFile) or CompiledSong:createFromMidi(self.midi, xmlFile)
+    if song then
+        song:retain()
+        self.compiledSong = song
+    end
+end
+
+-- 速度表（导出了TempoMap时）：每首曲子建一次，进度更新时的时间、tick、小节和拍子都用它换算
+function MultiPlayer:initTempoMap()
+    local tempoMap = nil
+    if self.compiledSong then
+        tempoMap = self.compiledSong:getTempoMap()
+    else
+        local TempoMap = rawget(_G, "TempoMap")
+        tempoMap = TempoMap and TempoMap:createWithMidi(self.midi)
+    end
+    if tempoMap then
+        tempoMap:retain()
+        self.tempoMap = tempoMap
+    end
+end
+
+function MultiPlayer:time2tick(time)
+    if self.tempoMap then
+        return self.tempoMap:secondsToTick(time)
+    end
+    return mu.time2tick(self.midi, time)
+end
+
+function MultiPlayer:time2Measure(time)
+    if self.tempoMap then
+        return self.tempoMap:secondsToMeasure(time)
+    end
+    return mu.time2Measure(self.midi, time)
+end
+
+function MultiPlayer:time2Beat(time)
+    if self.tempoMap then
+        return self.tempoMap:secondsToBeat(time)
+    end
+    return mu.time2Beat(self.midi, time)
+end
+
 function MultiPlayer:resetNodeData()
-    local startTick = mu.time2tick(self.midi, self.section.startTime)
-    local endTick = mu.time2tick(self.midi, self.section.endTime)
+    local startTick = self:time2tick(self.section.startTime)
+    local endTick = self:time2tick(self.section.endTime)
     self.midiNoteData = mu.calcNodeData(self.midi, self.hand, startTick, endTick)
 end
 
@@ -167,7 +227,7 @@ end
 
 function MultiPlayer:initWaterfall()
     Log.d("MultiPlayer: initWaterfall")
-    self.waterfallLayer = require("layers.WaterfallLayer"):create(self.midi, self.config.waterfallConfig)
+    self.waterfallLayer = require("layers.WaterfallLayer"):create(self.midi, self.config.waterfallConfig, self.compiledSong)
     self.waterfallLayer:setController(self)
     if self.viewMode ~= VIEW_MODE.WATERFALL then
         self.waterfallLayer:setVisible(false)
@@ -334,7 +394,7 @@ function MultiPlayer:initInputEventHandler()
         [WANAKA_MULTI_PLAYER_INPUT_EVENT.PROGRESS] = function (time)
             -- Log.d("INPUT_EVENT.PROGRESS:%f", time)
             self:setCurrentTime(time)
-            local measure = mu.time2Measure(self.midi, self:getCurrentTime())
+            local measure = self:time2Measure(self:getCurrentTime())
             if self.lastMeasure ~= measure then
                 self.lastMeasure = measure
                 self:onMeasure()
@@ -554,7 +614,7 @@ function MultiPlayer:onBeat()
 end
 
 function MultiPlayer:updateBeat(passedTime)
-    local beat = mu.time2Beat(self.midi, passedTime)
+    local beat = self:time2Beat(passedTime)
     if self.lastBeat ~= beat and beat > 0 then
         self.lastBeat = beat
         self:onBeat()
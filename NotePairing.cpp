@@ -0,0 +1,60 @@
+﻿#include "NotePairing.h"
+
+#include <algorithm>
+
+NotePairing::NotePairing() : _pairedCount(0) {
+    std::fill(_pendingHeads, _pendingHeads + kPitchCount, 0);
+}
+
+void NotePairing::clear() {
+    for (int i = 0; i < kPitchCount; i++) {
+        _pending[i].clear();
+        _pendingHeads[i] = 0;
+    }
+    _offOrders.clear();
+    _pairedCount = 0;
+}
+
+int NotePairing::noteOn(int pitch) {
+    if (pitch < 0 || pitch >= kPitchCount) {
+        return -1;
+    }
+    const int note = (int)_offOrders.size();
+    _pending[pitch].push_back(note);
+    _offOrders.push_back(-1);
+    return note;
+}
+
+int NotePairing::noteOff(int pitch) {
+    if (pitch < 0 || pitch >= kPitchCount || _pendingHeads[pitch] >= (int)_pending[pitch].size()) {
+        return -1;
+    }
+    const int note = _pending[pitch][_pendingHeads[pitch]++];
+    _offOrders[note] = _pairedCount++;
+    return note;
+}
+
+int NotePairing::getNoteOnCount() const {
+    return (int)_offOrders.size();
+}
+
+int NotePairing::getPairedCount() const {
+    return _pairedCount;
+}
+
+// LOGIC: 去掉没有配对的note on，keys已经按note on的顺序不减，只需要对key相同的一小段按note off的先后做插入排序
+void NotePairing::getPairedNotes(const std::vector<int> &keys, std::vector<int> *notes) const {
+    notes->clear();
+    notes->reserve(_pairedCount);
+    for (int i = 0; i < (int)_offOrders.size(); i++) {
+        if (_offOrders[i] < 0) {
+            continue;
+        }
+        int k = (int)notes->size();
+        notes->push_back(i);
+        while (k > 0 && keys[(*notes)[k - 1]] == keys[(*notes)[k]] && _offOrders[(*notes)[k - 1]] > _offOrders[(*notes)[k]]) {
+            std::swap((*notes)[k - 1], (*notes)[k]);
+            k--;
+        }
+    }
+}
@@ -0,0 +1,48 @@
+﻿#ifndef __NOTE_PAIRING_H__
+#define __NOTE_PAIRING_H__
+
+#include <vector>
+
+/**
+ * 音符配对
+ *
+ * 一个音轨内note off配对同pitch最早的还没配对的note on（每个pitch一个FIFO），O(N)。
+ * 瀑布流、预编译的曲子和离线回放工具都用它配对，同一首曲子得到的音符表相同。
+ * 不依赖cocos2d，每个音轨用一个。
+ */
+class NotePairing {
+public:
+    static const int kPitchCount = 128;
+
+    NotePairing();
+
+    void clear();
+
+    /**
+     * 记录一个note on，返回它的编号（按note on的先后从0开始），pitch无效时返回-1
+     */
+    int noteOn(int pitch);
+
+    /**
+     * 返回配对到的note on的编号，没有可以配对的note on时返回-1
+     */
+    int noteOff(int pitch);
+
+    int getNoteOnCount() const;
+
+    int getPairedCount() const;
+
+    /**
+     * 已经配对的note on编号，按keys从小到大排列，key相同时按note off的先后排列
+     * @param keys 每个note on的排序值（Y或者tick），按note on的顺序不减
+     */
+    void getPairedNotes(const std::vector<int> &keys, std::vector<int> *notes) const;
+
+private:
+    std::vector<int> _pending[kPitchCount];
+    int _pendingHeads[kPitchCount];
+    std::vector<int> _offOrders;    // 每个note on配对的note off的序号，没有配对时为-1
+    int _pairedCount;
+};
+
+#endif // __NOTE_PAIRING_H__
@@ -17,13 +17,29 @@ function PlayerCore:ctor(midi, hitRadius, hitRank, hand, playMode)
     self:initPlayEngine()
 
     self.autoPlayEvents = {}
-    -- 记录已经亮灯的pitch, 用于当关闭灯再打开的时候能正确显示
-    self._lightOnEvents = {}
+    -- 导出了AutoPlayScheduler时由它按到期时间保存自动弹奏的按键
+    local AutoPlayScheduler = rawget(_G, "AutoPlayScheduler")
+    if AutoPlayScheduler then
+        self.autoPlayScheduler = AutoPlayScheduler:create()
+        self.autoPlayScheduler:retain()
+    end
+    -- 关闭灯光时也记录按住的音符，再打开时能正确显示
+    self.lightManager = require("KeyLightManager").new()
 end
 
 function PlayerCore:release()
+    self:unscheduleAutoPlaySchedule()
+    if self.judgeDriver then
+        self.judgeDriver:release()
+        self.judgeDriver = nil
+    end
     self.midiPlayer:release()
     self.playEngine:release()
+    self.lightManager:release()
+    if self.autoPlayScheduler then
+        self.autoPlayScheduler:release()
+        self.autoPlayScheduler = nil
+    end
 end
 
 -------------------- init --------------------\\
@@ -47,9 +63,7 @@ function PlayerCore:initMidiPlayer()
             if enableAutoPlay then
                 self:addAutoPlayEvent(event)
             end
-            if self.controller.light then
-                self:changeLight(event)
-            end
+            self:changeLight(event)
         end,
         [MIDI_PLAYER_EVENT.EVENT_REST]    = function (midiPlayer, event)
             self:sendEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.EVENT_REST, event)
@@ -61,14 +75,17 @@ function PlayerCore:initMidiPlayer()
         -- [MIDI_PLAYER_EVENT.STOP]          = function (midiPlayer) end,
         -- [MIDI_PLAYER_EVENT.EVENT_CHANNEL] = function (midiPlayer) end,
         -- [MIDI_PLAYER_EVENT.BEAT]          = function (midiPlayer) self:sendEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.BEAT) end,
-        [MIDI_PLAYER_EVENT.UPDATE]           = function (midiPlayer)
-            self:onPlayUpdate()
-        end,
         [MIDI_PLAYER_EVENT.END]              = function (midiPlayer)
             self:sendEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.MIDI_END)
         end,
 
     }
+    -- 导出了StepJudgeDriver时每次更新由它在C++里判定，不注册Lua的UPDATE回调
+    if not rawget(_G, "StepJudgeDriver") then
+        midiPlayerCallback[MIDI_PLAYER_EVENT.UPDATE] = function (midiPlayer)
+            self:onPlayUpdate()
+        end
+    end
     self.midiPlayer = MidiPlayerForLua:create(self.midi, true)
     self.midiPlayer:retain()
     self.midiPlayer:addCallback(function(eventType, ...)
@@ -123,14 +140,25 @@ function PlayerCore:initPlayEngine()
             self:sendEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.ENGINE_RESULT_PASS, pitchEvent)
         end,
     }
+    self.playEngineEventHandler = playEngineEventHandler
     self.playEngine = StepPlayEngine:create(self.midi)
     self.playEngine:retain()
-    self.playEngine:setCallback(function(pitchEvent, ret, deltaTime, comboStep, tiedNoteIndex)
-        if playEngineEventHandler[ret] then
-            -- print("<EngineEventHandler>", testGetKey(PLAY_ENGINE_RESULT, ret))
-            playEngineEventHandler[ret](pitchEvent, deltaTime, comboStep, tiedNoteIndex)
-        end
-    end)
+    -- 导出了StepJudgeDriver时由它在C++里驱动判定，产生结果的那次更新或按键结束时整批交给Lua
+    local StepJudgeDriver = rawget(_G, "StepJudgeDriver")
+    if StepJudgeDriver then
+        self.judgeDriver = StepJudgeDriver:create(self.midiPlayer, self.playEngine)
+        self.judgeDriver:retain()
+        self.judgeDriver:setResultCallback(function()
+            self:dispatchJudgeResults()
+        end)
+    else
+        self.playEngine:setCallback(function(pitchEvent, ret, deltaTime, comboStep, tiedNoteIndex)
+            if playEngineEventHandler[ret] then
+                -- print("<EngineEventHandler>", testGetKey(PLAY_ENGINE_RESULT, ret))
+                playEngineEventHandler[ret](pitchEvent, deltaTime, comboStep, tiedNoteIndex)
+            end
+        end)
+    end
     self.playEngine:setHitTimeRadius(self.hitRadius)
     -- playEngine arg: 左手：0 右手：1 双手：2
     local engineHand
@@ -165,7 +193,11 @@ function PlayerCore:setController(controller)
         end,
         [WANAKA_MULTI_PLAYER_OUTPUT_EVENT.RESUME] = function( ... )
             self.midiPlayer:setNextUpdateIsSeeking()
-        end
+        end,
+        [WANAKA_MULTI_PLAYER_OUTPUT_EVENT.CONFIG_CHANGED_SECTION] = function (section)
+            self.judgeStartTick = nil
+            self:updateJudgeStartTick()
+        end,
     }
     controller:addEventHandler(function (event, ...)
         if eventsHandle[event] then
@@ -177,6 +209,8 @@ function PlayerCore:setController(controller)
         return self.controller:getCurrentTime()
     end)
     self.controller = controller
+    self.lightManager:setEnabled(controller.light and true or false)
+    self:updateJudgeStartTick()
 end
 
 -------------------- input --------------------//
@@ -201,12 +235,23 @@ function PlayerCore:reset()
 
     self:unscheduleAutoPlaySchedule()
     self.autoPlayEvents = {}
-    self:closeAllLight()
-    self._lightOnEvents = {}
+    if self.autoPlayScheduler then
+        self.autoPlayScheduler:clear()
+    end
+    self.lightManager:reset()
+end
+
+-- 控制器有速度表时用速度表换算
+function PlayerCore:time2tick(time)
+    local tempoMap = self.controller and self.controller.tempoMap
+    if tempoMap then
+        return tempoMap:secondsToTick(time)
+    end
+    return mu.time2tick(self.midi, time)
 end
 
 function PlayerCore:seek(time)
-    local tick = mu.time2tick(self.midi, time)
+    local tick = self:time2tick(time)
     self.midiPlayer:setNextUpdateIsSeeking()
     self.playData:seek(tick)
     self.playEngine:reset()
@@ -216,35 +261,65 @@ function PlayerCore:onPlayEnd()
     self.midiPlayer:setNextUpdateIsSeeking()
 end
 
--- 是否需要判定
-function PlayerCore:needJudge()
-    local tick = self.midiPlayer:getCurrentTick()
-    local section = self.controller.section
-    if section.prepareTime > 0 then
-        -- 在准备阶段不判定
-        local startTick = mu.time2tick(self.midi, section.startTime)
-        if tick >= startTick then
-            return true
+-- 开始判定的tick，在准备阶段不判定。只在段落改变后算一次
+function PlayerCore:getJudgeStartTick()
+    if not self.judgeStartTick then
+        local section = self.controller.section
+        if section.prepareTime > 0 then
+            self.judgeStartTick = self:time2tick(section.startTime)
         else
-            return false
+            self.judgeStartTick = -math.huge
         end
-    else
-        return true
     end
+    return self.judgeStartTick
+end
+
+-- 有原生驱动时判定起点在设置控制器和段落改变时直接交给它，之后的更新和按键马上按新的起点判定
+function PlayerCore:updateJudgeStartTick()
+    if self.judgeDriver then
+        self.judgeDriver:setJudgeStartTick(self:getJudgeStartTick())
+    end
+end
+
+-- 是否需要判定
+function PlayerCore:needJudge(tick)
+    return (tick or self.midiPlayer:getCurrentTick()) >= self:getJudgeStartTick()
 end
 
+-- LOGIC: 每次midi更新都会调用，当前tick只取一次，同时用于判断和判定
 function PlayerCore:onPlayUpdate()
-    if self:needJudge() then
-        self.playEngine:midiUpdate(self.midiPlayer:getCurrentTick())
+    local tick = self.midiPlayer:getCurrentTick()
+    if self:needJudge(tick) then
+        self.playEngine:midiUpdate(tick)
     end
 end
 
 function PlayerCore:handleInput(pitch, velocity)
-    if self:needJudge() then
+    if self.judgeDriver then
+        self.judgeDriver:onMidiNoteReceived(pitch, velocity)
+    elseif self:needJudge() then
         self.playEngine:onMidiNoteReceived(pitch, velocity)
     end
 end
 
+-- LOGIC: 原生驱动的结果回调，按产生的顺序交给原来的处理函数。
+-- 在产生结果的那次更新或按键里调用，与同步回调一样不晚一帧，WAIT模式的暂停和继续时机不变
+function PlayerCore:dispatchJudgeResults()
+    local driver = self.judgeDriver
+    if not driver or driver:getPendingCount() == 0 then return end
+
+    local results = driver:popResults()
+    local handler = self.playEngineEventHandler
+    local index = 0
+    for k = 1, #results, 4 do
+        local f = handler[results[k]]
+        if f then
+            f(driver:getResultEvent(index), results[k + 1], results[k + 2], results[k + 3])
+        end
+        index = index + 1
+    end
+end
+
 function PlayerCore:getPoint()
     return self.playData:getPoint()
 end
@@ -257,21 +332,34 @@ function PlayerCore:getHitRank(hitDeviation)
     end
 end
 
+-- 每帧发出所有已经到期的按键，和弦的几个音符在同一帧里一起按下
 function PlayerCore:autoPlay()
-    for i = 1, #self.autoPlayEvents do
-        local event = self.autoPlayEvents[i]
-        if UtilsWanakaFramework:getUnixTimestamp() > event.currentTime + event.delayTime then
+    local controller = self.controller
+    local inputEvent = WANAKA_MULTI_PLAYER_INPUT_EVENT.INPUT
+    if self.autoPlayScheduler then
+        local due = self.autoPlayScheduler:popDue()
+        for k = 1, #due, 3 do
+            controller:handleEvent(inputEvent, due[k], due[k + 1])
+        end
+        return
+    end
+
+    -- 没有导出AutoPlayScheduler时按加入顺序检查，没到期的留在列表里
+    local now = UtilsWanakaFramework:getUnixTimestamp()
+    local events = self.autoPlayEvents
+    local pending = {}
+    for _, event in ipairs(events) do
+        if now > event.dueTime then
             local pitchEvent = event.event
             -- Log.d("start autoPlay, pitch:%d", pitchEvent:getPitch())
-            if pitchEvent:isOn() then
-                self.controller:handleEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.INPUT, pitchEvent:getPitch(), 90)
-            else
-                self.controller:handleEvent(WANAKA_MULTI_PLAYER_INPUT_EVENT.INPUT, pitchEvent:getPitch(), 0)
-            end
-            table.remove(self.autoPlayEvents, i)
-            return
+            controller:handleEvent(inputEvent, pitchEvent:getPitch(), pitchEvent:isOn() and 90 or 0)
+        else
+            table.insert(pending, event)
         end
     end
+    if #pending ~= #events then
+        self.autoPlayEvents = pending
+    end
 end
 
 function PlayerCore:setAutoPlay(enable)
@@ -296,10 +384,15 @@ end
 function PlayerCore:addAutoPlayEvent(pitchEvent, delayTime)
     if not self.controller then return end
 
+    delayTime = delayTime or autoPlayDelayTime
+    if self.autoPlayScheduler then
+        self.autoPlayScheduler:schedule(pitchEvent:getPitch(), pitchEvent:isOn() and 90 or 0, delayTime)
+        return
+    end
+
     local event = {}
     event.event = pitchEvent
-    event.currentTime = UtilsWanakaFramework:getUnixTimestamp()
-    event.delayTime = delayTime or autoPlayDelayTime
+    event.dueTime = UtilsWanakaFramework:getUnixTimestamp() + delayTime
     table.insert(self.autoPlayEvents, event)
 end
 
@@ -310,30 +403,25 @@ function PlayerCore:unscheduleAutoPlaySchedule()
     end
 end
 
+-- LOGIC: 这里只记录灯的状态，由lightManager每帧合并后发给键盘
 function PlayerCore:changeLight(pitchEvent)
     local pitch = pitchEvent:getPitch()
+    local indicatorType = self:getIndicatorType(pitchEvent:getTrack())
     if pitchEvent:isOn() then
-        MidiDevice:getInstance():turnOnLight(pitch, self:getIndicatorType(pitchEvent:getTrack()))
-        local indicatorType = self:getKeyBoardIndicatorType(pitchEvent:getTrack())
-        -- self._keyboard:setKeyIndicator(pitch, indicatorType, pitchEvent:getFinger())
-        table.insert(self._lightOnEvents, {pitchEvent = pitchEvent, indicatorType = indicatorType})
+        -- self._keyboard:setKeyIndicator(pitch, self:getKeyBoardIndicatorType(pitchEvent:getTrack()), pitchEvent:getFinger())
+        self.lightManager:noteOn(pitch, indicatorType)
     else
-        MidiDevice:getInstance():turnOffLight(pitch)
         -- self._keyboard:setKeyIndicator(pitch, KeyIndicatorType.kKeyIndicatorNone, 0)
-        table.remove(self._lightOnEvents, 1)
+        self.lightManager:noteOff(pitch, indicatorType)
     end
 end
 
 function PlayerCore:openLight()
-    for i,v in ipairs(self._lightOnEvents) do
-        -- self._keyboard:setKeyIndicator(v.pitchEvent:getPitch(), v.indicatorType, v.pitchEvent:getFinger())
-        local indicatorType = self:getIndicatorType(v.pitchEvent:getTrack())
-        MidiDevice:getInstance():turnOnLight(v.pitchEvent:getPitch(), indicatorType)
-    end
+    self.lightManager:setEnabled(true)
 end
 
 function PlayerCore:closeAllLight()
-    MidiDevice:getInstance():turnOffAllLights()
+    self.lightManager:setEnabled(false)
     -- self._keyboard:clearAllKeys()
 end
 
@@ -0,0 +1,162 @@
+﻿#include "ProfileTrace.h"
+
+#ifdef WANAKA_PROFILE
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <thread>
+
+// 60帧下每帧几十条记录，默认大约能保存最近一分钟
+static const int kDefaultCapacity = 1 << 17;
+static const int kMaxFrameCounters = 32;
+
+static unsigned int currentThread() {
+    return (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id());
+}
+
+static void writeName(FILE *file, const char *name) {
+    for (const char *c = name; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', file);
+        }
+        fputc(*c, file);
+    }
+}
+
+ProfileTrace::Scope::Scope(const char *name) : _name(name), _start(ProfileTrace::now()) {
+}
+
+ProfileTrace::Scope::~Scope() {
+    ProfileTrace::getInstance()->addComplete(_name, _start, ProfileTrace::now() - _start);
+}
+
+ProfileTrace *ProfileTrace::getInstance() {
+    static ProfileTrace sInstance;
+    return &sInstance;
+}
+
+long long ProfileTrace::now() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ProfileTrace::ProfileTrace() : _enabled(true), _next(0), _size(0) {
+    _events.resize(kDefaultCapacity);
+    _frameCounters.reserve(kMaxFrameCounters);
+}
+
+void ProfileTrace::setCapacity(int capacity) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _events.assign(capacity > 0 ? capacity : 1, Event());
+    _next = 0;
+    _size = 0;
+}
+
+void ProfileTrace::setEnabled(bool enabled) {
+    _enabled = enabled;
+}
+
+bool ProfileTrace::isEnabled() const {
+    return _enabled;
+}
+
+void ProfileTrace::addComplete(const char *name, long long start, long long duration) {
+    if (!_enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    push(name, 'X', start, duration, 0);
+}
+
+void ProfileTrace::count(const char *name, long long value) {
+    if (!_enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < _frameCounters.size(); i++) {
+        // 同一个字符串常量在不同的编译单元里指针可能不同
+        if (_frameCounters[i].name == name || strcmp(_frameCounters[i].name, name) == 0) {
+            _frameCounters[i].value += value;
+            return;
+        }
+    }
+    if (_frameCounters.size() < kMaxFrameCounters) {
+        FrameCounter counter = {name, value};
+        _frameCounters.push_back(counter);
+    }
+}
+
+void ProfileTrace::counter(const std::string &name, long long value) {
+    if (!_enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    // 脚本传进来的名字需要保存一份，set中的字符串地址不会变
+    const char *internedName = _names.insert(name).first->c_str();
+    push(internedName, 'C', now(), 0, value);
+}
+
+void ProfileTrace::frame() {
+    if (!_enabled) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    const long long timestamp = now();
+    push("frame", 'i', timestamp, 0, 0);
+    for (size_t i = 0; i < _frameCounters.size(); i++) {
+        push(_frameCounters[i].name, 'C', timestamp, 0, _frameCounters[i].value);
+        _frameCounters[i].value = 0;
+    }
+}
+
+void ProfileTrace::clear() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _next = 0;
+    _size = 0;
+    _frameCounters.clear();
+}
+
+bool ProfileTrace::dump(const std::string &path) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    FILE *file = fopen(path.c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+
+    fputs("{\"traceEvents\":[\n", file);
+    const int capacity = (int)_events.size();
+    const int first = (_next - _size + capacity) % capacity;
+    for (int i = 0; i < _size; i++) {
+        const Event &event = _events[(first + i) % capacity];
+        fputs(i == 0 ? "{\"name\":\"" : ",\n{\"name\":\"", file);
+        writeName(file, event.name);
+        fprintf(file, "\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%u", event.phase, event.timestamp, event.thread);
+        if (event.phase == 'X') {
+            fprintf(file, ",\"dur\":%lld}", event.duration);
+        } else if (event.phase == 'C') {
+            fprintf(file, ",\"args\":{\"value\":%lld}}", event.value);
+        } else {
+            fputs(",\"s\":\"g\"}", file);
+        }
+    }
+    fputs("\n]}\n", file);
+    return fclose(file) == 0;
+}
+
+void ProfileTrace::push(const char *name, char phase, long long timestamp, long long duration, long long value) {
+    Event &event = _events[_next];
+    event.name = name;
+    event.phase = phase;
+    event.timestamp = timestamp;
+    event.duration = duration;
+    event.value = value;
+    event.thread = currentThread();
+
+    _next = (_next + 1) % (int)_events.size();
+    if (_size < (int)_events.size()) {
+        _size++;
+    }
+}
+
+#endif // WANAKA_PROFILE
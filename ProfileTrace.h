@@ -0,0 +1,112 @@
+﻿#ifndef __PROFILE_TRACE_H__
+#define __PROFILE_TRACE_H__
+
+/**
+ * 热点路径性能统计
+ *
+ * 只有定义了WANAKA_PROFILE时才会编译，否则下面的宏全部展开为空，发布版本没有任何开销。
+ *   PROFILE_SCOPE(name)        统计所在作用域的耗时
+ *   PROFILE_COUNT(name, value) 累加当前帧的计数，PROFILE_FRAME()时输出
+ *   PROFILE_FRAME()            一帧结束，输出本帧累加的计数
+ *   PROFILE_DUMP(path)         把环形缓冲区里的记录保存成Chrome trace（chrome://tracing）格式的JSON
+ * name必须是字符串常量，记录里只保存指针。
+ */
+#ifdef WANAKA_PROFILE
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+class ProfileTrace {
+public:
+    struct Event {
+        const char *name;
+        char phase;             // 'X'耗时，'C'计数，'i'帧标记
+        long long timestamp;    // 微秒
+        long long duration;     // 微秒，只有'X'有效
+        long long value;        // 只有'C'有效
+        unsigned int thread;
+    };
+
+    class Scope {
+    public:
+        explicit Scope(const char *name);
+        ~Scope();
+
+    private:
+        const char *_name;
+        long long _start;
+    };
+
+    static ProfileTrace *getInstance();
+
+    static long long now();
+
+    /**
+     * 设置环形缓冲区能保存的记录数，会清空已有记录
+     */
+    void setCapacity(int capacity);
+
+    void setEnabled(bool enabled);
+
+    bool isEnabled() const;
+
+    void addComplete(const char *name, long long start, long long duration);
+
+    /**
+     * 累加当前帧的计数
+     */
+    void count(const char *name, long long value);
+
+    /**
+     * 立即记录一个计数，name不要求是常量，用于脚本层
+     */
+    void counter(const std::string &name, long long value);
+
+    /**
+     * 一帧结束，输出本帧累加的计数并清零
+     */
+    void frame();
+
+    void clear();
+
+    bool dump(const std::string &path);
+
+private:
+    struct FrameCounter {
+        const char *name;
+        long long value;
+    };
+
+    ProfileTrace();
+
+    void push(const char *name, char phase, long long timestamp, long long duration, long long value);
+
+    std::mutex _mutex;
+    std::atomic<bool> _enabled;     // 各线程不加锁读取
+    std::vector<Event> _events;
+    int _next;
+    int _size;
+    std::vector<FrameCounter> _frameCounters;
+    std::set<std::string> _names;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileTrace::Scope PROFILE_CONCAT(__profileScope, __LINE__)(name)
+#define PROFILE_COUNT(name, value) ProfileTrace::getInstance()->count(name, value)
+#define PROFILE_FRAME() ProfileTrace::getInstance()->frame()
+#define PROFILE_DUMP(path) ProfileTrace::getInstance()->dump(path)
+
+#else
+
+#define PROFILE_SCOPE(name) ((void)0)
+#define PROFILE_COUNT(name, value) ((void)0)
+#define PROFILE_FRAME() ((void)0)
+#define PROFILE_DUMP(path) false
+
+#endif // WANAKA_PROFILE
+
+#endif // __PROFILE_TRACE_H__
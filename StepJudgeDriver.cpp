@@ -0,0 +1,152 @@
+﻿#include "StepJudgeDriver.h"
+#include "WanakaMidi.h"
+#include "MidiPlayerForLua.h"
+#include "StepPlayEngine.h"
+
+#include <cfloat>
+
+#include "ProfileTrace.h"
+
+// 每个结果在popResults的数组里占的位置数
+static const int kResultFieldCount = 4;
+// 一帧内的判定结果一般不多，预留后每帧都不需要分配内存
+static const int kReservedResults = 16;
+
+StepJudgeDriver *StepJudgeDriver::create(MidiPlayerForLua *player, StepPlayEngine *engine) {
+    StepJudgeDriver *driver = new StepJudgeDriver();
+    if (driver->init(player, engine)) {
+        driver->autorelease();
+        return driver;
+    }
+    CC_SAFE_DELETE(driver);
+    return nullptr;
+}
+
+StepJudgeDriver::StepJudgeDriver() : _player(nullptr), _engine(nullptr), _judgeStartTick(DBL_MAX), _delivering(false), _popCount(0) {
+}
+
+StepJudgeDriver::~StepJudgeDriver() {
+    if (_player != nullptr) {
+        _player->setUpdateListener(nullptr);
+        _player->release();
+    }
+    if (_engine != nullptr) {
+        _engine->setResultListener(nullptr);
+        _engine->release();
+    }
+    releaseEvents(&_pendingEvents);
+    releaseEvents(&_resultEvents);
+}
+
+bool StepJudgeDriver::init(MidiPlayerForLua *player, StepPlayEngine *engine) {
+    if (player == nullptr || engine == nullptr) {
+        return false;
+    }
+    _player = player;
+    _player->retain();
+    _engine = engine;
+    _engine->retain();
+    _pending.reserve(kReservedResults * kResultFieldCount);
+    _pendingEvents.reserve(kReservedResults);
+
+    // 两个监听都只保存this，不retain，析构时先解除
+    _player->setUpdateListener([this]() {
+        onPlayUpdate();
+    });
+    _engine->setResultListener([this](Wanaka::PitchEvent *event, int result, double deltaTime, int comboStep, int tiedNoteIndex) {
+        onEngineResult(event, result, deltaTime, comboStep, tiedNoteIndex);
+    });
+    return true;
+}
+
+void StepJudgeDriver::setResultCallback(const std::function<void()> &callback) {
+    _resultCallback = callback;
+}
+
+void StepJudgeDriver::setJudgeStartTick(double tick) {
+    _judgeStartTick = tick;
+}
+
+double StepJudgeDriver::getJudgeStartTick() const {
+    return _judgeStartTick;
+}
+
+// LOGIC: 每次midi更新都会调用，当前tick只取一次，同时用于判断和判定
+void StepJudgeDriver::onPlayUpdate() {
+    PROFILE_SCOPE("StepJudgeDriver::onPlayUpdate");
+    const double tick = _player->getCurrentTick();
+    if (tick >= _judgeStartTick) {
+        _engine->midiUpdate(tick);
+        deliverResults();
+    }
+}
+
+void StepJudgeDriver::onMidiNoteReceived(int pitch, int velocity) {
+    if (_player->getCurrentTick() >= _judgeStartTick) {
+        _engine->onMidiNoteReceived(pitch, velocity);
+        deliverResults();
+    }
+}
+
+void StepJudgeDriver::onEngineResult(Wanaka::PitchEvent *event, int result, double deltaTime, int comboStep, int tiedNoteIndex) {
+    _pending.push_back(result);
+    _pending.push_back(deltaTime);
+    _pending.push_back(comboStep);
+    _pending.push_back(tiedNoteIndex);
+    // 音符在Lua取走并处理完结果之前不能被释放
+    if (event != nullptr) {
+        event->retain();
+    }
+    _pendingEvents.push_back(event);
+}
+
+// LOGIC: Lua的处理函数可能再按键或者改变播放状态，又产生新的结果。这时不嵌套调用回调，
+// 而是等这一次返回后接着交付，popResults返回的数组和音符在处理完之前不会被替换。回调没有取走结果时停止
+void StepJudgeDriver::deliverResults() {
+    if (_delivering || !_resultCallback) {
+        return;
+    }
+    _delivering = true;
+    while (!_pendingEvents.empty()) {
+        const unsigned int popCount = _popCount;
+        _resultCallback();
+        if (_popCount == popCount) {
+            break;
+        }
+    }
+    _delivering = false;
+}
+
+// 取走的结果与缓存交换，两边的数组都只在第一次用到时分配
+const std::vector<double> &StepJudgeDriver::popResults() {
+    releaseEvents(&_resultEvents);
+    _results.clear();
+    _results.swap(_pending);
+    _resultEvents.swap(_pendingEvents);
+    _popCount++;
+    PROFILE_COUNT("judge.driverResults", (int)_resultEvents.size());
+    return _results;
+}
+
+Wanaka::PitchEvent *StepJudgeDriver::getResultEvent(int index) const {
+    if (index < 0 || index >= (int)_resultEvents.size()) {
+        return nullptr;
+    }
+    return _resultEvents[index];
+}
+
+int StepJudgeDriver::getPendingCount() const {
+    return (int)_pendingEvents.size();
+}
+
+void StepJudgeDriver::clear() {
+    _pending.clear();
+    releaseEvents(&_pendingEvents);
+}
+
+void StepJudgeDriver::releaseEvents(std::vector<Wanaka::PitchEvent *> *events) {
+    for (int i = 0; i < (int)events->size(); i++) {
+        CC_SAFE_RELEASE((*events)[i]);
+    }
+    events->clear();
+}
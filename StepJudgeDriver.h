@@ -0,0 +1,97 @@
+﻿#ifndef __STEP_JUDGE_DRIVER_H__
+#define __STEP_JUDGE_DRIVER_H__
+
+#include <functional>
+#include <vector>
+
+#include "cocos2d.h"
+
+USING_NS_CC;
+
+namespace Wanaka {
+class PitchEvent;
+}
+
+class MidiPlayerForLua;
+class StepPlayEngine;
+
+/**
+ * 跟弹判定的原生驱动
+ *
+ * MidiPlayerForLua每次更新时直接在C++里驱动StepPlayEngine（代替Lua的UPDATE回调），段落的判定起点预先换算成tick，准备阶段不判定。
+ * StepPlayEngine的判定结果先缓存起来，在产生它们的那次更新或按键结束时调用一次结果回调，由Lua用popResults整批取走；
+ * 没有结果的更新不进入Lua。只在主线程上使用。
+ */
+class StepJudgeDriver : public Ref {
+public:
+    // 与StepPlayEngine回调的结果一致
+    enum Result {
+        kResultHit = 0,
+        kResultMiss,
+        kResultNoMatch,
+        kResultTiedNoteHit,
+        kResultTiedNoteMiss,
+        kResultPassBaseLine,
+    };
+
+    static StepJudgeDriver *create(MidiPlayerForLua *player, StepPlayEngine *engine);
+
+    /**
+     * 有新的判定结果时调用，回调里应该调用popResults。回调里再产生的结果在回调返回后接着交给回调
+     */
+    void setResultCallback(const std::function<void()> &callback);
+
+    /**
+     * 开始判定的tick，之前的更新和按键都不判定。设置之前不判定
+     */
+    void setJudgeStartTick(double tick);
+
+    double getJudgeStartTick() const;
+
+    /**
+     * 按键输入，到了判定起点才交给StepPlayEngine
+     */
+    void onMidiNoteReceived(int pitch, int velocity);
+
+    /**
+     * 取出上一次调用之后的所有判定结果：{结果, deltaTime, comboStep, tiedNoteIndex, 结果, ...}
+     * NOMATCH的deltaTime位置是按错的pitch，与StepPlayEngine回调的参数一致。
+     * 第i个结果的音符用getResultEvent(i)取得。返回的数组在下一次调用前有效
+     */
+    const std::vector<double> &popResults();
+
+    /**
+     * popResults取出的第index个结果对应的音符，可能为nullptr
+     */
+    Wanaka::PitchEvent *getResultEvent(int index) const;
+
+    int getPendingCount() const;
+
+    /**
+     * 丢弃还没有取走的结果
+     */
+    void clear();
+
+private:
+    StepJudgeDriver();
+    ~StepJudgeDriver();
+
+    bool init(MidiPlayerForLua *player, StepPlayEngine *engine);
+    void onPlayUpdate();
+    void onEngineResult(Wanaka::PitchEvent *event, int result, double deltaTime, int comboStep, int tiedNoteIndex);
+    void deliverResults();
+    static void releaseEvents(std::vector<Wanaka::PitchEvent *> *events);
+
+    MidiPlayerForLua *_player;
+    StepPlayEngine *_engine;
+    double _judgeStartTick;
+    std::function<void()> _resultCallback;
+    bool _delivering;
+    unsigned int _popCount;
+    std::vector<double> _pending;
+    std::vector<Wanaka::PitchEvent *> _pendingEvents;    // 已retain
+    std::vector<double> _results;
+    std::vector<Wanaka::PitchEvent *> _resultEvents;     // 已retain
+};
+
+#endif // __STEP_JUDGE_DRIVER_H__
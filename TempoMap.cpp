@@ -0,0 +1,257 @@
+﻿#include "TempoMap.h"
+#include "WanakaMidi.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const int kDefaultMicrosecondsPerQuarter = 500000;
+// 从秒换算回来的tick在整拍处可能差一点点，判断小节和拍子时容忍这么多tick
+static const double kTickEpsilon = 1e-6;
+
+// LOGIC: 返回最后一个key不大于value的下标（value在第一项之前时返回0）。
+// 先看cursor所在的一项和前后相邻的项，顺序查询时都落在这里；不在附近时再二分查找。
+template <class T, class Key>
+static int seekIndex(const std::vector<T> &items, double value, int cursor, Key key) {
+    const int count = (int)items.size();
+    if (cursor < 0 || cursor >= count) {
+        cursor = 0;
+    }
+    if (key(items[cursor]) <= value) {
+        if (cursor + 1 >= count || key(items[cursor + 1]) > value) {
+            return cursor;
+        }
+        if (cursor + 2 >= count || key(items[cursor + 2]) > value) {
+            return cursor + 1;
+        }
+    } else if (cursor == 0 || key(items[cursor - 1]) <= value) {
+        return cursor > 0 ? cursor - 1 : 0;
+    }
+
+    int low = 0;
+    int high = count - 1;
+    while (low < high) {
+        const int middle = (low + high + 1) / 2;
+        if (key(items[middle]) <= value) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+TempoMap::TempoMap() : _ticksPerQuarter(480), _ticksPerY(6), _tickCursor(0), _secondsCursor(0), _yCursor(0), _measureCursor(0) {
+}
+
+TempoMap *TempoMap::create(const CompiledSong::Tempo *tempos, int tempoCount, int ticksPerQuarter, double ticksPerY) {
+    TempoMap *map = new TempoMap();
+    if (map->init(tempos, tempoCount, ticksPerQuarter, ticksPerY)) {
+        map->autorelease();
+        return map;
+    }
+    CC_SAFE_DELETE(map);
+    return nullptr;
+}
+
+TempoMap *TempoMap::createWithSong(const CompiledSong *song, double ticksPerY) {
+    TempoMap *map = create(song->getTempos(), song->getTempoCount(), song->getTicksPerQuarter(), ticksPerY);
+    if (map != nullptr) {
+        map->setMeasures(song->getMeasures(), song->getMeasureCount());
+    }
+    return map;
+}
+
+// 与CompiledSong使用同样的速度表和小节网格，没有缓存时换算结果也一致
+TempoMap *TempoMap::createWithMidi(Wanaka::Midi *midi, double ticksPerY) {
+    int endTick = 0;
+    for (int i = 0; i < (int)midi->getTracks().size(); i++) {
+        Vector<Wanaka::BaseEvent *> &events = midi->getTracks()[i]->getEvents();
+        if (!events.empty()) {
+            endTick = std::max(endTick, events.back()->getTick());
+        }
+    }
+    std::vector<CompiledSong::Tempo> tempos;
+    std::vector<CompiledSong::Measure> measures;
+    CompiledSong::collectTimeline(midi, endTick, &tempos, &measures);
+    TempoMap *map = create(&tempos[0], (int)tempos.size(), midi->getTicksPerQuauter(), ticksPerY);
+    if (map != nullptr && !measures.empty()) {
+        map->setMeasures(&measures[0], (int)measures.size());
+    }
+    return map;
+}
+
+bool TempoMap::init(const CompiledSong::Tempo *tempos, int tempoCount, int ticksPerQuarter, double ticksPerY) {
+    if (ticksPerQuarter <= 0 || ticksPerY <= 0) {
+        return false;
+    }
+    _ticksPerQuarter = ticksPerQuarter;
+    _ticksPerY = ticksPerY;
+
+    // 第一个速度之前按第一个速度算
+    const int firstMicroseconds = tempoCount > 0 && tempos[0].microsecondsPerQuarter > 0 ? tempos[0].microsecondsPerQuarter : kDefaultMicrosecondsPerQuarter;
+    Segment segment;
+    segment.tick = 0;
+    segment.seconds = 0;
+    segment.y = 0;
+    segment.secondsPerTick = firstMicroseconds / 1e6 / ticksPerQuarter;
+    segment.ticksPerY = ticksPerY;
+    _segments.clear();
+    _segments.push_back(segment);
+
+    for (int i = 0; i < tempoCount; i++) {
+        const int microseconds = tempos[i].microsecondsPerQuarter;
+        if (microseconds <= 0) {
+            continue;
+        }
+        Segment &last = _segments.back();
+        const double tick = std::max<double>(tempos[i].tick, last.tick);
+        Segment next;
+        next.tick = tick;
+        next.seconds = last.seconds + (tick - last.tick) * last.secondsPerTick;
+        next.y = last.y + (tick - last.tick) / last.ticksPerY;
+        next.secondsPerTick = microseconds / 1e6 / ticksPerQuarter;
+        next.ticksPerY = ticksPerY * firstMicroseconds / microseconds;
+        if (tick == last.tick) {
+            last = next;
+        } else {
+            _segments.push_back(next);
+        }
+    }
+
+    // 默认4/4拍
+    CompiledSong::Measure measure;
+    measure.tick = 0;
+    measure.beats = 4;
+    measure.beatType = 4;
+    setMeasures(&measure, 1);
+    return true;
+}
+
+void TempoMap::setMeasures(const CompiledSong::Measure *measures, int measureCount) {
+    _measures.clear();
+    _measureCursor = 0;
+    int measureIndex = 0;
+    int beatIndex = 0;
+    for (int i = 0; i < measureCount; i++) {
+        const CompiledSong::Measure &measure = measures[i];
+        if (measure.beats <= 0 || measure.beatType <= 0) {
+            continue;
+        }
+        const double ticksPerBeat = _ticksPerQuarter * 4.0 / measure.beatType;
+        if (!_measures.empty()) {
+            // 拍号不变的连续小节合成一段
+            MeasureSpan &last = _measures.back();
+            const double measureLength = last.ticksPerBeat * last.beats;
+            const int measuresInSpan = (int)std::floor((measure.tick - last.tick) / measureLength + kTickEpsilon);
+            if (last.ticksPerBeat == ticksPerBeat && last.beats == measure.beats && last.tick + measuresInSpan * measureLength == measure.tick) {
+                continue;
+            }
+            measureIndex = last.firstMeasure + measuresInSpan;
+            beatIndex = last.firstBeat + measuresInSpan * last.beats;
+        }
+        MeasureSpan span;
+        span.tick = measure.tick;
+        span.ticksPerBeat = ticksPerBeat;
+        span.beats = measure.beats;
+        span.firstMeasure = measureIndex;
+        span.firstBeat = beatIndex;
+        _measures.push_back(span);
+    }
+    if (_measures.empty()) {
+        MeasureSpan span;
+        span.tick = 0;
+        span.ticksPerBeat = _ticksPerQuarter;
+        span.beats = 4;
+        span.firstMeasure = 0;
+        span.firstBeat = 0;
+        _measures.push_back(span);
+    }
+}
+
+int TempoMap::getTicksPerQuarter() const {
+    return _ticksPerQuarter;
+}
+
+double TempoMap::getTicksPerY() const {
+    return _ticksPerY;
+}
+
+int TempoMap::getSegmentCount() const {
+    return (int)_segments.size();
+}
+
+double TempoMap::getSegmentTick(int segment) const {
+    return _segments[segment].tick;
+}
+
+double TempoMap::getSegmentMicrosecondsPerQuarter(int segment) const {
+    return _segments[segment].secondsPerTick * 1e6 * _ticksPerQuarter;
+}
+
+double TempoMap::tickToSeconds(double tick) {
+    return tickToSeconds(tick, &_tickCursor);
+}
+
+double TempoMap::secondsToTick(double seconds) {
+    _secondsCursor = seekIndex(_segments, seconds, _secondsCursor, [](const Segment &item) {
+        return item.seconds;
+    });
+    const Segment &segment = _segments[_secondsCursor];
+    return segment.tick + (seconds - segment.seconds) / segment.secondsPerTick;
+}
+
+double TempoMap::tickToY(double tick) {
+    return tickToY(tick, &_tickCursor);
+}
+
+double TempoMap::yToTick(double y) {
+    _yCursor = seekIndex(_segments, y, _yCursor, [](const Segment &item) {
+        return item.y;
+    });
+    const Segment &segment = _segments[_yCursor];
+    return segment.tick + (y - segment.y) * segment.ticksPerY;
+}
+
+double TempoMap::secondsToY(double seconds) {
+    return tickToY(secondsToTick(seconds));
+}
+
+int TempoMap::tickToMeasure(double tick) {
+    _measureCursor = seekIndex(_measures, tick + kTickEpsilon, _measureCursor, [](const MeasureSpan &item) {
+        return item.tick;
+    });
+    const MeasureSpan &span = _measures[_measureCursor];
+    return span.firstMeasure + (int)std::floor((tick - span.tick) / (span.ticksPerBeat * span.beats) + kTickEpsilon) + 1;
+}
+
+int TempoMap::secondsToMeasure(double seconds) {
+    return tickToMeasure(secondsToTick(seconds));
+}
+
+int TempoMap::tickToBeat(double tick) {
+    _measureCursor = seekIndex(_measures, tick + kTickEpsilon, _measureCursor, [](const MeasureSpan &item) {
+        return item.tick;
+    });
+    const MeasureSpan &span = _measures[_measureCursor];
+    return span.firstBeat + (int)std::floor((tick - span.tick) / span.ticksPerBeat + kTickEpsilon) + 1;
+}
+
+int TempoMap::secondsToBeat(double seconds) {
+    return tickToBeat(secondsToTick(seconds));
+}
+
+double TempoMap::tickToY(double tick, int *segment) const {
+    *segment = seekIndex(_segments, tick, *segment, [](const Segment &item) {
+        return item.tick;
+    });
+    const Segment &found = _segments[*segment];
+    return found.y + (tick - found.tick) / found.ticksPerY;
+}
+
+double TempoMap::tickToSeconds(double tick, int *segment) const {
+    *segment = seekIndex(_segments, tick, *segment, [](const Segment &item) {
+        return item.tick;
+    });
+    const Segment &found = _segments[*segment];
+    return found.seconds + (tick - found.tick) * found.secondsPerTick;
+}
@@ -0,0 +1,112 @@
+﻿#ifndef __TEMPO_MAP_H__
+#define __TEMPO_MAP_H__
+
+#include <vector>
+
+#include "cocos2d.h"
+#include "CompiledSong.h"
+
+USING_NS_CC;
+
+namespace Wanaka {
+    class Midi;
+}
+
+/**
+ * 速度表
+ *
+ * 每首曲子建一次，tick、秒和瀑布流像素之间按速度分段线性换算，曲子中途变速时各处的换算结果一致。
+ * 瀑布流的像素与时间成正比，第一个速度下每个像素为getTicksPerY()个tick。
+ * 每种换算各自保存上一次所在的分段，顺序查询时均摊O(1)，跳转时二分查找。
+ * 带segment参数的版本由调用方保存分段，可以在工作线程上使用；其它方法只能在主线程上调用。
+ */
+class TempoMap : public Ref {
+public:
+    /**
+     * tempos按tick排序，ticksPerY为第一个速度下每个像素的tick数
+     */
+    static TempoMap *create(const CompiledSong::Tempo *tempos, int tempoCount, int ticksPerQuarter, double ticksPerY);
+
+    static TempoMap *createWithSong(const CompiledSong *song, double ticksPerY = 6);
+
+    static TempoMap *createWithMidi(Wanaka::Midi *midi, double ticksPerY = 6);
+
+    /**
+     * 小节网格，最后一个小节之后按最后一个小节的长度延续。没有设置时按4/4拍
+     */
+    void setMeasures(const CompiledSong::Measure *measures, int measureCount);
+
+    int getTicksPerQuarter() const;
+
+    double getTicksPerY() const;
+
+    int getSegmentCount() const;
+
+    /**
+     * 第segment个速度分段的起点tick和速度
+     */
+    double getSegmentTick(int segment) const;
+
+    double getSegmentMicrosecondsPerQuarter(int segment) const;
+
+    double tickToSeconds(double tick);
+
+    double secondsToTick(double seconds);
+
+    double tickToY(double tick);
+
+    double yToTick(double y);
+
+    double secondsToY(double seconds);
+
+    /**
+     * 从1开始的小节序号，曲子开始之前为0或负数
+     */
+    int tickToMeasure(double tick);
+
+    int secondsToMeasure(double seconds);
+
+    /**
+     * 从曲子开始算起、从1开始的拍子序号，曲子开始之前为0或负数
+     */
+    int tickToBeat(double tick);
+
+    int secondsToBeat(double seconds);
+
+    double tickToY(double tick, int *segment) const;
+
+    double tickToSeconds(double tick, int *segment) const;
+
+private:
+    struct Segment {
+        double tick;
+        double seconds;
+        double y;
+        double secondsPerTick;
+        double ticksPerY;
+    };
+
+    struct MeasureSpan {
+        double tick;
+        double ticksPerBeat;
+        int beats;
+        int firstMeasure; // 这一段第一个小节的序号（从0开始）
+        int firstBeat;    // 这一段第一拍的序号（从0开始）
+    };
+
+    TempoMap();
+
+    bool init(const CompiledSong::Tempo *tempos, int tempoCount, int ticksPerQuarter, double ticksPerY);
+
+    std::vector<Segment> _segments;
+    std::vector<MeasureSpan> _measures;
+    int _ticksPerQuarter;
+    double _ticksPerY;
+
+    int _tickCursor;
+    int _secondsCursor;
+    int _yCursor;
+    int _measureCursor;
+};
+
+#endif // __TEMPO_MAP_H__
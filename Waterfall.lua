@@ -1,4 +1,7 @@
+local WaterfallNoteIndex = require("WaterfallNoteIndex")
+
 local Waterfall = {}
+Waterfall.__index = Waterfall
 
 Waterfall.Event = {
     kEleHide            = 1, -- 条条不在显示区域内
@@ -10,6 +13,7 @@ Waterfall.Event = {
     kBarLineShown       = 7, -- 显示一条小节线
     kBarLineHide        = 8, -- 隐藏一条小节线
     kBarLineYChanged    = 9, -- 小节线y坐标发生改变了
+    kViewScrolled       = 10, -- 视图滚动了(只在容器滚动模式下发送，eleID为0)
 }
 
 Waterfall.ViewState = {
@@ -22,15 +26,43 @@ Waterfall.ViewState = {
 
 local sInitTick = -9999
 --[[
-@brief 将tick转换成对应的y坐标
+@brief 元素的位置以秒保存，显示时才乘上每秒的高度。只有显示中和新显示的元素需要换算
 --]]
-local function tick2y(tick, eleHPerSec, speed, midi)
-    return eleHPerSec * UtilsMusicCore:ticksToSeconds(tick, midi) / speed
+local function applyScale(info, yPerSec)
+    info.y = info.sec * yPerSec
+    info.h = info.secH * yPerSec
+end
+
+--[[
+@brief 按从小到大的顺序维护显示中的元素下标。进入的一般是最大的，离开的一般是最小的，所以分别从两头找
+--]]
+local function insertViewId(viewIds, id)
+    local pos = #viewIds + 1
+    while pos > 1 and viewIds[pos - 1] > id do
+        pos = pos - 1
+    end
+    table.insert(viewIds, pos, id)
+end
+
+local function removeViewId(viewIds, id)
+    for pos = 1, #viewIds do
+        if viewIds[pos] == id then
+            table.remove(viewIds, pos)
+            return
+        end
+    end
 end
 
 ------------------------| 外部接口 |------------------------
 --[[
-@brief 创建瀑布流
+@brief 创建一个瀑布流模型，之后调用init。同一个midi的多个瀑布流共用一份音符索引
+--]]
+function Waterfall.new()
+    return setmetatable({}, Waterfall)
+end
+
+--[[
+@brief 初始化瀑布流
 @param w, h 视图的宽高
 @param midi 用于生成瀑布流的midi事件
 @param elePosInfo { 用于定位瀑布流条的信息
@@ -39,106 +71,161 @@ end
     ...
 }
 @param eventCB(eleID, eventType, ...)
-    kElePosChanged 将传递x, y
+    kElePosChanged 将传递x, y。容器滚动模式下y是元素在整首曲子里的位置，只在元素显示和重新布局时发送
+    kViewScrolled 将传递视图底边在整首曲子里的位置sy，元素的显示位置为y - sy
     kEleSizeChanged 将传递w, h
-    kEleOnLine, kEleShownFromHide, kEleShownFromOnLine 将传递一个info表。表结构见下面的tryAddEleInfo函数
+    kEleOnLine, kEleShownFromHide, kEleShownFromOnLine 将传递一个info表。表结构见getEleInfo
     kBarLineYChanged 将传递小节线的y坐标
     其它事件传递nil
 @param speed 滚动速率, 默认为1.0
 @param hand Waterfall.Hand 类型。指定midi表示哪只手。双手或者不知道使用哪个手就传递nil
+@param compiledSong 可选，midi对应的CompiledSong。传入时直接使用里面配对好的音符
 --]]
-function Waterfall:init(w, h, midi, elePosInfo, eventCB, speed, hand)
+function Waterfall:init(w, h, midi, elePosInfo, eventCB, speed, hand, compiledSong)
     self._midi            = midi
     self._eventCB         = assert(eventCB)
+    self._elePosInfo      = elePosInfo
     self._eleHPerSec      = 160          -- 每秒物理时间在瀑布流表现为多长
     self._speedScale      = speed or 1.0 -- 速率
-    self._eleList         = {}           -- 条条的信息列表
+    self._index           = WaterfallNoteIndex.get(midi, compiledSong) -- 共用的音符索引
+    self._notes           = self._index:getHandNotes(hand)             -- 这个瀑布流显示的音符，元素下标即其中的下标
+    self._infos           = {}           -- 显示过的元素信息，按下标
     self._viewEleList     = {}           -- 能看到的瀑布流元素信息
     self._barlineList     = {}           -- 小节线位置信息列表
     self._w               = w            -- 视图区域的宽度
     self._h               = h            -- 视图区域的高度
     self._curTick         = sInitTick
-    self._midi            = midi
     self._ticksPerBar     = 4 / midi:getTimeBeatType() * 480 * midi:getTimeBeats()
+    self._viewIds         = {}           -- 能看到的元素下标，从小到大
+    self._scrollContainer = self._scrollContainer or false -- 容器滚动模式，见setScrollContainer
 
-    -- 确定手
-    local is1Track = midi:getTrackNumber() == 1
-    local function getHand(track, pitch)
-        if is1Track then
-            -- 如果midi只有一条轨，那么根据pitch 小于C4就当是左手
-            return (pitch < 48) and PLAY_HAND.LEFT or PLAY_HAND.RIGHT
-        else
-            -- 如果midi有两条轨，那么根据track来判定
-            return (0 == track) and PLAY_HAND.RIGHT or PLAY_HAND.LEFT
+    -- 导出了WaterfallViewWindow时，由它根据游标给出每次滚动状态改变了的元素
+    local WaterfallViewWindow = rawget(_G, "WaterfallViewWindow")
+    if self._viewWindow then
+        self._viewWindow:release()
+    end
+    self._viewWindow = WaterfallViewWindow and WaterfallViewWindow:create()
+    if self._viewWindow then
+        self._viewWindow:retain()
+    end
+
+    -- 更新UI信息
+    local notes = self._notes.notes
+    if #notes > 0 then
+        self:buildLayout()
+        self:updateLayout()
+        self:scrollToTick(self._index.startTicks[notes[1]])
+    end
+end
+
+--[[
+@brief 用于判定碰撞，更新ele的显示情况，创建ele，发送事件
+--]]
+function Waterfall:updateElements()
+    if self._curTick == sInitTick then return end
+    -- 获得能够显示的区间，用秒表示
+    local yPerSec = self:getYPerSec()
+    local ss = self._index:tickToSeconds(self._curTick)
+    local es = ss + self._h / yPerSec
+    local sy = ss * yPerSec
+
+    local callback = self._eventCB
+    -- 打开性能统计时（导出了ProfileTrace）统计每次更新发出的回调数
+    local profile = rawget(_G, "ProfileTrace")
+    local fired = 0
+    if profile then
+        local eventCB = callback
+        callback = function(...)
+            fired = fired + 1
+            return eventCB(...)
+        end
+    end
+
+    if self._viewWindow then
+        self:updateViewWindow(ss, es, sy, callback)
+    else
+        self:scanElements(ss, es, sy, callback)
+    end
+
+    -- 容器滚动模式下所有元素一起移动，只发送一次
+    if self._scrollContainer then
+        callback(0, Waterfall.Event.kViewScrolled, sy)
+    end
+
+    -- 调整小节线的位置
+    local event = Waterfall.Event
+    local barlineViewH = self._barlineViewH
+    for i, y in ipairs(self._barlineList) do
+        local curY = y - sy % barlineViewH
+        if curY < 0 then
+            curY = barlineViewH + curY
         end
+        callback(i, event.kBarLineYChanged, curY)
     end
 
-    -- 瀑布流配置生成
-    local defaultVState = Waterfall.ViewState.kOutView
-    local function tryAddEleInfo(e, endTick, pitch)
-        local posInfo = elePosInfo[pitch]
-        local sTick   = e:getTick()
-        -- 生成一个配置, y和h在updateLayout中被确定
-        local info = {
-            w         = posInfo[1],
-            h         = 0,
-            x         = posInfo[2],
-            y         = 0,
-            pitch     = pitch,
-            finger    = e:getFinger(),
-            startTick = sTick,
-            endTick   = endTick,
-            hand      = getHand(e:getTrack(), pitch),
-            viewState = defaultVState,
-        }
-        table.insert(self._eleList, info)
+    if profile then
+        profile:getInstance():counter("lua.waterfall.callbacks", fired)
     end
+end
 
-    -- 遍历midi事件，生成瀑布流信息
-    local events = midi:getEvents(hand or PLAY_HAND.BOTH, -1, -1)
-    local onEvents = {}
-    for _, e in ipairs(events) do
-        if e:getType() == MIDI_EVENT_TYPE.PITCH then
-            local pitch = e:getPitch()
-            if e:isOn() then
-                onEvents[pitch] = e
-            else
-                local pree = onEvents[pitch]
-                if pree then
-                    tryAddEleInfo(pree, e:getTick(), pitch)
-                    onEvents[pitch] = nil
-                end
+--[[
+@brief 原生模型只返回状态改变了的元素，这里不需要遍历元素列表，也不产生临时表
+--]]
+function Waterfall:updateViewWindow(ss, es, sy, callback)
+    local event = Waterfall.Event
+    local viewState = Waterfall.ViewState
+    local yPerSec = self:getYPerSec()
+    local viewList = self._viewEleList
+    local viewIds = self._viewIds
+    local container = self._scrollContainer
+    local changes = self._viewWindow:scrollTo(ss, es)
+    for k = 1, #changes, 2 do
+        local i = changes[k] + 1
+        local vst = changes[k + 1]
+        local info = self:getEleInfo(i)
+        local prevst = info.viewState
+        info.viewState = vst
+        if vst == viewState.kOutView then
+            viewList[i] = nil
+            removeViewId(viewIds, i)
+            callback(i, event.kEleHide)
+        elseif prevst == viewState.kOutView then
+            applyScale(info, yPerSec)
+            viewList[i] = info
+            insertViewId(viewIds, i)
+            callback(i, (vst == viewState.kInView) and event.kEleShownFromHide or event.kEleOnLine, info)
+            if container then
+                callback(i, event.kElePosChanged, info.x, info.y)
             end
+        else
+            callback(i, (vst == viewState.kOnViewLine) and event.kEleOnLine or event.kEleShownFromOnLine, info)
         end
     end
 
-    -- 更新UI信息
-    if #self._eleList > 0 then
-        -- 根据startTick来排序
-        table.sort(self._eleList, function(a, b)
-            return a.startTick < b.startTick
-        end)
-        self:updateLayout()
-        self:scrollToTick(self._eleList[1].startTick)
+    if container then return end
+    for _, i in ipairs(viewIds) do
+        local info = viewList[i]
+        callback(i, event.kElePosChanged, info.x, info.y - sy)
     end
 end
 
 --[[
-@brief 用于判定碰撞，更新ele的显示情况，创建ele，发送事件
+@brief 没有导出原生模型时逐个检查显示中的元素，再从头查找新显示的元素
 --]]
-function Waterfall:updateElements()
-    if self._curTick == sInitTick then return end
-    -- 获得能够显示的区间
-    local sy = tick2y(self._curTick, self._eleHPerSec, self._speedScale, self._midi)
-    local ey = sy + self._h
+function Waterfall:scanElements(ss, es, sy, callback)
     local viewState = Waterfall.ViewState
-    -- 通过info获取这个显示元素的显示状态
-    local function getViewState(y, hy)
-        if hy <= sy or y > ey then
+    local yPerSec = self:getYPerSec()
+    local viewIds = self._viewIds
+    -- 容器滚动模式下元素的位置用整首曲子里的位置，已经显示的元素不需要移动
+    local container = self._scrollContainer
+    local posOffsetY = container and 0 or sy
+    -- 通过info获取这个显示元素的显示状态，s和hs是元素首尾的秒数
+    local function getViewState(s, hs)
+        if hs <= ss or s > es then
             return viewState.kOutView
         end
 
-        if y <= sy and hy > sy then
+        if s <= ss and hs > ss then
             return viewState.kOnViewLine
         end
 
@@ -146,7 +233,6 @@ function Waterfall:updateElements()
     end
 
     -- 遍历正在显示的元素，调整他们的位置，执行更新和删除操作
-    local callback = self._eventCB
     local event = Waterfall.Event
     local viewList = self._viewEleList
     local viewKeys = {}
@@ -157,8 +243,7 @@ function Waterfall:updateElements()
     for _, i in ipairs(viewKeys) do
         local info = viewList[i]
         -- 判定碰撞
-        local y = info.y
-        local vst = getViewState(y, info.h + y)
+        local vst = getViewState(info.sec, info.sec + info.secH)
         local prevst = info.viewState -- 当前肯定是显示的状态
 
         info.viewState = vst
@@ -166,9 +251,12 @@ function Waterfall:updateElements()
         if vst == viewState.kOutView then
             -- 从显示列表中删除
             viewList[i] = nil
+            removeViewId(viewIds, i)
             callback(i, event.kEleHide)
         else
-            callback(i, event.kElePosChanged, info.x, y - sy)
+            if not container then
+                callback(i, event.kElePosChanged, info.x, info.y - sy)
+            end
             if vst ~= prevst then
                 callback(i, (vst == viewState.kOnViewLine) and event.kEleOnLine or event.kEleShownFromOnLine, info)
             end
@@ -176,60 +264,63 @@ function Waterfall:updateElements()
     end
 
     -- 遍历列表调整不在原显示范围内的瀑布流条信息
-    for i, info in ipairs(self._eleList) do
+    local secs, secHs = self._notes.secs, self._notes.secHs
+    for i = 1, #secs do
         -- 只更新不在显示区域内的元素
-        local y = info.y
-        local hy = info.h + y
-        if y > ey then break end
+        local s = secs[i]
+        local hs = secHs[i] + s
+        if s > es then break end
 
-        if hy > sy and not viewList[i] then
-            local vst = getViewState(y, hy)
-            local prevst = info.viewState -- 当前肯定是隐藏的
-            if vst ~= prevst then
+        if hs > ss and not viewList[i] then
+            local vst = getViewState(s, hs)
+            if vst ~= viewState.kOutView then -- 当前肯定是隐藏的
+                local info = self:getEleInfo(i)
                 info.viewState = vst
+                applyScale(info, yPerSec)
                 viewList[i] = info
+                insertViewId(viewIds, i)
                 callback(i, (vst == viewState.kInView) and event.kEleShownFromHide or event.kEleOnLine, info)
-                callback(i, event.kElePosChanged, info.x, y - sy)
+                callback(i, event.kElePosChanged, info.x, info.y - posOffsetY)
             end
         end
     end
+end
 
-    -- 调整小节线的位置
-    local barlineViewH = self._barlineViewH
-    for i, y in ipairs(self._barlineList) do
-        local curY = y - sy % barlineViewH
-        if curY < 0 then
-            curY = barlineViewH + curY
-        end
-        callback(i, event.kBarLineYChanged, curY)
+--[[
+@brief 每秒物理时间在瀑布流上的高度，已经算上了速率
+--]]
+function Waterfall:getYPerSec()
+    return self._eleHPerSec / self._speedScale
+end
+
+--[[
+@brief 把显示的音符交给原生模型。位置是索引里的秒数，速率和每秒高度改变时不需要重新设置
+--]]
+function Waterfall:buildLayout()
+    if self._viewWindow then
+        self._viewWindow:setIntervals(self._notes.secs, self._notes.secHs)
     end
 end
 
 --[[
-@brief 重新布局UI
+@brief 重新布局UI。元素的位置以秒保存，这里只换算显示中的元素，与曲子长度无关
 --]]
 function Waterfall:updateLayout()
-    -- 遍历瀑布信息，根据高度和速度更新配置
-    local midi = self._midi
-    local ehp = self._eleHPerSec
-    local sps = self._speedScale
-
-    for _,info in ipairs(self._eleList) do
-        local sy = tick2y(info.startTick, ehp, sps, midi)
-        local ey = tick2y(info.endTick, ehp, sps, midi)
-        info.y = sy
-        info.h = ey - sy
-    end
+    local yPerSec = self:getYPerSec()
     -- 遍历正在显示的元素，调整他们的显示大小
     local callback = self._eventCB
     local et = Waterfall.Event.kEleSizeChanged
     for i, info in pairs(self._viewEleList) do
+        applyScale(info, yPerSec)
         -- 触发回调
         callback(i, et, info.w, info.h)
+        if self._scrollContainer then
+            callback(i, Waterfall.Event.kElePosChanged, info.x, info.y)
+        end
     end
     ------ 调整小节线的布局信息 --------
     -- 确定像是多少个小节线
-    local bh = tick2y(self._ticksPerBar, ehp, sps, midi) -- 每小节多高
+    local bh = self._index:tickToSeconds(self._ticksPerBar) * yPerSec -- 每小节多高
     local bn = math.floor(self._h / bh) + ((self._h % bh) > 0 and 1 or 0)
     local function updateBarLineY(curBn)
         -- 更新小节线的初始Y坐标位置
@@ -264,6 +355,88 @@ function Waterfall:updateLayout()
     self:updateElements()
 end
 
+--[[
+@brief 容器滚动模式：元素只在显示和重新布局时收到kElePosChanged（整首曲子里的位置），
+       每次滚动只发送一次kViewScrolled，由使用者把所有元素放在一个容器里整体移动。需要在init之前设置
+--]]
+function Waterfall:setScrollContainer(enabled)
+    self._scrollContainer = enabled
+end
+
+--[[
+@brief 能看到的元素下标，从小到大，也就是按开始的位置排序。返回的表不能修改
+--]]
+function Waterfall:getViewIds()
+    return self._viewIds
+end
+
+--[[
+@brief 元素的信息表，第一次显示时从索引生成，之后一直使用同一个表
+@return {
+    w, h, x, y  显示的位置和大小，y和h在显示时按速率换算
+    sec, secH   在曲子里开始的秒数和持续的秒数
+    pitch, finger, startTick, endTick, hand
+    viewState   Waterfall.ViewState
+}
+--]]
+function Waterfall:getEleInfo(id)
+    local info = self._infos[id]
+    if info then return info end
+
+    local n = self._notes.notes[id]
+    if not n then return nil end
+    local index = self._index
+    local pitch = index.pitches[n]
+    local posInfo = self._elePosInfo[pitch]
+    info = {
+        w         = posInfo[1],
+        h         = 0,
+        x         = posInfo[2],
+        y         = 0,
+        sec       = self._notes.secs[id],
+        secH      = self._notes.secHs[id],
+        pitch     = pitch,
+        finger    = index.fingers[n],
+        startTick = index.startTicks[n],
+        endTick   = index.endTicks[n],
+        hand      = index.hands[n],
+        viewState = Waterfall.ViewState.kOutView,
+    }
+    self._infos[id] = info
+    return info
+end
+
+--[[
+@brief 切换显示哪只手。音符索引不变，只是换成另一只手的筛选结果，不需要重新读取midi
+--]]
+function Waterfall:setHand(hand)
+    local notes = self._index:getHandNotes(hand)
+    if notes == self._notes then return end
+
+    -- 先隐藏当前显示的元素，元素下标在切换后会改变
+    local callback = self._eventCB
+    local event = Waterfall.Event
+    for _, i in ipairs(self._viewIds) do
+        callback(i, event.kEleHide)
+    end
+    self._viewEleList = {}
+    self._viewIds = {}
+    self._infos = {}
+    self._notes = notes
+    self:buildLayout()
+    self:updateElements()
+end
+
+--[[
+@brief 释放原生模型，瀑布流不再使用时调用
+--]]
+function Waterfall:cleanup()
+    if self._viewWindow then
+        self._viewWindow:release()
+        self._viewWindow = nil
+    end
+end
+
 --[[
 @brief 滚动到某个tick指定的位置
 --]]
@@ -0,0 +1,409 @@
+﻿#include "WaterfallBatchNode.h"
+
+#include <algorithm>
+
+// 同屏下落条一般不会超过几百个，每组按需要加倍
+static const int kInitialQuadCapacity = 128;
+// 尾巴固定三段拉伸，不需要拉伸时上下两段高度为0
+static const int kTailQuadCount = 3;
+static const float kFingerOffsetY = 3;
+
+WaterfallBatchNode *WaterfallBatchNode::create() {
+    WaterfallBatchNode *node = new WaterfallBatchNode();
+    if (node != nullptr && node->init()) {
+        node->autorelease();
+        return node;
+    }
+    CC_SAFE_DELETE(node);
+    return nullptr;
+}
+
+WaterfallBatchNode::WaterfallBatchNode() : _fingerVisible(true), _hitColor(0x80, 0x80, 0x80), _hiddenFallColor(-1), _dirty(false), _builtOpacity(0xff) {
+    for (int i = 0; i < kBatchCount; i++) {
+        _batches[i].atlas = nullptr;
+    }
+    for (int type = 0; type < 2; type++) {
+        for (int color = 0; color < 2; color++) {
+            _noteFrames[type][color].head = nullptr;
+            _noteFrames[type][color].tail = nullptr;
+            _noteFrames[type][color].tailCapHeight = 0;
+        }
+    }
+    for (int i = 0; i < (int)(sizeof(_fingerFrames) / sizeof(_fingerFrames[0])); i++) {
+        _fingerFrames[i] = nullptr;
+    }
+}
+
+WaterfallBatchNode::~WaterfallBatchNode() {
+    for (int type = 0; type < 2; type++) {
+        for (int color = 0; color < 2; color++) {
+            CC_SAFE_RELEASE(_noteFrames[type][color].head);
+            CC_SAFE_RELEASE(_noteFrames[type][color].tail);
+        }
+    }
+    for (int i = 0; i < (int)(sizeof(_fingerFrames) / sizeof(_fingerFrames[0])); i++) {
+        CC_SAFE_RELEASE(_fingerFrames[i]);
+    }
+    for (int i = 0; i < kBatchCount; i++) {
+        CC_SAFE_RELEASE(_batches[i].atlas);
+    }
+}
+
+bool WaterfallBatchNode::init() {
+    if (!Node::init()) {
+        return false;
+    }
+    _blendFunc = BlendFunc::ALPHA_PREMULTIPLIED;
+    setGLProgram(GLProgramCache::getInstance()->getGLProgram(GLProgram::SHADER_NAME_POSITION_TEXTURE_COLOR));
+    setCascadeOpacityEnabled(true);
+    return true;
+}
+
+void WaterfallBatchNode::setNoteFrames(FallType fallType, FallColor fallColor, SpriteFrame *head, SpriteFrame *tail, float tailCapHeight) {
+    NoteFrames &frames = _noteFrames[fallType][fallColor];
+    CC_SAFE_RETAIN(head);
+    CC_SAFE_RETAIN(tail);
+    CC_SAFE_RELEASE(frames.head);
+    CC_SAFE_RELEASE(frames.tail);
+    frames.head = head;
+    frames.tail = tail;
+    frames.tailCapHeight = tailCapHeight;
+    setBatchTexture(kBatchTail + fallType * 2 + fallColor, tail);
+    setBatchTexture(kBatchHead + fallType * 2 + fallColor, head);
+    setNeedsRebuild();
+}
+
+void WaterfallBatchNode::setFingerFrame(int finger, SpriteFrame *frame) {
+    if (finger <= 0 || finger >= (int)(sizeof(_fingerFrames) / sizeof(_fingerFrames[0]))) {
+        return;
+    }
+    CC_SAFE_RETAIN(frame);
+    CC_SAFE_RELEASE(_fingerFrames[finger]);
+    _fingerFrames[finger] = frame;
+    setBatchTexture(kBatchFinger + finger - 1, frame);
+    setNeedsRebuild();
+}
+
+void WaterfallBatchNode::setFingerVisible(bool visible) {
+    if (_fingerVisible != visible) {
+        _fingerVisible = visible;
+        setNeedsRebuild();
+    }
+}
+
+void WaterfallBatchNode::setHitColor(const Color3B &color) {
+    _hitColor = color;
+    setNeedsRebuild();
+}
+
+void WaterfallBatchNode::setHiddenFallColor(int fallColor) {
+    if (_hiddenFallColor != fallColor) {
+        _hiddenFallColor = fallColor;
+        setNeedsRebuild();
+    }
+}
+
+void WaterfallBatchNode::addNote(int id, float x, float y, float length, int pitch, FallType fallType, FallColor fallColor, int finger) {
+    removeNote(id);
+
+    BatchNote note;
+    note.id = id;
+    note.x = x;
+    note.y = y;
+    note.length = length;
+    note.pitch = pitch;
+    note.finger = finger;
+    note.fallType = fallType;
+    note.fallColor = fallColor;
+    note.hit = false;
+    for (int part = 0; part < kPartCount; part++) {
+        note.slots[part] = -1;
+    }
+    _noteIndices[id] = (int)_notes.size();
+    _notes.push_back(note);
+    if (!_dirty) {
+        insertQuads(_notes.back());
+    }
+}
+
+void WaterfallBatchNode::removeNote(int id) {
+    auto iter = _noteIndices.find(id);
+    if (iter == _noteIndices.end()) {
+        return;
+    }
+
+    const int index = iter->second;
+    _noteIndices.erase(iter);
+    if (!_dirty) {
+        eraseQuads(_notes[index]);
+    }
+    if (index != (int)_notes.size() - 1) {
+        _notes[index] = _notes.back();
+        _noteIndices[_notes[index].id] = index;
+    }
+    _notes.pop_back();
+}
+
+void WaterfallBatchNode::removeAllNotes() {
+    _notes.clear();
+    _noteIndices.clear();
+    setNeedsRebuild();
+}
+
+void WaterfallBatchNode::setNoteHit(int id, bool hit) {
+    auto iter = _noteIndices.find(id);
+    if (iter != _noteIndices.end() && _notes[iter->second].hit != hit) {
+        BatchNote &note = _notes[iter->second];
+        note.hit = hit;
+        if (!_dirty) {
+            writeQuads(note);
+        }
+    }
+}
+
+void WaterfallBatchNode::setNoteY(int id, float y, float length) {
+    auto iter = _noteIndices.find(id);
+    if (iter != _noteIndices.end()) {
+        BatchNote &note = _notes[iter->second];
+        note.y = y;
+        note.length = length;
+        if (!_dirty) {
+            writeQuads(note);
+        }
+    }
+}
+
+void WaterfallBatchNode::setPitchX(int pitch, float x) {
+    for (auto &note : _notes) {
+        if (note.pitch == pitch) {
+            note.x = x;
+            if (!_dirty) {
+                writeQuads(note);
+            }
+        }
+    }
+}
+
+int WaterfallBatchNode::getNoteCount() const {
+    return (int)_notes.size();
+}
+
+// 图片、指法显示、颜色等对所有下落条都有影响的设置改变时，下一次绘制前全部重建
+void WaterfallBatchNode::setNeedsRebuild() {
+    _dirty = true;
+}
+
+// 没有这个部件（图片没有设置、隐藏的手、不显示指法）时返回-1
+int WaterfallBatchNode::getBatchIndex(const BatchNote &note, Part part) const {
+    if (note.fallColor == _hiddenFallColor) {
+        return -1;
+    }
+    int batch = -1;
+    switch (part) {
+        case kPartTail:
+            batch = kBatchTail + note.fallType * 2 + note.fallColor;
+            break;
+        case kPartHead:
+            batch = kBatchHead + note.fallType * 2 + note.fallColor;
+            break;
+        default:
+            if (_fingerVisible && note.finger > 0 && note.finger < (int)(sizeof(_fingerFrames) / sizeof(_fingerFrames[0]))) {
+                batch = kBatchFinger + note.finger - 1;
+            }
+            break;
+    }
+    return batch >= 0 && getBatchFrame(batch) != nullptr && _batches[batch].atlas != nullptr ? batch : -1;
+}
+
+SpriteFrame *WaterfallBatchNode::getBatchFrame(int batch) const {
+    if (batch < kBatchHead) {
+        return _noteFrames[(batch - kBatchTail) / 2][(batch - kBatchTail) % 2].tail;
+    }
+    if (batch < kBatchFinger) {
+        return _noteFrames[(batch - kBatchHead) / 2][(batch - kBatchHead) % 2].head;
+    }
+    return _fingerFrames[batch - kBatchFinger + 1];
+}
+
+void WaterfallBatchNode::setBatchTexture(int batch, SpriteFrame *frame) {
+    if (frame == nullptr) {
+        return;
+    }
+    TextureAtlas *&atlas = _batches[batch].atlas;
+    if (atlas == nullptr) {
+        atlas = TextureAtlas::createWithTexture(frame->getTexture(), kInitialQuadCapacity);
+        atlas->retain();
+    } else if (atlas->getTexture() != frame->getTexture()) {
+        atlas->setTexture(frame->getTexture());
+    }
+}
+
+// LOGIC: 新的下落条放在各组的末尾
+void WaterfallBatchNode::insertQuads(BatchNote &note) {
+    for (int part = 0; part < kPartCount; part++) {
+        const int batchIndex = getBatchIndex(note, (Part)part);
+        if (batchIndex < 0) {
+            continue;
+        }
+        Batch &batch = _batches[batchIndex];
+        note.slots[part] = (int)batch.owners.size();
+        batch.owners.push_back(note.id);
+
+        const int quadCount = batchIndex < kBatchHead ? kTailQuadCount : 1;
+        const ssize_t needed = (ssize_t)batch.owners.size() * quadCount;
+        if (needed > batch.atlas->getCapacity()) {
+            batch.atlas->resizeCapacity(std::max(needed, batch.atlas->getCapacity() * 2));
+        }
+    }
+    writeQuads(note);
+}
+
+// LOGIC: 用组里最后一个下落条的四边形填补空位，绘制顺序只影响同一组里重叠的下落条
+void WaterfallBatchNode::eraseQuads(BatchNote &note) {
+    for (int part = 0; part < kPartCount; part++) {
+        const int slot = note.slots[part];
+        if (slot < 0) {
+            continue;
+        }
+        note.slots[part] = -1;
+        const int batchIndex = getBatchIndex(note, (Part)part);
+        Batch &batch = _batches[batchIndex];
+        const int quadCount = batchIndex < kBatchHead ? kTailQuadCount : 1;
+        const int last = (int)batch.owners.size() - 1;
+        if (slot != last) {
+            V3F_C4B_T2F_Quad *quads = batch.atlas->getQuads();
+            for (int i = 0; i < quadCount; i++) {
+                batch.atlas->updateQuad(&quads[last * quadCount + i], slot * quadCount + i);
+            }
+            const int moved = batch.owners[last];
+            batch.owners[slot] = moved;
+            _notes[_noteIndices[moved]].slots[part] = slot;
+        }
+        batch.owners.pop_back();
+        batch.atlas->removeQuadsAtIndex(last * quadCount, quadCount);
+    }
+}
+
+void WaterfallBatchNode::writeQuads(const BatchNote &note) {
+    const GLubyte opacity = _builtOpacity;
+    const Color3B &rgb = note.hit ? _hitColor : Color3B::WHITE;
+    // 预乘alpha
+    const Color4B color(rgb.r * opacity / 0xff, rgb.g * opacity / 0xff, rgb.b * opacity / 0xff, opacity);
+
+    if (note.slots[kPartTail] >= 0) {
+        const NoteFrames &frames = _noteFrames[note.fallType][note.fallColor];
+        TextureAtlas *atlas = _batches[getBatchIndex(note, kPartTail)].atlas;
+        const ssize_t index = note.slots[kPartTail] * kTailQuadCount;
+        const Size &size = frames.tail->getRect().size;
+        const float left = note.x - size.width / 2;
+        const float right = note.x + size.width / 2;
+        const float top = note.y + note.length;
+        const float cap = std::max(0.0f, std::min(frames.tailCapHeight, note.length / 2));
+        const float capFraction = size.height > 0 && cap > 0 ? frames.tailCapHeight / size.height : 0;
+        setQuad(atlas, index, frames.tail, left, note.y, right, note.y + cap, 0, capFraction, color);
+        setQuad(atlas, index + 1, frames.tail, left, note.y + cap, right, top - cap, capFraction, 1 - capFraction, color);
+        setQuad(atlas, index + 2, frames.tail, left, top - cap, right, top, 1 - capFraction, 1, color);
+    }
+
+    if (note.slots[kPartHead] >= 0) {
+        SpriteFrame *head = _noteFrames[note.fallType][note.fallColor].head;
+        const Size &size = head->getRect().size;
+        setQuad(_batches[getBatchIndex(note, kPartHead)].atlas, note.slots[kPartHead], head, note.x - size.width / 2, note.y, note.x + size.width / 2, note.y + size.height, 0, 1, color);
+    }
+
+    if (note.slots[kPartFinger] >= 0) {
+        SpriteFrame *glyph = _fingerFrames[note.finger];
+        const Size &size = glyph->getRect().size;
+        const float bottom = note.y + kFingerOffsetY;
+        setQuad(_batches[getBatchIndex(note, kPartFinger)].atlas, note.slots[kPartFinger], glyph, note.x - size.width / 2, bottom, note.x + size.width / 2, bottom + size.height, 0, 1, color);
+    }
+}
+
+// frameBottom和frameTop是使用图片的纵向范围（0为底边，1为顶边），用于尾巴的三段拉伸
+void WaterfallBatchNode::setQuad(TextureAtlas *atlas, ssize_t index, SpriteFrame *frame, float left, float bottom, float right, float top, float frameBottom, float frameTop, const Color4B &color) {
+    Texture2D *texture = frame->getTexture();
+    const Rect &rect = frame->getRectInPixels();
+    const float textureWidth = texture->getPixelsWide();
+    const float textureHeight = texture->getPixelsHigh();
+
+    // 打包时被旋转的图片在纹理里顺时针转了90度，宽高互换
+    float u0, u1, v0, v1;
+    if (frame->isRotated()) {
+        u0 = rect.origin.x / textureWidth;
+        u1 = (rect.origin.x + rect.size.height) / textureWidth;
+        v0 = rect.origin.y / textureHeight;
+        v1 = (rect.origin.y + rect.size.width) / textureHeight;
+    } else {
+        u0 = rect.origin.x / textureWidth;
+        u1 = (rect.origin.x + rect.size.width) / textureWidth;
+        v0 = rect.origin.y / textureHeight;
+        v1 = (rect.origin.y + rect.size.height) / textureHeight;
+    }
+
+    V3F_C4B_T2F_Quad quad;
+    quad.bl.vertices = Vec3(left, bottom, 0);
+    quad.br.vertices = Vec3(right, bottom, 0);
+    quad.tl.vertices = Vec3(left, top, 0);
+    quad.tr.vertices = Vec3(right, top, 0);
+    quad.bl.colors = quad.br.colors = quad.tl.colors = quad.tr.colors = color;
+    if (frame->isRotated()) {
+        const float uBottom = u0 + (u1 - u0) * frameBottom;
+        const float uTop = u0 + (u1 - u0) * frameTop;
+        quad.bl.texCoords = Tex2F(uBottom, v0);
+        quad.br.texCoords = Tex2F(uBottom, v1);
+        quad.tl.texCoords = Tex2F(uTop, v0);
+        quad.tr.texCoords = Tex2F(uTop, v1);
+    } else {
+        const float vBottom = v1 - (v1 - v0) * frameBottom;
+        const float vTop = v1 - (v1 - v0) * frameTop;
+        quad.bl.texCoords = Tex2F(u0, vBottom);
+        quad.br.texCoords = Tex2F(u1, vBottom);
+        quad.tl.texCoords = Tex2F(u0, vTop);
+        quad.tr.texCoords = Tex2F(u1, vTop);
+    }
+    atlas->updateQuad(&quad, index);
+}
+
+void WaterfallBatchNode::rebuildQuads() {
+    for (int i = 0; i < kBatchCount; i++) {
+        if (_batches[i].atlas != nullptr) {
+            _batches[i].atlas->removeAllQuads();
+        }
+        _batches[i].owners.clear();
+    }
+
+    _builtOpacity = getDisplayedOpacity();
+    for (auto &note : _notes) {
+        for (int part = 0; part < kPartCount; part++) {
+            note.slots[part] = -1;
+        }
+        insertQuads(note);
+    }
+    _dirty = false;
+}
+
+void WaterfallBatchNode::draw(Renderer *renderer, const Mat4 &transform, uint32_t flags) {
+    if (_dirty || _builtOpacity != getDisplayedOpacity()) {
+        rebuildQuads();
+    }
+    if (_notes.empty()) {
+        return;
+    }
+
+    _customCommand.init(_globalZOrder);
+    _customCommand.func = CC_CALLBACK_0(WaterfallBatchNode::onDraw, this, transform, flags);
+    renderer->addCommand(&_customCommand);
+}
+
+void WaterfallBatchNode::onDraw(const Mat4 &transform, uint32_t flags) {
+    getGLProgram()->use();
+    getGLProgram()->setUniformsForBuiltins(transform);
+    GL::blendFunc(_blendFunc.src, _blendFunc.dst);
+
+    // 按组的固定顺序绘制，每组一次draw call
+    for (int i = 0; i < kBatchCount; i++) {
+        if (_batches[i].atlas != nullptr && _batches[i].atlas->getTotalQuads() > 0) {
+            _batches[i].atlas->drawQuads();
+        }
+    }
+}
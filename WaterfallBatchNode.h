@@ -0,0 +1,138 @@
+﻿#ifndef __WATERFALL_BATCH_NODE_H__
+#define __WATERFALL_BATCH_NODE_H__
+
+#include <unordered_map>
+#include <vector>
+
+#include "cocos2d.h"
+#include "FallElementSprite.h"
+
+USING_NS_CC;
+
+/**
+ * 瀑布流批量绘制节点
+ *
+ * 下落条的四边形（尾巴、头部、指法数字）按部件和种类分组，每组一个动态顶点缓冲（TextureAtlas），一组一次draw call。
+ * 各组按固定顺序绘制：所有尾巴、所有头部、所有指法数字，层次与纹理的加载顺序无关。
+ * 每个下落条在各组里占固定的位置，添加、删除或修改一个下落条只更新它自己的四边形。
+ * 四边形使用节点内的坐标，滚动时只需要移动节点本身，即只改变一次模型视图矩阵，不需要逐个修改位置。
+ * 只使用GLES2的基础着色器，软件GL下也能运行。
+ */
+class WaterfallBatchNode : public Node {
+public:
+    static WaterfallBatchNode *create();
+
+    virtual ~WaterfallBatchNode();
+
+    virtual bool init() override;
+
+    /**
+     * 设置一种下落条的图片，尾巴按tailCapHeight上下各保留一段不拉伸
+     */
+    void setNoteFrames(FallType fallType, FallColor fallColor, SpriteFrame *head, SpriteFrame *tail, float tailCapHeight);
+
+    /**
+     * 设置指法数字（1~5）的字形
+     */
+    void setFingerFrame(int finger, SpriteFrame *frame);
+
+    void setFingerVisible(bool visible);
+
+    void setHitColor(const Color3B &color);
+
+    /**
+     * 隐藏某只手的下落条，传-1全部显示
+     */
+    void setHiddenFallColor(int fallColor);
+
+    /**
+     * 添加一个下落条，(x, y)是下落条底边中点在节点内的坐标
+     */
+    void addNote(int id, float x, float y, float length, int pitch, FallType fallType, FallColor fallColor, int finger);
+
+    void removeNote(int id);
+
+    void removeAllNotes();
+
+    void setNoteHit(int id, bool hit);
+
+    void setNoteY(int id, float y, float length);
+
+    void setPitchX(int pitch, float x);
+
+    int getNoteCount() const;
+
+    virtual void draw(Renderer *renderer, const Mat4 &transform, uint32_t flags) override;
+
+protected:
+    WaterfallBatchNode();
+
+private:
+    // 各组的下标，也是绘制顺序：尾巴和头部按FallType、FallColor各4组，指法数字1~5各1组
+    enum BatchIndex {
+        kBatchTail = 0,
+        kBatchHead = 4,
+        kBatchFinger = 8,
+        kBatchCount = 13,
+    };
+
+    // 下落条的部件，BatchNote::slots的下标
+    enum Part {
+        kPartTail = 0,
+        kPartHead,
+        kPartFinger,
+        kPartCount,
+    };
+
+    struct NoteFrames {
+        SpriteFrame *head;
+        SpriteFrame *tail;
+        float tailCapHeight;
+    };
+
+    struct BatchNote {
+        int id;
+        float x;
+        float y;
+        float length;
+        int pitch;
+        int finger;
+        FallType fallType;
+        FallColor fallColor;
+        bool hit;
+        int slots[kPartCount];    // 在各部件所在组里的位置，没有这个部件时为-1
+    };
+
+    struct Batch {
+        TextureAtlas *atlas;
+        std::vector<int> owners;  // 每个位置上的下落条id
+    };
+
+    void setNeedsRebuild();
+    void rebuildQuads();
+    int getBatchIndex(const BatchNote &note, Part part) const;
+    SpriteFrame *getBatchFrame(int batch) const;
+    void setBatchTexture(int batch, SpriteFrame *frame);
+    void insertQuads(BatchNote &note);
+    void eraseQuads(BatchNote &note);
+    void writeQuads(const BatchNote &note);
+    void setQuad(TextureAtlas *atlas, ssize_t index, SpriteFrame *frame, float left, float bottom, float right, float top, float frameBottom, float frameTop, const Color4B &color);
+    void onDraw(const Mat4 &transform, uint32_t flags);
+
+    NoteFrames _noteFrames[2][2];
+    SpriteFrame *_fingerFrames[6];
+    bool _fingerVisible;
+    Color3B _hitColor;
+    int _hiddenFallColor;
+
+    std::vector<BatchNote> _notes;
+    std::unordered_map<int, int> _noteIndices;
+    Batch _batches[kBatchCount];
+    bool _dirty;
+    GLubyte _builtOpacity;
+
+    BlendFunc _blendFunc;
+    CustomCommand _customCommand;
+};
+
+#endif // __WATERFALL_BATCH_NODE_H__
@@ -1,8 +1,19 @@
 ﻿#include "WaterfallLayer.h"
 #include "WanakaMidi.h"
+#include "CompiledSong.h"
+#include "TempoMap.h"
+#include "NotePairing.h"
 #include "FallElementSprite.h"
 #include "FlowerElementSprite.h"
 #include "MiniKeyboard.h"
+#include "WaterfallBatchNode.h"
+#include "ProfileTrace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <thread>
 
 #define RATE_OF_TICK_LENGTH 6
 USING_NS_WANAKA;
@@ -13,14 +24,203 @@ void WaterfallLayer::setDebugEnabled(bool enabled) {
     game_debug = enabled;
 }
 
-inline static int tickToY(int tick) {
-    return tick / RATE_OF_TICK_LENGTH;
+// LOGIC: 像素与时间成正比，第一个速度下6个tick为1个像素，中途变速时按速度表换算；segment是调用方保存的速度分段游标
+inline static int tickToY(const TempoMap *tempoMap, int tick, int *segment) {
+    return (int)tempoMap->tickToY(tick, segment);
+}
+
+// 可见区间上下各多绑定半屏的音符，滚动时精灵提前准备好
+static const float kPrefetchScreens = 0.5f;
+static const int kPitchCount = 128;
+
+// LOGIC: 按NotePairing的规则配对，结果按note on的先后排列，即按Y排序；同一个Y的音符再按note off的先后排列，
+// 与之前对精灵的稳定排序结果相同。只读取音轨事件，可以在工作线程上执行。
+static void buildTrackNotes(Track *track, const TempoMap *tempoMap, vector<WaterfallNoteTable::Note> *notes) {
+    Vector<BaseEvent *> &events = track->getEvents();
+    vector<WaterfallNoteTable::Note> slots;
+    vector<int> ys;
+    NotePairing pairing;
+    int onSegment = 0;
+    int offSegment = 0;
+
+    for (int j = 0; j < events.size(); j++) {
+        BaseEvent *baseEvent = events.at(j);
+        if (baseEvent->getType() != kEventTypePitch) {
+            continue;
+        }
+        PitchEvent *pitchEvent = static_cast<PitchEvent *>(baseEvent);
+        const int pitch = pitchEvent->getPitch();
+
+        if (pitchEvent->isOn()) {
+            if (pairing.noteOn(pitch) < 0) {
+                continue;
+            }
+            WaterfallNoteTable::Note note;
+            note.y = tickToY(tempoMap, pitchEvent->getTick(), &onSegment);
+            note.length = 0;
+            note.pitch = pitch;
+            note.tick = pitchEvent->getTick();
+            note.finger = pitchEvent->getFinger();
+            note.fallType = kFallTypeWhite;
+            note.fallColor = kFallColorRight;
+            note.hit = false;
+            slots.push_back(note);
+            ys.push_back((int)note.y);
+        } else {
+            const int slot = pairing.noteOff(pitch);
+            if (slot < 0) {
+                continue;
+            }
+            WaterfallNoteTable::Note &note = slots[slot];
+            int length = tickToY(tempoMap, pitchEvent->getTick(), &offSegment) - (int)note.y - 2;
+            if (length < 5) {
+                length = 5;
+            }
+            note.length = length;
+            note.fallColor = pitchEvent->getTrack() % 2 == 0 ? kFallColorRight : kFallColorLeft;
+        }
+    }
+
+    vector<int> paired;
+    pairing.getPairedNotes(ys, &paired);
+    notes->reserve(paired.size());
+    for (int i = 0; i < (int)paired.size(); i++) {
+        notes->push_back(slots[paired[i]]);
+    }
+}
+
+// Y相同时前面音轨的音符在前
+static void mergeNotesByY(vector<WaterfallNoteTable::Note> *merged, vector<WaterfallNoteTable::Note> &notes) {
+    if (merged->empty()) {
+        merged->swap(notes);
+        return;
+    }
+    vector<WaterfallNoteTable::Note> result;
+    result.reserve(merged->size() + notes.size());
+    std::merge(merged->begin(), merged->end(), notes.begin(), notes.end(), std::back_inserter(result), [](const WaterfallNoteTable::Note &lhs, const WaterfallNoteTable::Note &rhs) -> bool {
+        return lhs.y < rhs.y;
+    });
+    merged->swap(result);
+}
+
+// 预编译的曲子里音符已经配对并按startTick排好序，只需要换算成像素
+static void buildSongNotes(const CompiledSong *song, const TempoMap *tempoMap, vector<WaterfallNoteTable::Note> *notes) {
+    notes->reserve(song->getNoteCount());
+    int startSegment = 0;
+    int endSegment = 0;
+    for (int i = 0; i < song->getNoteCount(); i++) {
+        const CompiledSong::Note &songNote = song->getNote(i);
+        WaterfallNoteTable::Note note;
+        note.y = tickToY(tempoMap, songNote.startTick, &startSegment);
+        int length = tickToY(tempoMap, songNote.endTick, &endSegment) - (int)note.y - 2;
+        if (length < 5) {
+            length = 5;
+        }
+        note.length = length;
+        note.pitch = songNote.pitch;
+        note.tick = songNote.startTick;
+        note.finger = songNote.finger;
+        note.fallType = kFallTypeWhite;
+        note.fallColor = songNote.track % 2 == 0 ? kFallColorRight : kFallColorLeft;
+        note.hit = false;
+        notes->push_back(note);
+    }
+}
+
+WaterfallLayer::WaterfallLayer() : _midi(nullptr), _scrollView(nullptr), _linesNode(nullptr), _keyboardLayer(nullptr), _mode(kWaterfallModeGame), _background(nullptr), _scrollCallback(nullptr), _baselineSprite(nullptr), _hitBaselineSprite(nullptr), _builder(nullptr), _elementMode(kWaterfallModeGame), _fingerVisibility(-1), _hiddenFallColor(-1), _batchNode(nullptr), _outlineRegionHeight(0), _outlineBegin(0), _outlineEnd(0), _tempoMap(nullptr), _ready(false) {
+    for (int pitch = 0; pitch < kPitchCount; pitch++) {
+        _pitchOutlines[pitch] = nullptr;
+        _outlineNotes[pitch] = -1;
+    }
+}
+
+WaterfallLayer::~WaterfallLayer() {
+    CC_SAFE_RELEASE(_tempoMap);
+}
+
+// LOGIC: 只读取midi、预编译的曲子和速度表（使用自己的分段游标），可以在工作线程上执行
+static void buildLayoutData(Wanaka::Midi *midi, const CompiledSong *song, const TempoMap *tempoMap, vector<WaterfallNoteTable::Note> *notes, float *maxY) {
+    int segment = 0;
+    *maxY = 0;
+    if (song != nullptr) {
+        *maxY = tickToY(tempoMap, song->getEndTick(), &segment);
+        buildSongNotes(song, tempoMap, notes);
+        return;
+    }
+
+    for (int i = 0; i < midi->getTracks().size(); i++) {
+        Track *track = midi->getTracks()[i];
+        CCLOG("track: %d events count: %lu", i, track->getEvents().size());
+        if (!track->getEvents().empty()) {
+            float y = tickToY(tempoMap, track->getEvents().back()->getTick(), &segment);
+            if (*maxY < y) {
+                *maxY = y;
+            }
+
+        }
+    }
+
+    // LOGIC: 各音轨并行配对，再按Y归并成一个表。线程数不超过CPU核数，当前线程也参与，各线程依次领取下一个音轨
+    const int trackCount = (int)midi->getTracks().size();
+    vector<vector<WaterfallNoteTable::Note> > trackNotes(trackCount);
+    std::atomic<int> nextTrack(0);
+    auto buildTracks = [midi, tempoMap, &trackNotes, &nextTrack, trackCount]() {
+        for (int i = nextTrack++; i < trackCount; i = nextTrack++) {
+            buildTrackNotes(midi->getTracks()[i], tempoMap, &trackNotes[i]);
+        }
+    };
+    const int workerCount = std::min(trackCount, std::max(1, (int)std::thread::hardware_concurrency()));
+    vector<std::thread> builders;
+    for (int i = 1; i < workerCount; i++) {
+        builders.push_back(std::thread(buildTracks));
+    }
+    buildTracks();
+    for (auto &thread : builders) {
+        thread.join();
+    }
+    for (int i = 0; i < trackCount; i++) {
+        mergeNotesByY(notes, trackNotes[i]);
+    }
+}
+
+bool WaterfallLayer::init(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode, CompiledSong *song) {
+    initLayer(midi, keyboard, builder, mode, song);
+
+    vector<WaterfallNoteTable::Note> notes;
+    float maxY = 0;
+    buildLayoutData(midi, song, _tempoMap, &notes, &maxY);
+    attachNotes(notes, maxY);
+    return true;
 }
 
-WaterfallLayer::WaterfallLayer() : _midi(nullptr), _scrollView(nullptr), _linesNode(nullptr), _keyboardLayer(nullptr), _mode(kWaterfallModeGame), _background(nullptr), _scrollCallback(nullptr), _baselineSprite(nullptr), _hitBaselineSprite(nullptr) {
+bool WaterfallLayer::initAsync(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode, CompiledSong *song, const WaterfallReadyCallback &callback) {
+    initLayer(midi, keyboard, builder, mode, song);
+
+    // LOGIC: 音符表在工作线程上生成，生成完回到主线程绑定。在这之前层已经可以加到场景里，只是没有下落条。
+    // 生成期间持有层、midi和预编译的曲子，中途退出场景也不会被提前释放
+    retain();
+    midi->retain();
+    CC_SAFE_RETAIN(song);
+    TempoMap *tempoMap = _tempoMap;
+    std::thread([this, midi, song, tempoMap, callback]() {
+        auto notes = std::make_shared<vector<WaterfallNoteTable::Note> >();
+        float maxY = 0;
+        buildLayoutData(midi, song, tempoMap, notes.get(), &maxY);
+
+        Director::getInstance()->getScheduler()->performFunctionInCocosThread([this, midi, song, notes, maxY, callback]() {
+            attachNotes(*notes, maxY);
+            if (callback != nullptr) {
+                callback();
+            }
+            CC_SAFE_RELEASE(song);
+            midi->release();
+            release();
+        });
+    }).detach();
+    return true;
 }
 
-bool WaterfallLayer::init(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode) {
+void WaterfallLayer::initLayer(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode, CompiledSong *song) {
     Layer::init();
     _midi = midi;
     _keyboardLayer = keyboard;
@@ -43,23 +243,15 @@ bool WaterfallLayer::init(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElemen
     _scrollView->setViewSize(winSize);
     _scrollView->setDirection(extension::ScrollView::Direction::VERTICAL);
     _scrollView->setBounceable(false);
-
-    float maxY = 0;
-    for (int i = 0; i < _midi->getTracks().size(); i++) {
-        Track *track = _midi->getTracks()[i];
-        CCLOG("track: %d events count: %lu", i, track->getEvents().size());
-        if (!track->getEvents().empty()) {
-            float y = tickToY(track->getEvents().back()->getTick());
-            if (maxY < y) {
-                maxY = y;
-            }
-
-        }
-    }
-    const float totalHeight = maxY + _scrollView->getViewSize().height;
-    _scrollView->setContentSize(Size(_scrollView->getContentSize().width, totalHeight));
+    // 音符表准备好之前只有一屏高
+    _scrollView->setContentSize(Size(_scrollView->getContentSize().width, _scrollView->getViewSize().height));
     addChild(_scrollView);
 
+    // 速度表每首曲子一个，预编译的曲子自带
+    CC_SAFE_RELEASE(_tempoMap);
+    _tempoMap = song != nullptr ? song->getTempoMap() : TempoMap::createWithMidi(midi, RATE_OF_TICK_LENGTH);
+    CC_SAFE_RETAIN(_tempoMap);
+
     // draw node
 //    const Size &contentSize = _scrollView->getContentSize();
 //    _linesNode = DrawNode::create();
@@ -83,60 +275,13 @@ bool WaterfallLayer::init(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElemen
 
 
     // color blocks
-    vector<PitchEvent *> onEvents;
-    for (int i = 0; i < _midi->getTracks().size(); i++) {
-        Vector<BaseEvent *> &events = _midi->getTracks()[i]->getEvents();
-        for(int j = 0; j < events.size(); j++) {
-            BaseEvent *baseEvent = events.at(j);
-            if(baseEvent->getType() == kEventTypePitch) {
-                PitchEvent *pitchEvent = static_cast<PitchEvent *>(baseEvent);
-                if (pitchEvent->isOn()) {
-                    onEvents.push_back(pitchEvent);
-                } else {
-                    for (auto iter = onEvents.begin(); iter != onEvents.end(); iter++) {
-                        PitchEvent *onEvent = *iter;
-                        const int pitch = pitchEvent->getPitch();
-                        if (onEvent->getPitch() == pitch) {
-                            const int y = tickToY(onEvent->getTick());
-                            int length = tickToY(pitchEvent->getTick()) - y - 2;
-                            if (length < 5) {
-                                length = 5;
-                            }
-
-                            FallType fallType = _keyboardLayer->isWhiteKey(pitch) ? kFallTypeWhite : kFallTypeBlack;
-                            FallColor fallColor = pitchEvent->getTrack() % 2 == 0 ? kFallColorRight : kFallColorLeft;
-
-                            Node *sprite = nullptr;
-                            if (mode == kWaterfallModeAdvanced) {
-                                sprite = FlowerElementSprite::create(fallType, fallColor, length, onEvent->getFinger(), pitch);
-                            } else {
-                                if (builder != nullptr) {
-                                    sprite = builder(fallType, fallColor, length, onEvent->getFinger(), pitch);
-                                } else {
-                                    sprite = FallElementSprite::create(fallType, fallColor, length, onEvent->getFinger(), pitch);
-                                }
-                            }
-
-                            Rect rect = _keyboardLayer->getKeyRect(pitch);
-                            sprite->setAnchorPoint(Point::ANCHOR_MIDDLE_BOTTOM);
-                            sprite->setPosition(rect.origin.x + rect.size.width / 2, y);
-                            _scrollView->addChild(sprite);
-                            _elements.pushBack(sprite);
-
-                            onEvents.erase(iter);
-                            break;
-                        }
-                    }
-                }
-            }
-        }
+    // LOGIC: 这里只记录音符表，精灵在滚动到可见区间附近时才从复用池里绑定，节点数与曲子长度无关
+    _builder = builder;
+    _elementMode = mode;
+    for (int pitch = 0; pitch < kPitchCount; pitch++) {
+        _pitchXs[pitch] = -1;
     }
 
-    // 非单轨的曲子需要再排一次序，用于之后对轮廓线的控制
-    std::stable_sort(_elements.begin(), _elements.end(), [](Node *lhs, Node *rhs) -> bool {
-        return lhs->getPositionY() < rhs->getPositionY();
-    });
-
     if (game_debug) {
         Label *label = Label::createWithSystemFont("", "", 30);
         addChild(label);
@@ -146,13 +291,46 @@ bool WaterfallLayer::init(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElemen
         sprintf(str, "tempo=%d, tpq=%d", (int)midi->getFirstTempo(), midi->getTicksPerQuauter());
         label->setString(str);
     }
+}
 
-    return true;
+void WaterfallLayer::attachNotes(vector<WaterfallNoteTable::Note> &notes, float maxY) {
+    const float totalHeight = maxY + _scrollView->getViewSize().height;
+    _scrollView->setContentSize(Size(_scrollView->getContentSize().width, totalHeight));
+
+    // 键盘相关的属性在主线程上补齐
+    for (auto &note : notes) {
+        const int pitch = note.pitch;
+        note.fallType = _keyboardLayer->isWhiteKey(pitch) ? kFallTypeWhite : kFallTypeBlack;
+        if (pitch >= 0 && pitch < kPitchCount && _pitchXs[pitch] < 0) {
+            Rect rect = _keyboardLayer->getKeyRect(pitch);
+            _pitchXs[pitch] = rect.origin.x + rect.size.width / 2;
+        }
+    }
+    _noteTable.setNotes(notes);
+    _noteTable.setHiddenFallColor(_hiddenFallColor);
+    _noteElements.assign(_noteTable.getNoteCount(), nullptr);
+    _ready = true;
+    updateVisibleElements();
 }
 
-WaterfallLayer* WaterfallLayer::create(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode) {
+bool WaterfallLayer::isReady() const {
+    return _ready;
+}
+
+WaterfallLayer* WaterfallLayer::create(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode, CompiledSong *song) {
     WaterfallLayer *layer = new WaterfallLayer();
-    if (layer != nullptr && layer->init(midi, keyboard, builder, mode)) {
+    if (layer != nullptr && layer->init(midi, keyboard, builder, mode, song)) {
+        layer->autorelease();
+        return layer;
+    } else {
+        CC_SAFE_DELETE(layer);
+        return nullptr;
+    }
+}
+
+WaterfallLayer* WaterfallLayer::createAsync(Wanaka::Midi *midi, MiniKeyboard *keyboard, FallElementSpriteBuilder builder, WaterfallMode mode, CompiledSong *song, const WaterfallReadyCallback &callback) {
+    WaterfallLayer *layer = new WaterfallLayer();
+    if (layer != nullptr && layer->initAsync(midi, keyboard, builder, mode, song, callback)) {
         layer->autorelease();
         return layer;
     } else {
@@ -204,6 +382,9 @@ void WaterfallLayer::layoutSubNodes() {
             outline->setOpacity(0);
             _outlineSprites.insert(i, outline);
             addChild(outline);
+            if (i >= 0 && i < kPitchCount) {
+                _pitchOutlines[i] = outline;
+            }
 
             Sprite *bang = Sprite::create("flower_bang_light.png");
             bang->setAnchorPoint(Point::ANCHOR_MIDDLE_BOTTOM);
@@ -212,6 +393,9 @@ void WaterfallLayer::layoutSubNodes() {
             _bangSprites.insert(i, bang);
             addChild(bang, 1);
         }
+        if (_outlineSprites.at(64) != nullptr) {
+            _outlineRegionHeight = _outlineSprites.at(64)->getContentSize().height * 3; // 3个小花的高度
+        }
     }
 }
 
@@ -233,62 +417,259 @@ bool WaterfallLayer::isHidden() {
 }
 
 void WaterfallLayer::scrollTo(int tick) {
-    Point offset = Point(0, -tickToY(tick));
+    PROFILE_SCOPE("WaterfallLayer::scrollTo");
+    Point offset = Point(0, -(int)_tempoMap->tickToY(tick));
     if (_scrollView->getContentOffset().y != offset.y) {
         _scrollView->setContentOffset(offset);
+        updateVisibleElements();
 
         // update flower outline
         // TODO: 放到FollowGameEngine::onWaterfallDidScroll里面一个循环搞定？
         if (_mode == kWaterfallModeAdvanced) {
-            const float regionBottomY = -offset.y;
-            const float regionHeight = _outlineSprites.at(64)->getContentSize().height * 3; // 3个小花的高度
-            const float regionTopY = regionBottomY + regionHeight;
-
-            // LOGIC: 从前往后遍历每个小花，找到已经显示出来的小花对应的outline，再修改其alpha值
-            for (int i = 0; i < _elements.size(); i++) {
-                FallElementSprite *sprite = dynamic_cast<FallElementSprite *>(_elements.at(i));
-                if (sprite != nullptr) {
-                    const float positionY = sprite->getPositionY();
-                    if (positionY > regionTopY) {
-                        break;
-                    } else if (positionY >= regionBottomY) {
-                        const int pitch = sprite->getPitch();
-                        const GLbyte opacity = 0xFF * ((regionTopY - positionY)/ regionHeight);
-                        auto iter = _processedElements.find(pitch);
-                        if (iter != _processedElements.end()) {
-                            // 有相同pitch的node
-                            if (iter->second == sprite) {
-                                _outlineSprites.at(pitch)->setOpacity(opacity);
-                            }
-                        } else {
-                            _processedElements.insert(pitch, sprite);
-                            _outlineSprites.at(pitch)->setOpacity(opacity);
-                        }
-                    }
-                }
-            }
-
-            auto iter = _processedElements.begin();
-            while (iter != _processedElements.end()) {
-                if (iter->second->getPositionY() < regionBottomY) {
-                    _outlineSprites.at(iter->first)->setOpacity(0);
-                    iter = _processedElements.erase(iter);
-                } else {
-                    iter++;
-                }
-            }
+            updateOutlineWindow(-offset.y);
         }
 
         if (_scrollCallback != nullptr) {
             _scrollCallback();
         }
     }
+    PROFILE_FRAME();
+}
+
+// LOGIC: 小花的轮廓线区域是基准线以上3个小花的高度，[_outlineBegin, _outlineEnd)是音符表中Y落在区域内的音符。
+// 每个pitch的轮廓线只跟随区域内Y最小的那个音符，越靠近基准线越不透明；这个音符离开区域后轮廓线消失，交给同pitch的下一个音符。
+// 游标跟着滚动移动，每次只处理区域内和刚离开区域的音符。
+void WaterfallLayer::updateOutlineWindow(float regionBottomY) {
+    const int count = _noteTable.getNoteCount();
+    const float regionTopY = regionBottomY + _outlineRegionHeight;
+
+    // 从区域底部离开
+    while (_outlineBegin < count && _noteTable.getY(_outlineBegin) < regionBottomY) {
+        releaseOutline(_outlineBegin);
+        _outlineBegin++;
+    }
+    // 往回滚动时从底部重新进入
+    while (_outlineBegin > 0 && _noteTable.getY(_outlineBegin - 1) >= regionBottomY) {
+        _outlineBegin--;
+    }
+    if (_outlineEnd < _outlineBegin) {
+        _outlineEnd = _outlineBegin;
+    }
+    while (_outlineEnd < count && _noteTable.getY(_outlineEnd) <= regionTopY) {
+        _outlineEnd++;
+    }
+    // 往回滚动时从区域顶部离开
+    while (_outlineEnd > _outlineBegin && _noteTable.getY(_outlineEnd - 1) > regionTopY) {
+        _outlineEnd--;
+        releaseOutline(_outlineEnd);
+    }
+
+    for (int i = _outlineBegin; i < _outlineEnd; i++) {
+        PROFILE_COUNT("waterfall.outlineScanned", 1);
+        const int pitch = _noteTable.getPitch(i);
+        if (pitch < 0 || pitch >= kPitchCount || _pitchOutlines[pitch] == nullptr) {
+            continue;
+        }
+        // 区域内已经有同pitch更靠下的音符
+        if (_outlineNotes[pitch] >= 0 && _outlineNotes[pitch] < i) {
+            continue;
+        }
+        _outlineNotes[pitch] = i;
+        const GLubyte opacity = 0xFF * ((regionTopY - _noteTable.getY(i)) / _outlineRegionHeight);
+        _pitchOutlines[pitch]->setOpacity(opacity);
+    }
+}
+
+void WaterfallLayer::releaseOutline(int index) {
+    const int pitch = _noteTable.getPitch(index);
+    if (pitch >= 0 && pitch < kPitchCount && _outlineNotes[pitch] == index) {
+        _outlineNotes[pitch] = -1;
+        if (_pitchOutlines[pitch] != nullptr) {
+            _pitchOutlines[pitch]->setOpacity(0);
+        }
+    }
+}
+
+void WaterfallLayer::resetOutlineWindow() {
+    for (int pitch = 0; pitch < kPitchCount; pitch++) {
+        if (_outlineNotes[pitch] >= 0 && _pitchOutlines[pitch] != nullptr) {
+            _pitchOutlines[pitch]->setOpacity(0);
+        }
+        _outlineNotes[pitch] = -1;
+    }
 }
 
 Vector<Node *> &WaterfallLayer::getFallElements() {
     return _elements;
 }
 
+TempoMap *WaterfallLayer::getTempoMap() const {
+    return _tempoMap;
+}
+
+const WaterfallNoteTable &WaterfallLayer::getNoteTable() const {
+    return _noteTable;
+}
+
+void WaterfallLayer::updateVisibleElements() {
+    const float bottomY = -_scrollView->getContentOffset().y;
+    const float viewHeight = _scrollView->getViewSize().height;
+    const float prefetch = viewHeight * kPrefetchScreens;
+
+    _enteredNotes.clear();
+    _leftNotes.clear();
+    _noteTable.updateWindow(bottomY - prefetch, bottomY + viewHeight + prefetch, &_enteredNotes, &_leftNotes);
+    if (_enteredNotes.empty() && _leftNotes.empty()) {
+        return;
+    }
+
+    // 先回收再绑定，离开的精灵可以直接给新进入的音符用
+    for (int i = 0; i < _leftNotes.size(); i++) {
+        unbindElement(_leftNotes[i]);
+    }
+    for (int i = 0; i < _enteredNotes.size(); i++) {
+        bindElement(_enteredNotes[i]);
+    }
+
+    // _elements只保存已绑定的精灵，按Y排序
+    _elements.clear();
+    for (int i = _noteTable.getWindowBegin(); i < _noteTable.getWindowEnd(); i++) {
+        if (_noteElements[i] != nullptr) {
+            _elements.pushBack(_noteElements[i]);
+        }
+    }
+}
+
+WaterfallBatchNode *WaterfallLayer::enableBatchRendering() {
+    // 小花和自定义builder的下落条有各自的节点和动画，不能合批
+    if (_elementMode == kWaterfallModeAdvanced || _builder != nullptr) {
+        return nullptr;
+    }
+    if (_batchNode != nullptr) {
+        return _batchNode;
+    }
+
+    _leftNotes.clear();
+    _noteTable.resetWindow(&_leftNotes);
+    for (int i = 0; i < _leftNotes.size(); i++) {
+        unbindElement(_leftNotes[i]);
+    }
+    for (auto element : _elementPool) {
+        element->removeFromParent();
+    }
+    _elementPool.clear();
+    _elements.clear();
+
+    _batchNode = WaterfallBatchNode::create();
+    _batchNode->setPosition(Point::ZERO);
+    if (_fingerVisibility >= 0) {
+        _batchNode->setFingerVisible(_fingerVisibility != 0);
+    }
+    _batchNode->setHiddenFallColor(_hiddenFallColor);
+    _scrollView->addChild(_batchNode);
+
+    updateVisibleElements();
+    return _batchNode;
+}
+
+Node *WaterfallLayer::bindElement(int index) {
+    const WaterfallNoteTable::Note &note = _noteTable.getNote(index);
+    const FallType fallType = (FallType)note.fallType;
+    const FallColor fallColor = (FallColor)note.fallColor;
+
+    if (_batchNode != nullptr) {
+        _batchNode->addNote(index, _pitchXs[note.pitch], note.y, note.length, note.pitch, fallType, fallColor, note.finger);
+        if (note.hit) {
+            _batchNode->setNoteHit(index, true);
+        }
+        return nullptr;
+    }
+
+    Node *sprite = nullptr;
+    if (!_elementPool.empty()) {
+        FallElementSprite *element = static_cast<FallElementSprite *>(_elementPool.back());
+        element->setup(fallType, fallColor, note.length, note.finger, note.pitch);
+        sprite = element;
+        _elementPool.popBack();
+    } else {
+        if (_elementMode == kWaterfallModeAdvanced) {
+            sprite = FlowerElementSprite::create(fallType, fallColor, note.length, note.finger, note.pitch);
+        } else {
+            if (_builder != nullptr) {
+                sprite = _builder(fallType, fallColor, note.length, note.finger, note.pitch);
+            } else {
+                sprite = FallElementSprite::create(fallType, fallColor, note.length, note.finger, note.pitch);
+            }
+        }
+        PROFILE_COUNT("waterfall.spritesCreated", 1);
+
+        sprite->setAnchorPoint(Point::ANCHOR_MIDDLE_BOTTOM);
+        _scrollView->addChild(sprite);
+    }
+
+    sprite->setPosition(_pitchXs[note.pitch], note.y);
+    sprite->setVisible(!_noteTable.isHidden(index));
+    if (_fingerVisibility >= 0) {
+        static_cast<FallElementSprite *>(sprite)->setFingerVisible(_fingerVisibility != 0);
+    }
+    if (note.hit) {
+        static_cast<FallElementSprite *>(sprite)->hit();
+    }
+    _noteElements[index] = sprite;
+    return sprite;
+}
+
+void WaterfallLayer::unbindElement(int index) {
+    if (_batchNode != nullptr) {
+        _batchNode->removeNote(index);
+        return;
+    }
+
+    Node *sprite = _noteElements[index];
+    if (sprite == nullptr) {
+        return;
+    }
+    _noteElements[index] = nullptr;
+
+    sprite->stopAllActions();
+    if (_builder != nullptr && _elementMode != kWaterfallModeAdvanced) {
+        // 自定义builder创建的节点没法重新设置，不复用
+        sprite->removeFromParent();
+    } else {
+        static_cast<FallElementSprite *>(sprite)->reset();
+        sprite->setVisible(false);
+        _elementPool.pushBack(sprite);
+    }
+}
+
+void WaterfallLayer::hitNote(int index) {
+    // 异步生成时音符表可能还没有准备好
+    if (index < 0 || index >= _noteTable.getNoteCount()) {
+        return;
+    }
+    _noteTable.setHit(index, true);
+    if (_batchNode != nullptr) {
+        _batchNode->setNoteHit(index, true);
+    } else if (_noteElements[index] != nullptr) {
+        static_cast<FallElementSprite *>(_noteElements[index])->hit();
+    }
+}
+
+void WaterfallLayer::setPitchPositionX(int pitch, float x) {
+    if (pitch < 0 || pitch >= kPitchCount) {
+        return;
+    }
+    _pitchXs[pitch] = x;
+    if (_batchNode != nullptr) {
+        _batchNode->setPitchX(pitch, x);
+    }
+    for (int i = _noteTable.getWindowBegin(); i < _noteTable.getWindowEnd(); i++) {
+        if (_noteElements[i] != nullptr && _noteTable.getPitch(i) == pitch) {
+            _noteElements[i]->setPositionX(x);
+        }
+    }
+}
+
 void WaterfallLayer::setScrollCallback(const WaterfallScrollCallback &cb) {
     _scrollCallback = cb;
 }
@@ -298,7 +679,7 @@ Point WaterfallLayer::getScrollOffset() {
 }
 
 unsigned int WaterfallLayer::getNoteCount() const {
-    return (unsigned int)_elements.size();
+    return (unsigned int)_noteTable.getNoteCount();
 }
 
 void WaterfallLayer::setTouchScrollEnabled(bool enabled) {
@@ -312,14 +693,23 @@ void WaterfallLayer::setScollViewContent(Size size, int navigationHeight) {
     if (_background != nullptr) {
         _background->setTextureRect(Rect(0, 0, size.width, size.height - navigationHeight));
     }
+    updateVisibleElements();
 }
 
 void WaterfallLayer::reset() {
+    _noteTable.clearHits();
+    if (_batchNode != nullptr) {
+        for (int i = _noteTable.getWindowBegin(); i < _noteTable.getWindowEnd(); i++) {
+            _batchNode->setNoteHit(i, false);
+        }
+    }
     for (auto element : _elements) {
         auto fallElement = dynamic_cast<FlowerElementSprite *>(element);
-        fallElement->reset();
+        if (fallElement != nullptr) {
+            fallElement->reset();
+        }
     }
-    _processedElements.clear();
+    resetOutlineWindow();
 }
 
 void WaterfallLayer::setBackgroundVisiable(bool visible) {
@@ -340,6 +730,10 @@ void WaterfallLayer::setOutLineSpritesVisible(bool visible) {
 }
 
 void WaterfallLayer::setFingerVisible(bool visible) {
+    _fingerVisibility = visible ? 1 : 0;
+    if (_batchNode != nullptr) {
+        _batchNode->setFingerVisible(visible);
+    }
     for (auto element: _elements) {
         auto fallElementSprite = static_cast<FallElementSprite *>(element);
         fallElementSprite->setFingerVisible(visible);
@@ -360,12 +754,15 @@ void WaterfallLayer::hitPitch(int pitch) {
 }
 
 void WaterfallLayer::hideElementsByFallColor(FallColor color) {
-    for (auto element : _elements){
-        auto fallElementSprite = static_cast<FallElementSprite *>(element);
-        if (fallElementSprite->getFallColor() == color) {
-            fallElementSprite->setVisible(false);
-        } else {
-            fallElementSprite->setVisible(true);
+    _hiddenFallColor = color;
+    if (_batchNode != nullptr) {
+        _batchNode->setHiddenFallColor(color);
+    }
+    // 表里的标记是唯一的数据来源，已绑定的精灵照着标记显示
+    _noteTable.setHiddenFallColor(color);
+    for (int i = _noteTable.getWindowBegin(); i < _noteTable.getWindowEnd(); i++) {
+        if (_noteElements[i] != nullptr) {
+            _noteElements[i]->setVisible(!_noteTable.isHidden(i));
         }
     }
 }
@@ -5,8 +5,9 @@ end)
 
 local mu = require("MidiUtil")
 
-function WaterfallLayer:ctor(midi, config)
+function WaterfallLayer:ctor(midi, config, compiledSong)
     self.midi = midi
+    self.compiledSong = compiledSong
     self.musicXml = musicXml
     self.config = config
 
@@ -40,7 +41,7 @@ function WaterfallLayer:init()
         cc.FadeTo:create(0.5, 0x40)
     )))
 
-    local waterfallNode = require("layers.WaterfallNode"):create(self.config.rect, self.midi, self.elePosInfo, self.config.rate, self.config.hand)
+    local waterfallNode = require("layers.WaterfallNode"):create(self.config.rect, self.midi, self.elePosInfo, self.config.rate, self.config.hand, self.compiledSong)
     waterfallNode:setPosition(0, 0)
     self:addChild(waterfallNode)
     self.waterfallNode = waterfallNode
@@ -103,7 +104,8 @@ function WaterfallLayer:sendEvent(eventType, ...)
 end
 
 function WaterfallLayer:updateProgress(time)
-    local tick = mu.time2tick(self.midi, time)
+    local tempoMap = self.controller and self.controller.tempoMap
+    local tick = tempoMap and tempoMap:secondsToTick(time) or mu.time2tick(self.midi, time)
     self:scrollToTick(tick)
 end
 
@@ -130,13 +132,8 @@ function WaterfallLayer:setHand(hand)
     if self.config.hand == hand then return end
 
     self.config.hand = hand
-    self.waterfallNode:removeFromParent()
-
-    local waterfallNode = require("layers.WaterfallNode"):create(self.config.rect, self.midi, self.elePosInfo, self.config.rate, self.config.hand)
-    waterfallNode:setPosition(-10, 0)
-    self:addChild(waterfallNode)
-    self.waterfallNode = waterfallNode
-    self:scrollOutOfWindow()
+    -- 同一个瀑布流切换到另一只手的音符，位置保持不变
+    self.waterfallNode:setHand(hand)
 end
 
 function WaterfallLayer:scrollToTick(tick)
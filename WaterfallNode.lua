@@ -2,8 +2,8 @@ local function getRes(fileName)
     return "waterfall_test_" .. fileName
 end
 
--- 创建瀑布流的数据模型
-local sDataModel = require("Waterfall")
+-- 瀑布流的数据模型，每个WaterfallNode一个，同一个midi的模型共用音符索引
+local Waterfall = require("Waterfall")
 local function isWhiteKey(pitch)
     local normalPitch = pitch % 12
     if normalPitch < 5 then
@@ -13,12 +13,16 @@ local function isWhiteKey(pitch)
     end
 end
 ------------------------| 瀑布流元素 |------------------------
+local kElePrewarmCount = 8  -- 每种键色和手预先创建的元素数目
+local kEleFreeLimit = 48    -- 每种键色和手最多缓存的元素数目
 local Ele = class("WaterfallEle", cc.Node)
 
-function Ele:ctor(pitch, hand, finger, tick)
+--[[
+@brief 同一种键色和手的元素可以互相复用，创建后通过setNote设置音符
+@param fingerGlyphs 指法数字的字形，见getFingerGlyphs
+--]]
+function Ele:ctor(keyColorName, handName, fingerGlyphs)
     -- 创建显示的条条
-    local keyColorName = isWhiteKey(pitch) and "white" or "black"
-    local handName = (hand == PLAY_HAND.RIGHT) and "right" or "left"
     local sp = display.newNode()
     local icon = display.newSprite(string.format("ui_waterfall_note_%s_key.png", keyColorName))
     icon:setPositionY(icon:getContentSize().width / 2)
@@ -28,17 +32,30 @@ function Ele:ctor(pitch, hand, finger, tick)
     tail:setAnchorPoint(0.5, 0)
     sp:addChild(tail)
     sp:addChild(icon)
-    self.pitch = pitch
-    self.tick = tick
+    self.variant = keyColorName .. handName
     self:addChild(sp)
 
-    local fingerLabel = nil
-    -- 创建指法显示label
-    if finger and finger > 0 and finger < 6 then
-        fingerLabel = display.newTTFLabel({text = tostring(finger), size = 15})
-        fingerLabel:setAnchorPoint(display.CENTER_BOTTOM)
-        fingerLabel:setPositionY(3)
-        self:addChild(fingerLabel)
+    -- 指法数字使用字形图集里的精灵，复用时只切换帧
+    local fingerSprite = cc.Sprite:createWithSpriteFrame(fingerGlyphs.frames[1])
+    fingerSprite:setFlippedY(fingerGlyphs.flipped)
+    fingerSprite:setAnchorPoint(display.CENTER_BOTTOM)
+    fingerSprite:setPositionY(3)
+    fingerSprite:setVisible(false)
+    self:addChild(fingerSprite)
+    local hasFinger = false
+    local fingerEnabled = true
+
+    -- 设置音符
+    function self.setNote(pitch, finger, tick)
+        self.pitch = pitch
+        self.tick = tick
+        hasFinger = finger and finger > 0 and finger < 6
+        if hasFinger then
+            fingerSprite:setSpriteFrame(fingerGlyphs.frames[finger])
+            fingerSprite:setFlippedY(fingerGlyphs.flipped)
+            fingerSprite:setScale(1)
+        end
+        fingerSprite:setVisible(hasFinger and fingerEnabled)
     end
 
     -- 设置大小
@@ -57,22 +74,128 @@ function Ele:ctor(pitch, hand, finger, tick)
         tail:setContentSize(tail:getContentSize().width, h)
         self:setContentSize(newSize)
 
-        -- 调整显示指法的label大小
-        if fingerLabel then
-            local labelW = fingerLabel:getContentSize().width
-            if labelW > w then
-                fingerLabel:setScale(w / labelW * 0.8)
-            end
+        -- 调整显示指法的大小
+        if hasFinger then
+            local labelW = fingerSprite:getContentSize().width
+            fingerSprite:setScale(labelW > w and (w / labelW * 0.8) or 1)
         end
     end
 
     -- 设置指法
     function self.enableFingering(b)
-        if fingerLabel then
-            fingerLabel:setVisible(b)
+        fingerEnabled = b
+        fingerSprite:setVisible(hasFinger and b)
+    end
+end
+------------------------| 批量绘制 |------------------------
+-- 与C++中FallType、FallColor的取值一致
+local kFallTypeWhite, kFallTypeBlack = 0, 1
+local kFallColorRight, kFallColorLeft = 0, 1
+local kTailCapHeight = 5
+
+local function newFrameFromFile(file)
+    local texture = cc.Director:getInstance():getTextureCache():addImage(file)
+    if not texture then return nil end
+    local size = texture:getContentSize()
+    return cc.SpriteFrame:createWithTexture(texture, cc.rect(0, 0, size.width, size.height))
+end
+
+--[[
+@brief 导出了WaterfallBatchNode并且有指法数字图片时，所有下落条合并绘制，否则返回nil使用WaterfallEle
+--]]
+local function newBatchNode()
+    local WaterfallBatchNode = rawget(_G, "WaterfallBatchNode")
+    if not WaterfallBatchNode then return nil end
+
+    local fileUtils = cc.FileUtils:getInstance()
+    local fingerFiles = {}
+    for finger = 1, 5 do
+        fingerFiles[finger] = string.format("ui_waterfall_finger_%d.png", finger)
+        if not fileUtils:isFileExist(fingerFiles[finger]) then return nil end
+    end
+
+    local batch = WaterfallBatchNode:create()
+    local headWidth = 0
+    for _, keyColorName in ipairs({"white", "black"}) do
+        for _, handName in ipairs({"right", "left"}) do
+            local fallType = (keyColorName == "white") and kFallTypeWhite or kFallTypeBlack
+            local fallColor = (handName == "right") and kFallColorRight or kFallColorLeft
+            local head = newFrameFromFile(string.format("ui_waterfall_note_%s_key.png", keyColorName))
+            local tail = newFrameFromFile(string.format("ui_waterfall_note_tail_%s.png", handName))
+            batch:setNoteFrames(fallType, fallColor, head, tail, kTailCapHeight)
+            headWidth = head:getRect().width
+        end
+    end
+    for finger, file in ipairs(fingerFiles) do
+        batch:setFingerFrame(finger, newFrameFromFile(file))
+    end
+    -- 与WaterfallEle一致，尾巴从头部中间开始
+    return batch, headWidth / 2
+end
+
+------------------------| 指法字形 |------------------------
+local kFingerFontSize = 15
+local sFingerGlyphs = nil
+
+--[[
+@brief 指法数字1~5的字形，整个进程共用一份
+       有指法数字图片时直接使用，否则用TTF把1~5画到同一张RenderTexture上，之后只切换精灵帧，不再光栅化文字
+@return {frames = {[finger] = SpriteFrame}, flipped = 纹理是否上下颠倒}
+--]]
+local function getFingerGlyphs()
+    if sFingerGlyphs then return sFingerGlyphs end
+
+    local fileUtils = cc.FileUtils:getInstance()
+    local frames = {}
+    for finger = 1, 5 do
+        local file = string.format("ui_waterfall_finger_%d.png", finger)
+        frames[finger] = fileUtils:isFileExist(file) and newFrameFromFile(file) or nil
+        if not frames[finger] then
+            frames = nil
+            break
+        end
+    end
+    if frames then
+        for _, frame in ipairs(frames) do
+            frame:retain()
         end
+        sFingerGlyphs = {frames = frames, flipped = false}
+        return sFingerGlyphs
+    end
+
+    local labels = {}
+    local atlasW, atlasH = 0, 0
+    for finger = 1, 5 do
+        local label = display.newTTFLabel({text = tostring(finger), size = kFingerFontSize})
+        local size = label:getContentSize()
+        label:setAnchorPoint(0, 0)
+        label:setPosition(atlasW, 0)
+        -- 绘制命令在这一帧渲染时才执行，在那之前label不能被释放
+        label:retain()
+        labels[finger] = label
+        atlasW = atlasW + math.ceil(size.width) + 2
+        atlasH = math.max(atlasH, math.ceil(size.height))
     end
+    local atlas = cc.RenderTexture:create(atlasW, atlasH)
+    atlas:retain()
+    atlas:beginWithClear(0, 0, 0, 0)
+    for _, label in ipairs(labels) do
+        label:visit()
+    end
+    atlas:endToLua()
+
+    -- 所有字形在同一行，上下颠倒不影响各自的横向范围
+    local texture = atlas:getSprite():getTexture()
+    frames = {}
+    for finger, label in ipairs(labels) do
+        local size = label:getContentSize()
+        frames[finger] = cc.SpriteFrame:createWithTexture(texture, cc.rect(label:getPositionX(), 0, math.ceil(size.width), atlasH))
+        frames[finger]:retain()
+    end
+    sFingerGlyphs = {frames = frames, flipped = true, atlas = atlas, labels = labels}
+    return sFingerGlyphs
 end
+
 ------------------------| 瀑布流按下特效 |------------------------
 local EleOnLineEffectNode = class("EleOnLineEffectNode", cc.Node)
 
@@ -147,7 +270,7 @@ local WaterfallNode = class("WaterfallNode", cc.ClippingRectangleNode)
 @brief 创建一个瀑布流UI。 参数意义参考Waterfall.lua中的init函数
 @param viewRect cc.Rect
 --]]
-function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand)
+function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand, compiledSong)
     -- 这是裁剪区域
     self:setClippingRegion(viewRect)
     -- NOTE(zhangyufei): 调试使用，用于显示裁剪区域范围
@@ -164,7 +287,7 @@ function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand)
 
     local eleList     = {}
     local barlineList = {}
-    local eventType = sDataModel.Event
+    local eventType = Waterfall.Event
     local sx = viewRect.x
     local sy = viewRect.y
 
@@ -184,25 +307,112 @@ function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand)
         self._prepareEffectSprite[pitch] = sp
     end
 
-    sDataModel:init(viewRect.width, viewRect.height, midi, elePosInfo, function(id, event, ...)
+    -- 所有下落条按在整首曲子里的位置放在同一个容器里，滚动只移动这个容器
+    local container = display.newNode()
+    self:addChild(container, 1)
+    self._container = container
+    local scrollY = nil
+
+    local function onScrolled(y)
+        if y ~= scrollY then
+            scrollY = y
+            container:setPositionY(-y)
+        end
+        if self._initEnd then
+            self:updatePrepareEffects(y)
+        end
+    end
+
+    -- 批量绘制时所有下落条的四边形都在批量节点里
+    local batch, tailOffsetY = newBatchNode()
+    if batch then
+        container:addChild(batch)
+        self._batchNode = batch
+    end
+    local batchInfos = {}
+
+    -- 没有批量绘制时，离开视图的元素按键色和手放回缓存，之后显示的元素优先从缓存里取
+    local freeEles = {}
+    local fingerGlyphs = (not batch) and getFingerGlyphs()
+    local function newPooledEle(keyColorName, handName)
+        local ele = Ele:create(keyColorName, handName, fingerGlyphs)
+        ele:retain()
+        return ele
+    end
+    if not batch then
+        for _, keyColorName in ipairs({"white", "black"}) do
+            for _, handName in ipairs({"right", "left"}) do
+                local free = {}
+                for i = 1, kElePrewarmCount do
+                    free[i] = newPooledEle(keyColorName, handName)
+                end
+                freeEles[keyColorName .. handName] = free
+            end
+        end
+    end
+    self._freeEles = freeEles
+
+    local function acquireEle(pitch, eleHand)
+        local keyColorName = isWhiteKey(pitch) and "white" or "black"
+        local handName = (eleHand == PLAY_HAND.RIGHT) and "right" or "left"
+        return table.remove(freeEles[keyColorName .. handName]) or newPooledEle(keyColorName, handName)
+    end
+
+    local function recycleEle(oldEle)
+        container:removeChild(oldEle, false)
+        local free = freeEles[oldEle.variant]
+        if #free < kEleFreeLimit then
+            table.insert(free, oldEle)
+        else
+            oldEle:release()
+        end
+    end
+
+    local function onBatchEvent(id, event, ...)
+        if event == eventType.kViewScrolled then
+            onScrolled(...)
+        elseif event == eventType.kEleShownFromHide or (event == eventType.kEleOnLine and not batchInfos[id]) then
+            local info = ...
+            batchInfos[id] = info
+            local fallType = isWhiteKey(info.pitch) and kFallTypeWhite or kFallTypeBlack
+            local fallColor = (info.hand == PLAY_HAND.RIGHT) and kFallColorRight or kFallColorLeft
+            batch:addNote(id, info.x + sx, info.y + sy + 2, info.h + tailOffsetY, info.pitch, fallType, fallColor, info.finger or 0)
+        elseif event == eventType.kEleHide then
+            batch:removeNote(id)
+            batchInfos[id] = nil
+        elseif event == eventType.kEleSizeChanged then
+            local info = batchInfos[id]
+            batch:setNoteY(id, info.y + sy + 2, info.h + tailOffsetY)
+        end
+    end
+
+    local dataModel = Waterfall.new()
+    self._dataModel = dataModel
+    dataModel:setScrollContainer(true)
+    dataModel:init(viewRect.width, viewRect.height, midi, elePosInfo, function(id, event, ...)
+        if batch then
+            onBatchEvent(id, event, ...)
+            return
+        end
+
         local ele = eleList[id]
 
-        -- 创建一个新的瀑布流元素
+        -- 从缓存中取出一个瀑布流元素
         local function newEle(info)
-            ele = Ele:create(info.pitch, info.hand, info.finger, info.startTick)
+            ele = acquireEle(info.pitch, info.hand)
+            ele.setNote(info.pitch, info.finger, info.startTick)
+            ele.enableFingering(self._showFingering)
             eleList[id] = ele
             ele.setSize(info.w, info.h)
-            self:addChild(ele, 1)
+            container:addChild(ele)
         end
 
-        if event == eventType.kElePosChanged then
-            -- 只要改变y位置就好了
+        if event == eventType.kViewScrolled then
+            onScrolled(...)
+        elseif event == eventType.kElePosChanged then
+            -- 元素在容器里的位置，只在显示和重新布局时改变
             local x, y = ...
-            ele:setPositionX(x + sx)
-            ele:setPositionY(y + sy + 2)
-            if self._initEnd then
-                self:updatePrepareEffect(ele.pitch, y, id)
-            end
+            ele:setPosition(x + sx, y + sy + 2)
         elseif event == eventType.kEleShownFromOnLine then
             -- self:dismissEff(ele.pitch)
         elseif event == eventType.kEleShownFromHide then
@@ -216,8 +426,8 @@ function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand)
             -- end
         elseif event == eventType.kEleHide then
             -- self:dismissEff(ele.pitch)
-            -- 需要释放掉这个元素
-            self:removeChild(ele)
+            -- 放回缓存
+            recycleEle(ele)
             eleList[id] = nil
         elseif event == eventType.kEleSizeChanged then
             ele.setSize(...)
@@ -228,29 +438,70 @@ function WaterfallNode:ctor(viewRect, midi, elePosInfo, speed, hand)
         elseif event == eventType.kBarLineYChanged then
             -- 调整小节线的位置
         end
-    end, speed, hand)
+    end, speed, hand, compiledSong)
 
     self._eleList = eleList
     self._initEnd = true
 end
 
 function WaterfallNode:getDataModel()
-    return sDataModel
+    return self._dataModel
+end
+
+--[[
+@brief 切换显示哪只手，复用这个节点和数据模型，不需要重新创建
+--]]
+function WaterfallNode:setHand(hand)
+    -- 元素下标在切换后会改变，清掉按下标记录的基准线效果
+    self.preSprID = {}
+    for _, sp in pairs(self._prepareEffectSprite) do
+        sp:stopAllActions()
+        sp:setOpacity(0)
+        sp.lastId = nil
+    end
+    self._dataModel:setHand(hand)
 end
 
 function WaterfallNode:onCleanup()
-    sDataModel = nil
+    self._dataModel:cleanup()
+    for _, ele in pairs(self._eleList) do
+        ele:release()
+    end
+    for _, free in pairs(self._freeEles) do
+        for _, ele in ipairs(free) do
+            ele:release()
+        end
+    end
+    self._freeEles = {}
 end
 
 function WaterfallNode:enableFingering(b)
     if self._showFingering == b then return end
     self._showFingering = b
+    if self._batchNode then
+        self._batchNode:setFingerVisible(b)
+        return
+    end
     -- 关闭组件的指法
     for _,ele in pairs(self._eleList) do
         ele.enableFingering(b)
     end
 end
 
+--[[
+@brief 只检查压线和接近基准线的元素，显示中的元素按开始位置排序，遇到离基准线太远的就可以停下
+@param scrollY 视图底边在整首曲子里的位置
+--]]
+function WaterfallNode:updatePrepareEffects(scrollY)
+    local dataModel = self._dataModel
+    for _, id in ipairs(dataModel:getViewIds()) do
+        local info = dataModel:getEleInfo(id)
+        local y = info.y - scrollY
+        if y >= self._prepareHeight then break end
+        self:updatePrepareEffect(info.pitch, y, id)
+    end
+end
+
 function WaterfallNode:updatePrepareEffect(pitch, y, id)
     local yy = y
     local effectSp = self._prepareEffectSprite[pitch]
@@ -0,0 +1,176 @@
+local WaterfallNoteIndex = {}
+WaterfallNoteIndex.__index = WaterfallNoteIndex
+
+-- 每个midi只建一次索引，midi被回收后索引也跟着回收
+local sIndexes = setmetatable({}, {__mode = "k"})
+
+------------------------| 内部工具 |------------------------
+
+--[[
+@brief 将tick转换成曲子里的时间（秒）
+@param tempoMap 可选，有速度表时用它换算，顺序查询均摊O(1)
+--]]
+local function tick2sec(tick, midi, tempoMap)
+    return tempoMap and tempoMap:tickToSeconds(tick) or UtilsMusicCore:ticksToSeconds(tick, midi)
+end
+
+------------------------| 外部接口 |------------------------
+--[[
+@brief 获取midi的音符索引，同一个midi的所有瀑布流共用一份
+       索引建好后不再修改：音符按startTick排序，各个属性按列存放（startTicks、pitches等各一个数组，下标从1开始），
+       位置用曲子里的秒数表示，与速率和每秒高度无关
+@param compiledSong 可选，midi对应的CompiledSong。传入时直接使用里面配对好的音符和速度表
+--]]
+function WaterfallNoteIndex.get(midi, compiledSong)
+    local index = sIndexes[midi]
+    if index and index.compiledSong == compiledSong then
+        return index
+    end
+
+    index = setmetatable({}, WaterfallNoteIndex)
+    index:build(midi, compiledSong)
+    sIndexes[midi] = index
+    return index
+end
+
+function WaterfallNoteIndex:build(midi, compiledSong)
+    self.midi          = midi
+    self.compiledSong  = compiledSong
+    self.tempoMap      = compiledSong and compiledSong:getTempoMap() -- 速度表，与原生瀑布流共用
+    self.count         = 0
+    self.startTicks    = {}
+    self.endTicks      = {}
+    self.pitches       = {}
+    self.fingers       = {}
+    self.hands         = {}
+    self._handNotes    = {}  -- 按手筛选后的音符，见getHandNotes
+
+    local notes = {}
+    local function addNote(sTick, endTick, pitch, finger, hand)
+        table.insert(notes, {startTick = sTick, endTick = endTick, pitch = pitch, finger = finger, hand = hand})
+    end
+
+    -- 确定手
+    local is1Track = midi:getTrackNumber() == 1
+    local function getHand(track, pitch)
+        if is1Track then
+            -- 如果midi只有一条轨，那么根据pitch 小于C4就当是左手
+            return (pitch < 48) and PLAY_HAND.LEFT or PLAY_HAND.RIGHT
+        else
+            -- 如果midi有两条轨，那么根据track来判定
+            return (0 == track) and PLAY_HAND.RIGHT or PLAY_HAND.LEFT
+        end
+    end
+
+    if compiledSong then
+        -- 预编译的曲子里音符已经配对好并按startTick排序，手的规则与getHand相同
+        local songHands = {[0] = PLAY_HAND.RIGHT, [1] = PLAY_HAND.LEFT}
+        for i = 0, compiledSong:getNoteCount() - 1 do
+            addNote(compiledSong:getNoteStartTick(i), compiledSong:getNoteEndTick(i), compiledSong:getNotePitch(i),
+                compiledSong:getNoteFinger(i), songHands[compiledSong:getNoteHand(i)])
+        end
+    else
+        -- LOGIC: 与CompiledSong相同的配对规则：每个音轨内note off配对同pitch最早的还没配对的note on（每个pitch一个队列）。
+        -- 排序也相同：按startTick，再按音轨，同一个音轨内再按note off的先后，有没有缓存得到的音符表都一样
+        local events = midi:getEvents(PLAY_HAND.BOTH, -1, -1)
+        local pending = {}  -- [track][pitch] = {head = 下一个要配对的下标, note on事件...}
+        local offCount = 0
+        for _, e in ipairs(events) do
+            if e:getType() == MIDI_EVENT_TYPE.PITCH then
+                local track = e:getTrack()
+                local pitch = e:getPitch()
+                local trackPending = pending[track]
+                if not trackPending then
+                    trackPending = {}
+                    pending[track] = trackPending
+                end
+                local queue = trackPending[pitch]
+                if e:isOn() then
+                    if not queue then
+                        queue = {head = 1}
+                        trackPending[pitch] = queue
+                    end
+                    table.insert(queue, e)
+                elseif queue and queue[queue.head] then
+                    local pree = queue[queue.head]
+                    queue[queue.head] = false
+                    queue.head = queue.head + 1
+                    offCount = offCount + 1
+                    addNote(pree:getTick(), e:getTick(), pitch, pree:getFinger(), getHand(track, pitch))
+                    notes[#notes].track = track
+                    notes[#notes].offOrder = offCount
+                end
+            end
+        end
+        table.sort(notes, function(a, b)
+            if a.startTick ~= b.startTick then
+                return a.startTick < b.startTick
+            end
+            if a.track ~= b.track then
+                return a.track < b.track
+            end
+            return a.offOrder < b.offOrder
+        end)
+    end
+
+    -- 转成按列存放，临时的音符表随后被回收
+    for i, note in ipairs(notes) do
+        self.startTicks[i] = note.startTick
+        self.endTicks[i]   = note.endTick
+        self.pitches[i]    = note.pitch
+        self.fingers[i]    = note.finger
+        self.hands[i]      = note.hand
+    end
+    self.count = #notes
+end
+
+--[[
+@brief 按手筛选的音符，每只手只筛选一次，之后所有瀑布流共用
+@param hand PLAY_HAND，nil或PLAY_HAND.BOTH表示双手
+@return {
+    notes = {索引中的音符下标, ...},
+    secs  = {音符开始的秒数, ...},
+    secHs = {音符持续的秒数, ...},
+}
+--]]
+function WaterfallNoteIndex:getHandNotes(hand)
+    local key = (hand and hand ~= PLAY_HAND.BOTH) and hand or PLAY_HAND.BOTH
+    local handNotes = self._handNotes[key]
+    if handNotes then return handNotes end
+
+    -- 双手的秒数只算一次，单手的从里面取
+    local all = self._handNotes[PLAY_HAND.BOTH]
+    if not all then
+        all = {notes = {}, secs = {}, secHs = {}}
+        local midi = self.midi
+        local tempoMap = self.tempoMap
+        for i = 1, self.count do
+            local s = tick2sec(self.startTicks[i], midi, tempoMap)
+            all.notes[i] = i
+            all.secs[i] = s
+            all.secHs[i] = tick2sec(self.endTicks[i], midi, tempoMap) - s
+        end
+        self._handNotes[PLAY_HAND.BOTH] = all
+    end
+    if key == PLAY_HAND.BOTH then return all end
+
+    handNotes = {notes = {}, secs = {}, secHs = {}}
+    for i = 1, self.count do
+        if self.hands[i] == key then
+            table.insert(handNotes.notes, i)
+            table.insert(handNotes.secs, all.secs[i])
+            table.insert(handNotes.secHs, all.secHs[i])
+        end
+    end
+    self._handNotes[key] = handNotes
+    return handNotes
+end
+
+--[[
+@brief 按tick获取曲子里的秒数，与索引中的位置使用同样的换算
+--]]
+function WaterfallNoteIndex:tickToSeconds(tick)
+    return tick2sec(tick, self.midi, self.tempoMap)
+end
+
+return WaterfallNoteIndex
@@ -0,0 +1,217 @@
+﻿#include "WaterfallNoteTable.h"
+
+#include <algorithm>
+
+WaterfallNoteTable::WaterfallNoteTable() : _windowBegin(0), _windowEnd(0), _exitCursor(0) {
+}
+
+void WaterfallNoteTable::clear() {
+    _ys.clear();
+    _lengths.clear();
+    _pitches.clear();
+    _ticks.clear();
+    _fingers.clear();
+    _fallTypes.clear();
+    _fallColors.clear();
+    _flags.clear();
+    _inWindow.clear();
+    _byEnd.clear();
+    _sortedEnds.clear();
+    _maxEnds.clear();
+    _windowBegin = 0;
+    _windowEnd = 0;
+    _exitCursor = 0;
+}
+
+void WaterfallNoteTable::setNotes(std::vector<Note> &notes) {
+    clear();
+    const int count = (int)notes.size();
+    _ys.resize(count);
+    _lengths.resize(count);
+    _pitches.resize(count);
+    _ticks.resize(count);
+    _fingers.resize(count);
+    _fallTypes.resize(count);
+    _fallColors.resize(count);
+    _flags.resize(count);
+    _inWindow.assign(count, 0);
+    _byEnd.resize(count);
+    _maxEnds.resize(count);
+    for (int i = 0; i < count; i++) {
+        const Note &note = notes[i];
+        _ys[i] = note.y;
+        _lengths[i] = note.length;
+        _pitches[i] = note.pitch;
+        _ticks[i] = note.tick;
+        _fingers[i] = (signed char)note.finger;
+        _fallTypes[i] = (unsigned char)note.fallType;
+        _fallColors[i] = (unsigned char)note.fallColor;
+        _flags[i] = note.hit ? kFlagHit : 0;
+        _byEnd[i] = i;
+        _maxEnds[i] = i > 0 ? std::max(_maxEnds[i - 1], note.y + note.length) : note.y + note.length;
+    }
+    std::vector<Note>().swap(notes);
+
+    std::stable_sort(_byEnd.begin(), _byEnd.end(), [this](int lhs, int rhs) {
+        return _ys[lhs] + _lengths[lhs] < _ys[rhs] + _lengths[rhs];
+    });
+    _sortedEnds.resize(count);
+    for (int i = 0; i < count; i++) {
+        _sortedEnds[i] = _ys[_byEnd[i]] + _lengths[_byEnd[i]];
+    }
+}
+
+int WaterfallNoteTable::getNoteCount() const {
+    return (int)_ys.size();
+}
+
+WaterfallNoteTable::Note WaterfallNoteTable::getNote(int index) const {
+    Note note;
+    note.y = _ys[index];
+    note.length = _lengths[index];
+    note.pitch = _pitches[index];
+    note.tick = _ticks[index];
+    note.finger = _fingers[index];
+    note.fallType = _fallTypes[index];
+    note.fallColor = _fallColors[index];
+    note.hit = (_flags[index] & kFlagHit) != 0;
+    return note;
+}
+
+float WaterfallNoteTable::getY(int index) const {
+    return _ys[index];
+}
+
+float WaterfallNoteTable::getLength(int index) const {
+    return _lengths[index];
+}
+
+int WaterfallNoteTable::getPitch(int index) const {
+    return _pitches[index];
+}
+
+int WaterfallNoteTable::getTick(int index) const {
+    return _ticks[index];
+}
+
+int WaterfallNoteTable::getFallColor(int index) const {
+    return _fallColors[index];
+}
+
+const float *WaterfallNoteTable::getYs() const {
+    return _ys.empty() ? nullptr : &_ys[0];
+}
+
+const float *WaterfallNoteTable::getLengths() const {
+    return _lengths.empty() ? nullptr : &_lengths[0];
+}
+
+const int *WaterfallNoteTable::getPitches() const {
+    return _pitches.empty() ? nullptr : &_pitches[0];
+}
+
+const int *WaterfallNoteTable::getTicks() const {
+    return _ticks.empty() ? nullptr : &_ticks[0];
+}
+
+void WaterfallNoteTable::setHit(int index, bool hit) {
+    if (hit) {
+        _flags[index] |= kFlagHit;
+    } else {
+        _flags[index] &= ~kFlagHit;
+    }
+}
+
+bool WaterfallNoteTable::isHit(int index) const {
+    return (_flags[index] & kFlagHit) != 0;
+}
+
+// 以下整表扫描只有按字节的与、或和比较，编译器会展开成SIMD指令
+void WaterfallNoteTable::clearHits() {
+    const int count = getNoteCount();
+    unsigned char *flags = _flags.empty() ? nullptr : &_flags[0];
+    for (int i = 0; i < count; i++) {
+        flags[i] &= (unsigned char)~kFlagHit;
+    }
+}
+
+void WaterfallNoteTable::setHiddenFallColor(int fallColor) {
+    const int count = getNoteCount();
+    const unsigned char *fallColors = _fallColors.empty() ? nullptr : &_fallColors[0];
+    unsigned char *flags = _flags.empty() ? nullptr : &_flags[0];
+    if (fallColor < 0) {
+        for (int i = 0; i < count; i++) {
+            flags[i] &= (unsigned char)~kFlagHidden;
+        }
+        return;
+    }
+    const unsigned char hiddenColor = (unsigned char)fallColor;
+    for (int i = 0; i < count; i++) {
+        flags[i] = (unsigned char)((flags[i] & ~kFlagHidden) | (fallColors[i] == hiddenColor ? kFlagHidden : 0));
+    }
+}
+
+bool WaterfallNoteTable::isHidden(int index) const {
+    return (_flags[index] & kFlagHidden) != 0;
+}
+
+// 同一个音符可能被两个游标越过，第二次检查时标记已经更新，不会重复记录
+void WaterfallNoteTable::touchWindow(int index, float lowY, float highY, std::vector<int> *entered, std::vector<int> *left) {
+    const bool visible = _ys[index] <= highY && _ys[index] + _lengths[index] >= lowY;
+    if (visible != (_inWindow[index] != 0)) {
+        _inWindow[index] = visible ? 1 : 0;
+        (visible ? entered : left)->push_back(index);
+    }
+}
+
+// LOGIC: 音符可见只取决于“起点 <= highY”和“终点 >= lowY”两个条件，任何一个条件改变的音符都会被对应的游标越过，
+// 终点的游标走按终点排好序的下标，与WaterfallViewWindow相同。所以每帧只检查越过游标的音符，
+// 不需要按整首曲子最长的音符放宽区间，也不需要扫描区间里的所有音符。往回seek时游标反向移动即可。
+void WaterfallNoteTable::updateWindow(float lowY, float highY, std::vector<int> *entered, std::vector<int> *left) {
+    const int count = getNoteCount();
+    while (_windowEnd < count && _ys[_windowEnd] <= highY) {
+        touchWindow(_windowEnd++, lowY, highY, entered, left);
+    }
+    while (_windowEnd > 0 && _ys[_windowEnd - 1] > highY) {
+        touchWindow(--_windowEnd, lowY, highY, entered, left);
+    }
+
+    while (_exitCursor < count && _sortedEnds[_exitCursor] < lowY) {
+        touchWindow(_byEnd[_exitCursor++], lowY, highY, entered, left);
+    }
+    while (_exitCursor > 0 && _sortedEnds[_exitCursor - 1] >= lowY) {
+        touchWindow(_byEnd[--_exitCursor], lowY, highY, entered, left);
+    }
+
+    // 区间的起点只用于遍历可见的音符：它之前的音符终点全部小于lowY
+    while (_windowBegin < count && _maxEnds[_windowBegin] < lowY) {
+        _windowBegin++;
+    }
+    while (_windowBegin > 0 && _maxEnds[_windowBegin - 1] >= lowY) {
+        _windowBegin--;
+    }
+}
+
+void WaterfallNoteTable::resetWindow(std::vector<int> *left) {
+    for (int i = _windowBegin; i < _windowEnd; i++) {
+        if (_inWindow[i]) {
+            _inWindow[i] = 0;
+            left->push_back(i);
+        }
+    }
+    _windowBegin = 0;
+    _windowEnd = 0;
+    _exitCursor = 0;
+}
+
+bool WaterfallNoteTable::isInWindow(int index) const {
+    return _inWindow[index] != 0;
+}
+
+int WaterfallNoteTable::getWindowBegin() const {
+    return _windowBegin;
+}
+
+int WaterfallNoteTable::getWindowEnd() const {
+    return _windowEnd;
+}
@@ -0,0 +1,118 @@
+﻿#ifndef __WATERFALL_NOTE_TABLE_H__
+#define __WATERFALL_NOTE_TABLE_H__
+
+#include <vector>
+
+/**
+ * 瀑布流音符表
+ *
+ * 保存整首曲子所有下落条的位置和显示属性，不依赖任何Node。
+ * WaterfallLayer只为落在可见区间内的音符绑定精灵，区间移动时由这里给出进入和离开的音符；精灵只是表里状态的镜像。
+ * 各个属性按列连续存放（y、length、pitch等各一个数组），每帧的扫描只读需要的列，按手隐藏之类的整表操作是连续的字节扫描。
+ */
+class WaterfallNoteTable {
+public:
+    enum Flag {
+        kFlagHit = 1 << 0,
+        kFlagHidden = 1 << 1,     // 所在的手被隐藏
+    };
+
+    /**
+     * 添加和读取单个音符时使用，表内不按这个结构存放
+     */
+    struct Note {
+        float y;
+        float length;
+        int pitch;
+        int tick;         // 音符开始的tick
+        int finger;
+        int fallType;
+        int fallColor;
+        bool hit;
+    };
+
+    WaterfallNoteTable();
+
+    void clear();
+
+    /**
+     * 用已经按Y排好序的音符替换整个表，notes的内容会被取走
+     */
+    void setNotes(std::vector<Note> &notes);
+
+    int getNoteCount() const;
+
+    Note getNote(int index) const;
+
+    float getY(int index) const;
+
+    float getLength(int index) const;
+
+    int getPitch(int index) const;
+
+    int getTick(int index) const;
+
+    int getFallColor(int index) const;
+
+    const float *getYs() const;
+
+    const float *getLengths() const;
+
+    const int *getPitches() const;
+
+    const int *getTicks() const;
+
+    void setHit(int index, bool hit);
+
+    bool isHit(int index) const;
+
+    void clearHits();
+
+    /**
+     * 隐藏fallColor这只手的所有音符，传-1全部显示
+     */
+    void setHiddenFallColor(int fallColor);
+
+    bool isHidden(int index) const;
+
+    /**
+     * 把可见区间移动到[lowY, highY]，与上一次相比新进入和离开区间的音符分别追加到entered和left中
+     * 只检查起点或终点越过了区间边界的音符，与音符总数和最长的音符无关
+     */
+    void updateWindow(float lowY, float highY, std::vector<int> *entered, std::vector<int> *left);
+
+    /**
+     * 所有音符都离开可见区间，离开的音符追加到left中
+     */
+    void resetWindow(std::vector<int> *left);
+
+    bool isInWindow(int index) const;
+
+    /**
+     * [getWindowBegin(), getWindowEnd())之间包含所有可见的音符，按Y排序
+     */
+    int getWindowBegin() const;
+
+    int getWindowEnd() const;
+
+private:
+    void touchWindow(int index, float lowY, float highY, std::vector<int> *entered, std::vector<int> *left);
+
+    std::vector<float> _ys;
+    std::vector<float> _lengths;
+    std::vector<int> _ticks;
+    std::vector<int> _pitches;
+    std::vector<signed char> _fingers;
+    std::vector<unsigned char> _fallTypes;
+    std::vector<unsigned char> _fallColors;
+    std::vector<unsigned char> _flags;
+    std::vector<unsigned char> _inWindow;
+    std::vector<int> _byEnd;           // 按终点从小到大排序的下标
+    std::vector<float> _sortedEnds;    // 与_byEnd对应的终点
+    std::vector<float> _maxEnds;       // 按下标，前面所有音符终点的最大值
+    int _windowBegin;     // _maxEnds < lowY的音符数目
+    int _windowEnd;       // 起点 <= highY的音符数目
+    int _exitCursor;      // _byEnd中终点 < lowY的数目
+};
+
+#endif // __WATERFALL_NOTE_TABLE_H__
@@ -0,0 +1,155 @@
+﻿#include "WaterfallViewWindow.h"
+
+#include <algorithm>
+
+#include "ProfileTrace.h"
+
+WaterfallViewWindow *WaterfallViewWindow::create() {
+    WaterfallViewWindow *window = new WaterfallViewWindow();
+    window->autorelease();
+    return window;
+}
+
+WaterfallViewWindow::WaterfallViewWindow() : _bottomY(0), _topY(0), _enterCursor(0), _lineCursor(0), _exitCursor(0), _layoutDirty(false) {
+}
+
+void WaterfallViewWindow::clear() {
+    _ys.clear();
+    _ends.clear();
+    _byEnd.clear();
+    _sortedEnds.clear();
+    _states.clear();
+    _changes.clear();
+    _enterCursor = 0;
+    _lineCursor = 0;
+    _exitCursor = 0;
+    _layoutDirty = false;
+}
+
+void WaterfallViewWindow::addInterval(float y, float height) {
+    _ys.push_back(y);
+    _ends.push_back(y + height);
+    _states.push_back(kOutView);
+    _layoutDirty = true;
+}
+
+void WaterfallViewWindow::setIntervals(const std::vector<float> &ys, const std::vector<float> &heights) {
+    clear();
+    const size_t count = std::min(ys.size(), heights.size());
+    _ys.assign(ys.begin(), ys.begin() + count);
+    _ends.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        _ends[i] = ys[i] + heights[i];
+    }
+    _states.assign(count, kOutView);
+    _layoutDirty = true;
+}
+
+void WaterfallViewWindow::setInterval(int index, float y, float height) {
+    if (index < 0 || index >= getIntervalCount()) {
+        return;
+    }
+    _ys[index] = y;
+    _ends[index] = y + height;
+    _layoutDirty = true;
+}
+
+void WaterfallViewWindow::commitLayout() {
+    _layoutDirty = true;
+}
+
+int WaterfallViewWindow::getIntervalCount() const {
+    return (int)_ys.size();
+}
+
+WaterfallViewWindow::ViewState WaterfallViewWindow::getViewState(int index) const {
+    if (index < 0 || index >= getIntervalCount()) {
+        return kOutView;
+    }
+    return (ViewState)_states[index];
+}
+
+// 与Waterfall.lua中getViewState的边界一致
+WaterfallViewWindow::ViewState WaterfallViewWindow::computeState(int index) const {
+    const float y = _ys[index];
+    const float end = _ends[index];
+    if (end <= _bottomY || y > _topY) {
+        return kOutView;
+    }
+    if (y <= _bottomY) {
+        return kOnViewLine;
+    }
+    return kInView;
+}
+
+// 同一个下落条可能被几个游标越过，第二次检查时状态已经更新，不会重复记录
+void WaterfallViewWindow::touch(int index) {
+    const ViewState state = computeState(index);
+    if (state != _states[index]) {
+        _states[index] = state;
+        _changes.push_back(index);
+        _changes.push_back(state);
+    }
+}
+
+// 位置改变后尾部的顺序也可能改变，重新排序并逐个检查，开销与重新布局本身相同
+void WaterfallViewWindow::resync() {
+    const int count = getIntervalCount();
+    _byEnd.resize(count);
+    for (int i = 0; i < count; i++) {
+        _byEnd[i] = i;
+    }
+    std::stable_sort(_byEnd.begin(), _byEnd.end(), [this](int lhs, int rhs) {
+        return _ends[lhs] < _ends[rhs];
+    });
+    _sortedEnds.resize(count);
+    for (int i = 0; i < count; i++) {
+        _sortedEnds[i] = _ends[_byEnd[i]];
+    }
+
+    _enterCursor = (int)(std::upper_bound(_ys.begin(), _ys.end(), _topY) - _ys.begin());
+    _lineCursor = (int)(std::upper_bound(_ys.begin(), _ys.end(), _bottomY) - _ys.begin());
+    _exitCursor = (int)(std::upper_bound(_sortedEnds.begin(), _sortedEnds.end(), _bottomY) - _sortedEnds.begin());
+    for (int i = 0; i < count; i++) {
+        touch(i);
+    }
+    _layoutDirty = false;
+}
+
+// LOGIC: 状态只取决于y <= topY、y <= bottomY、尾部 <= bottomY三个条件，任何一个条件改变的下落条都会被对应的游标越过。
+// 所以只检查游标越过的下落条就能找出所有状态改变的下落条。往回滚动时游标反向移动即可。
+const std::vector<int> &WaterfallViewWindow::scrollTo(float bottomY, float topY) {
+    _changes.clear();
+    _bottomY = bottomY;
+    _topY = topY;
+    if (_layoutDirty) {
+        resync();
+        PROFILE_COUNT("waterfall.viewChanges", (int)_changes.size() / 2);
+        return _changes;
+    }
+
+    const int count = getIntervalCount();
+    while (_enterCursor < count && _ys[_enterCursor] <= topY) {
+        touch(_enterCursor++);
+    }
+    while (_enterCursor > 0 && _ys[_enterCursor - 1] > topY) {
+        touch(--_enterCursor);
+    }
+
+    while (_lineCursor < count && _ys[_lineCursor] <= bottomY) {
+        touch(_lineCursor++);
+    }
+    while (_lineCursor > 0 && _ys[_lineCursor - 1] > bottomY) {
+        touch(--_lineCursor);
+    }
+
+    while (_exitCursor < count && _sortedEnds[_exitCursor] <= bottomY) {
+        touch(_byEnd[_exitCursor++]);
+    }
+    while (_exitCursor > 0 && _sortedEnds[_exitCursor - 1] > bottomY) {
+        touch(_byEnd[--_exitCursor]);
+    }
+
+    PROFILE_COUNT("waterfall.viewChanges", (int)_changes.size() / 2);
+    return _changes;
+}
@@ -0,0 +1,87 @@
+﻿#ifndef __WATERFALL_VIEW_WINDOW_H__
+#define __WATERFALL_VIEW_WINDOW_H__
+
+#include <vector>
+
+#include "cocos2d.h"
+
+USING_NS_CC;
+
+/**
+ * Lua瀑布流（Waterfall.lua）的数据模型
+ *
+ * 保存所有下落条的区间[y, y + height)，按y排序。视图区间为(bottomY, topY]，每个下落条处于
+ * 不可见、可见、压基准线三种状态之一，与Waterfall.ViewState的取值一致。
+ * 用三个游标记录“y不大于topY”“y不大于bottomY”“尾部不大于bottomY”的下落条数目，
+ * 每次滚动只检查越过了游标的下落条，开销与曲子进行到哪里无关。
+ * 区间的单位由调用方决定，Waterfall.lua使用曲子里的秒数，改变速率时不需要重新布局。
+ * 只在主线程上使用。
+ */
+class WaterfallViewWindow : public Ref {
+public:
+    enum ViewState {
+        kOutView = 1,
+        kInView = 2,
+        kOnViewLine = 3,
+    };
+
+    static WaterfallViewWindow *create();
+
+    /**
+     * 删除所有下落条
+     */
+    void clear();
+
+    /**
+     * 按y从小到大的顺序添加下落条，下标从0开始。添加完后调用commitLayout
+     */
+    void addInterval(float y, float height);
+
+    /**
+     * 用按y排好序的下落条替换所有下落条，所有下落条回到不可见状态，下一次scrollTo时重新计算
+     */
+    void setIntervals(const std::vector<float> &ys, const std::vector<float> &heights);
+
+    /**
+     * 修改下落条的位置和长度，修改完后调用commitLayout。修改不能改变下落条之间按y的顺序
+     */
+    void setInterval(int index, float y, float height);
+
+    /**
+     * 下落条的位置改变了，下一次scrollTo时重新计算所有下落条的状态
+     */
+    void commitLayout();
+
+    int getIntervalCount() const;
+
+    ViewState getViewState(int index) const;
+
+    /**
+     * 把视图移动到(bottomY, topY]，返回状态改变了的下落条：{下标, 新状态, 下标, 新状态, ...}
+     * 返回的数组在下一次调用前有效
+     */
+    const std::vector<int> &scrollTo(float bottomY, float topY);
+
+private:
+    WaterfallViewWindow();
+
+    ViewState computeState(int index) const;
+    void touch(int index);
+    void resync();
+
+    std::vector<float> _ys;
+    std::vector<float> _ends;          // 按下标，y + height
+    std::vector<int> _byEnd;           // 按尾部从小到大排序的下标
+    std::vector<float> _sortedEnds;    // 与_byEnd对应的尾部
+    std::vector<unsigned char> _states;
+    std::vector<int> _changes;
+
+    float _bottomY;
+    float _topY;
+    int _enterCursor;     // y <= topY的下落条数目
+    int _lineCursor;      // y <= bottomY的下落条数目
+    int _exitCursor;      // _byEnd中尾部 <= bottomY的数目
+    bool _layoutDirty;
+};
+
+#endif // __WATERFALL_VIEW_WINDOW_H__
@@ -0,0 +1,228 @@
+﻿#include "JudgeReplay.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include "NotePairing.h"
+#include "ProfileTrace.h"
+
+namespace JudgeReplay {
+
+static const int kTicksPerQuarter = 480;
+static const int kRateOfTickLength = 6;
+static const double kStandardTempo = 60;
+// keep scrolling this long after the last note so that trailing notes can be missed
+static const long long kTailMicroseconds = 2000000;
+
+// same defaults as FollowGameEngine: pixel ranges at the standard tempo
+static long long rangeToMicroseconds(float range) {
+    return (long long)(range * kRateOfTickLength * 60000000.0 / (kStandardTempo * kTicksPerQuarter));
+}
+
+bool Song::load(const std::string &path, std::string *error) {
+    if (!midi.load(path, error)) {
+        return false;
+    }
+
+    ticksScale = (double)kTicksPerQuarter / midi.getTicksPerQuarter();
+    // like TempoMap: pixels are proportional to time, 6 ticks per pixel at the first tempo
+    yPerMicrosecond = midi.getFirstTempo() * kTicksPerQuarter / (60000000.0 * kRateOfTickLength);
+    notes.clear();
+
+    const std::vector<MidiNoteEvent> &events = midi.getNoteEvents();
+    std::vector<std::vector<int> > trackEvents(midi.getTrackCount());
+    long long lastTick = 0;
+    for (size_t i = 0; i < events.size(); i++) {
+        lastTick = std::max(lastTick, events[i].tick);
+        if (events[i].track >= 0 && events[i].track < (int)trackEvents.size()) {
+            trackEvents[events[i].track].push_back((int)i);
+        }
+    }
+
+    // pair note on/off per track with NotePairing like WaterfallLayer::init, then merge the tracks by Y
+    for (size_t track = 0; track < trackEvents.size(); track++) {
+        NotePairing pairing;
+        std::vector<Note> slots;
+        std::vector<int> ys;
+        for (size_t i = 0; i < trackEvents[track].size(); i++) {
+            const MidiNoteEvent &event = events[trackEvents[track][i]];
+            if (event.on) {
+                if (pairing.noteOn(event.pitch) < 0) {
+                    continue;
+                }
+                Note note;
+                note.y = tickToY(event.tick);
+                note.length = 0;
+                note.pitch = event.pitch;
+                note.tick = (int)(event.tick * ticksScale);
+                slots.push_back(note);
+                ys.push_back((int)note.y);
+            } else {
+                const int slot = pairing.noteOff(event.pitch);
+                if (slot < 0) {
+                    continue;
+                }
+                int length = tickToY(event.tick) - (int)slots[slot].y - 2;
+                if (length < 5) {
+                    length = 5;
+                }
+                slots[slot].length = length;
+            }
+        }
+
+        std::vector<int> paired;
+        pairing.getPairedNotes(ys, &paired);
+        for (size_t i = 0; i < paired.size(); i++) {
+            notes.push_back(slots[paired[i]]);
+        }
+    }
+
+    std::stable_sort(notes.begin(), notes.end(), [](const Note &lhs, const Note &rhs) {
+        return lhs.y < rhs.y;
+    });
+    endMicroseconds = midi.tickToMicroseconds(lastTick);
+    return true;
+}
+
+int Song::tickToY(long long tick) const {
+    return (int)(midi.tickToMicroseconds(tick) * yPerMicrosecond);
+}
+
+double Song::getTickAt(double microseconds) const {
+    return midi.microsecondsToTick(microseconds) * ticksScale;
+}
+
+int Song::getYAt(double microseconds) const {
+    return (int)(microseconds * yPerMicrosecond);
+}
+
+void Song::fillCore(FollowJudgeCore *core) const {
+    // tempo changes for the time judge, in the same 480-per-quarter ticks as the notes
+    const std::vector<MidiTempoEvent> &tempoEvents = midi.getTempoEvents();
+    std::vector<double> ticks;
+    std::vector<double> microsecondsPerQuarter;
+    for (size_t i = 0; i < tempoEvents.size(); i++) {
+        ticks.push_back(tempoEvents[i].tick * ticksScale);
+        microsecondsPerQuarter.push_back(tempoEvents[i].microsecondsPerQuarter);
+    }
+    core->getTimeJudge().setTempoChanges(ticks.empty() ? nullptr : &ticks[0], microsecondsPerQuarter.empty() ? nullptr : &microsecondsPerQuarter[0], (int)ticks.size());
+    core->clearNotes();
+    for (size_t i = 0; i < notes.size(); i++) {
+        core->addNote(notes[i].y, notes[i].length, notes[i].pitch, notes[i].tick);
+    }
+    core->commitNotes();
+}
+
+bool Recording::load(const std::string &recordingPath, long long offsetMicroseconds, std::string *error) {
+    MidiFile midi;
+    if (!midi.load(recordingPath, error)) {
+        return false;
+    }
+
+    path = recordingPath;
+    events.clear();
+    const std::vector<MidiNoteEvent> &noteEvents = midi.getNoteEvents();
+    for (size_t i = 0; i < noteEvents.size(); i++) {
+        KeyEvent event;
+        event.microseconds = (long long)midi.tickToMicroseconds(noteEvents[i].tick) + offsetMicroseconds;
+        event.pitch = noteEvents[i].pitch;
+        event.down = noteEvents[i].on;
+        events.push_back(event);
+    }
+    return true;
+}
+
+ReplayOptions::ReplayOptions() : mode(FollowJudgeCore::kJudgeModeScroll), fps(60), perfectRange(25), greatRange(30), rightRatePercent(0.5f), durationPercent(0.25f), rhythmPercent(0.25f), measureLatency(true) {
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static long long elapsedNanoseconds(const Clock::time_point &from) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - from).count();
+}
+
+void runReplay(const Song &song, const Recording &recording, const ReplayOptions &options, FollowJudgeCore *core, ReplayResult *result) {
+    const float tempo = song.midi.getFirstTempo();
+    core->setJudgeMode(options.mode);
+    core->setRanges(options.perfectRange * tempo / kStandardTempo, options.greatRange * tempo / kStandardTempo);
+    core->getTimeJudge().setTempo(tempo, kTicksPerQuarter);
+    core->getTimeJudge().setWindows(rangeToMicroseconds(options.perfectRange), rangeToMicroseconds(options.greatRange));
+    core->reset();
+
+    result->keyEvents = 0;
+    result->frames = 0;
+    result->keyLatencies.clear();
+    result->frameLatencies.clear();
+
+    const double frameMicroseconds = 1000000.0 / options.fps;
+    const std::vector<Recording::KeyEvent> &events = recording.events;
+    long long endMicroseconds = (long long)song.endMicroseconds;
+    if (!events.empty()) {
+        endMicroseconds = std::max(endMicroseconds, events.back().microseconds);
+    }
+    endMicroseconds += kTailMicroseconds;
+
+    const Clock::time_point start = Clock::now();
+    double frameTime = 0;
+    float bottomY = 0;
+    double bottomTick = 0;
+    size_t next = 0;
+    while (frameTime <= endMicroseconds || next < events.size()) {
+        // key events that happened before this frame see the previous frame's scroll offset
+        while (next < events.size() && events[next].microseconds < frameTime) {
+            const Recording::KeyEvent &event = events[next++];
+            const Clock::time_point keyStart = Clock::now();
+            if (!event.down) {
+                core->keyUp(event.pitch, bottomY);
+            } else if (options.mode == FollowJudgeCore::kJudgeModeTime) {
+                core->keyDownAtTime(event.pitch, event.microseconds);
+            } else {
+                core->keyDown(event.pitch, bottomY, bottomTick);
+            }
+            if (options.measureLatency) {
+                result->keyLatencies.push_back(elapsedNanoseconds(keyStart));
+            }
+            result->keyEvents++;
+        }
+
+        bottomTick = song.getTickAt(frameTime);
+        bottomY = song.getYAt(frameTime);
+        const Clock::time_point frameStart = Clock::now();
+        core->getTimeJudge().syncClock(bottomTick, (long long)frameTime);
+        core->scrollTo(bottomY, bottomTick);
+        if (options.measureLatency) {
+            result->frameLatencies.push_back(elapsedNanoseconds(frameStart));
+        }
+        result->frames++;
+        frameTime += frameMicroseconds;
+        PROFILE_FRAME();
+    }
+    result->wallSeconds = elapsedNanoseconds(start) / 1e9;
+
+    const int totalNotes = core->getNoteCount();
+    const int maxLongComboCount = core->getLongPressPointCount();
+    result->totalNotes = totalNotes;
+    result->maxLongComboCount = maxLongComboCount;
+    result->perfectCount = core->getPerfectCount();
+    result->greatCount = core->getGreatCount();
+    result->missCount = core->getMissCount();
+    result->longPressComboCount = core->getLongPressComboCount();
+    result->maxCombo = core->getMaxCombo();
+    result->rightRate = core->getRightRate(totalNotes);
+    result->durationScore = core->getDurationScore(totalNotes, maxLongComboCount);
+    result->rhythmScore = core->getRhythmScore(totalNotes, 0.5f);
+    result->finalScore = core->getFinalScore(totalNotes, maxLongComboCount, options.rightRatePercent, options.durationPercent, options.rhythmPercent);
+}
+
+long long percentile(std::vector<long long> &samples, double percent) {
+    if (samples.empty()) {
+        return 0;
+    }
+    std::sort(samples.begin(), samples.end());
+    size_t index = (size_t)std::ceil(percent / 100.0 * samples.size());
+    index = std::min(samples.size() - 1, index > 0 ? index - 1 : 0);
+    return samples[index];
+}
+
+} // namespace JudgeReplay
@@ -0,0 +1,107 @@
+#ifndef __JUDGE_REPLAY_H__
+#define __JUDGE_REPLAY_H__
+
+#include <string>
+#include <vector>
+
+#include "FollowJudgeCore.h"
+#include "MidiFile.h"
+
+namespace JudgeReplay {
+
+/**
+ * Song notes laid out the same way as WaterfallLayer::init: paired per track with NotePairing,
+ * Y proportional to time with 6 ticks per pixel at the first tempo, sorted by Y.
+ * Ticks are scaled to 480 per quarter.
+ */
+struct Song {
+    struct Note {
+        float y;
+        float length;
+        int pitch;
+        int tick;       // start tick, 480 per quarter
+    };
+
+    MidiFile midi;
+    std::vector<Note> notes;
+    double ticksScale;      // song ticks -> 480 ticks per quarter
+    double yPerMicrosecond;
+    double endMicroseconds;
+
+    bool load(const std::string &path, std::string *error);
+
+    /**
+     * Waterfall Y of a song tick (not scaled)
+     */
+    int tickToY(long long tick) const;
+
+    double getTickAt(double microseconds) const;
+
+    int getYAt(double microseconds) const;
+
+    void fillCore(FollowJudgeCore *core) const;
+};
+
+/**
+ * Key presses recorded on a student's device, e.g. the result.mid written by MidiRecorder.
+ */
+struct Recording {
+    struct KeyEvent {
+        long long microseconds;
+        int pitch;
+        bool down;
+    };
+
+    std::string path;
+    std::vector<KeyEvent> events;
+
+    bool load(const std::string &path, long long offsetMicroseconds, std::string *error);
+};
+
+struct ReplayOptions {
+    FollowJudgeCore::JudgeMode mode;
+    float fps;
+    float perfectRange;
+    float greatRange;
+    float rightRatePercent;
+    float durationPercent;
+    float rhythmPercent;
+    bool measureLatency;
+
+    ReplayOptions();
+};
+
+struct ReplayResult {
+    int keyEvents;
+    int frames;
+    double wallSeconds;
+    std::vector<long long> keyLatencies;    // nanoseconds per key event
+    std::vector<long long> frameLatencies;  // nanoseconds per scroll frame
+
+    int totalNotes;
+    int maxLongComboCount;
+    int perfectCount;
+    int greatCount;
+    int missCount;
+    int longPressComboCount;
+    int maxCombo;
+    int rightRate;
+    int durationScore;
+    int rhythmScore;
+    float finalScore;
+};
+
+/**
+ * Replays the recording against the song at full speed, stepping the waterfall at options.fps.
+ * The core is reused so that repeated runs do not allocate.
+ */
+void runReplay(const Song &song, const Recording &recording, const ReplayOptions &options, FollowJudgeCore *core, ReplayResult *result);
+
+/**
+ * Value at percentile (0-100) of the samples; sorts the vector in place.
+ */
+long long percentile(std::vector<long long> &samples, double percent);
+
+} // namespace JudgeReplay
+
+#endif // __JUDGE_REPLAY_H__
@@ -0,0 +1,228 @@
+#include "MidiFile.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+
+namespace JudgeReplay {
+
+static const int kDefaultMicrosecondsPerQuarter = 500000;
+
+static unsigned int readBigEndian(const unsigned char *data, int bytes) {
+    unsigned int value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+static bool readVariableLength(const unsigned char *data, size_t size, size_t *pos, unsigned int *value) {
+    *value = 0;
+    for (int i = 0; i < 4; i++) {
+        if (*pos >= size) {
+            return false;
+        }
+        const unsigned char byte = data[(*pos)++];
+        *value = (*value << 7) | (byte & 0x7F);
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+MidiFile::MidiFile() : _ticksPerQuarter(480), _trackCount(0) {
+}
+
+bool MidiFile::load(const std::string &path, std::string *error) {
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file) {
+        if (error != nullptr) {
+            *error = "cannot open " + path;
+        }
+        return false;
+    }
+    std::vector<unsigned char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return parse(data, error);
+}
+
+bool MidiFile::parse(const std::vector<unsigned char> &data, std::string *error) {
+    _noteEvents.clear();
+    _tempoEvents.clear();
+    _tempoMicroseconds.clear();
+    _trackCount = 0;
+
+    if (data.size() < 14 || readBigEndian(&data[0], 4) != 0x4D546864) {  // MThd
+        if (error != nullptr) {
+            *error = "not a standard MIDI file";
+        }
+        return false;
+    }
+
+    const unsigned int headerSize = readBigEndian(&data[4], 4);
+    const int trackCount = readBigEndian(&data[10], 2);
+    const int division = readBigEndian(&data[12], 2);
+    if (division & 0x8000) {
+        if (error != nullptr) {
+            *error = "SMPTE time division is not supported";
+        }
+        return false;
+    }
+    _ticksPerQuarter = division;
+
+    size_t pos = 8 + headerSize;
+    for (int track = 0; track < trackCount && pos + 8 <= data.size(); track++) {
+        const unsigned int chunkType = readBigEndian(&data[pos], 4);
+        const unsigned int chunkSize = readBigEndian(&data[pos + 4], 4);
+        pos += 8;
+        if (pos + chunkSize > data.size()) {
+            if (error != nullptr) {
+                *error = "truncated track chunk";
+            }
+            return false;
+        }
+        if (chunkType == 0x4D54726B) {  // MTrk
+            if (!parseTrack(&data[pos], chunkSize, _trackCount, error)) {
+                return false;
+            }
+            _trackCount++;
+        }
+        pos += chunkSize;
+    }
+
+    std::stable_sort(_noteEvents.begin(), _noteEvents.end(), [](const MidiNoteEvent &lhs, const MidiNoteEvent &rhs) {
+        return lhs.tick < rhs.tick;
+    });
+    std::stable_sort(_tempoEvents.begin(), _tempoEvents.end(), [](const MidiTempoEvent &lhs, const MidiTempoEvent &rhs) {
+        return lhs.tick < rhs.tick;
+    });
+    if (_tempoEvents.empty() || _tempoEvents.front().tick > 0) {
+        MidiTempoEvent tempo;
+        tempo.tick = 0;
+        tempo.microsecondsPerQuarter = kDefaultMicrosecondsPerQuarter;
+        _tempoEvents.insert(_tempoEvents.begin(), tempo);
+    }
+
+    double microseconds = 0;
+    _tempoMicroseconds.push_back(0);
+    for (size_t i = 1; i < _tempoEvents.size(); i++) {
+        microseconds += (double)(_tempoEvents[i].tick - _tempoEvents[i - 1].tick) * _tempoEvents[i - 1].microsecondsPerQuarter / _ticksPerQuarter;
+        _tempoMicroseconds.push_back(microseconds);
+    }
+    return true;
+}
+
+bool MidiFile::parseTrack(const unsigned char *data, size_t size, int track, std::string *error) {
+    size_t pos = 0;
+    long long tick = 0;
+    unsigned char runningStatus = 0;
+
+    while (pos < size) {
+        unsigned int delta = 0;
+        if (!readVariableLength(data, size, &pos, &delta) || pos >= size) {
+            break;
+        }
+        tick += delta;
+
+        unsigned char status = data[pos];
+        if (status & 0x80) {
+            pos++;
+        } else if (runningStatus != 0) {
+            status = runningStatus;
+        } else {
+            if (error != nullptr) {
+                *error = "running status without a previous status byte";
+            }
+            return false;
+        }
+
+        if (status == 0xFF) {
+            if (pos >= size) {
+                break;
+            }
+            const unsigned char type = data[pos++];
+            unsigned int length = 0;
+            if (!readVariableLength(data, size, &pos, &length) || pos + length > size) {
+                break;
+            }
+            if (type == 0x51 && length == 3) {
+                MidiTempoEvent tempo;
+                tempo.tick = tick;
+                tempo.microsecondsPerQuarter = readBigEndian(&data[pos], 3);
+                _tempoEvents.push_back(tempo);
+            } else if (type == 0x2F) {
+                break;
+            }
+            pos += length;
+        } else if (status == 0xF0 || status == 0xF7) {
+            unsigned int length = 0;
+            if (!readVariableLength(data, size, &pos, &length) || pos + length > size) {
+                break;
+            }
+            pos += length;
+        } else {
+            runningStatus = status;
+            const unsigned char kind = status & 0xF0;
+            const int dataBytes = (kind == 0xC0 || kind == 0xD0) ? 1 : 2;
+            if (pos + dataBytes > size) {
+                break;
+            }
+            if (kind == 0x80 || kind == 0x90) {
+                MidiNoteEvent event;
+                event.tick = tick;
+                event.track = track;
+                event.pitch = data[pos] & 0x7F;
+                event.velocity = data[pos + 1] & 0x7F;
+                event.on = (kind == 0x90 && event.velocity > 0);
+                _noteEvents.push_back(event);
+            }
+            pos += dataBytes;
+        }
+    }
+    return true;
+}
+
+int MidiFile::getTicksPerQuarter() const {
+    return _ticksPerQuarter;
+}
+
+int MidiFile::getTrackCount() const {
+    return _trackCount;
+}
+
+const std::vector<MidiNoteEvent> &MidiFile::getNoteEvents() const {
+    return _noteEvents;
+}
+
+const std::vector<MidiTempoEvent> &MidiFile::getTempoEvents() const {
+    return _tempoEvents;
+}
+
+float MidiFile::getFirstTempo() const {
+    const int microsecondsPerQuarter = _tempoEvents.empty() ? kDefaultMicrosecondsPerQuarter : _tempoEvents.front().microsecondsPerQuarter;
+    return 60000000.0f / microsecondsPerQuarter;
+}
+
+double MidiFile::tickToMicroseconds(double tick) const {
+    size_t i = 0;
+    while (i + 1 < _tempoEvents.size() && _tempoEvents[i + 1].tick <= tick) {
+        i++;
+    }
+    const int tempo = _tempoEvents.empty() ? kDefaultMicrosecondsPerQuarter : _tempoEvents[i].microsecondsPerQuarter;
+    const double base = _tempoMicroseconds.empty() ? 0 : _tempoMicroseconds[i];
+    const double baseTick = _tempoEvents.empty() ? 0 : _tempoEvents[i].tick;
+    return base + (tick - baseTick) * tempo / _ticksPerQuarter;
+}
+
+double MidiFile::microsecondsToTick(double microseconds) const {
+    size_t i = 0;
+    while (i + 1 < _tempoMicroseconds.size() && _tempoMicroseconds[i + 1] <= microseconds) {
+        i++;
+    }
+    const int tempo = _tempoEvents.empty() ? kDefaultMicrosecondsPerQuarter : _tempoEvents[i].microsecondsPerQuarter;
+    const double base = _tempoMicroseconds.empty() ? 0 : _tempoMicroseconds[i];
+    const double baseTick = _tempoEvents.empty() ? 0 : _tempoEvents[i].tick;
+    return baseTick + (microseconds - base) * _ticksPerQuarter / tempo;
+}
+
+} // namespace JudgeReplay
@@ -0,0 +1,65 @@
+#ifndef __JUDGE_REPLAY_MIDI_FILE_H__
+#define __JUDGE_REPLAY_MIDI_FILE_H__
+
+#include <string>
+#include <vector>
+
+namespace JudgeReplay {
+
+struct MidiNoteEvent {
+    long long tick;
+    int track;
+    int pitch;
+    int velocity;
+    bool on;
+};
+
+struct MidiTempoEvent {
+    long long tick;
+    int microsecondsPerQuarter;
+};
+
+/**
+ * Minimal Standard MIDI File reader: note on/off and tempo events only.
+ * Enough to read songs and the result.mid recordings written by MidiRecorder.
+ */
+class MidiFile {
+public:
+    MidiFile();
+
+    bool load(const std::string &path, std::string *error);
+
+    int getTicksPerQuarter() const;
+
+    int getTrackCount() const;
+
+    /**
+     * Note events of all tracks ordered by tick, events on the same tick keep track order.
+     */
+    const std::vector<MidiNoteEvent> &getNoteEvents() const;
+
+    const std::vector<MidiTempoEvent> &getTempoEvents() const;
+
+    /**
+     * Tempo of the first tempo event in beats per minute, 120 when the file has none.
+     */
+    float getFirstTempo() const;
+
+    double tickToMicroseconds(double tick) const;
+
+    double microsecondsToTick(double microseconds) const;
+
+private:
+    bool parse(const std::vector<unsigned char> &data, std::string *error);
+    bool parseTrack(const unsigned char *data, size_t size, int track, std::string *error);
+
+    int _ticksPerQuarter;
+    int _trackCount;
+    std::vector<MidiNoteEvent> _noteEvents;
+    std::vector<MidiTempoEvent> _tempoEvents;
+    std::vector<double> _tempoMicroseconds;  // time at each tempo event
+};
+
+} // namespace JudgeReplay
+
+#endif // __JUDGE_REPLAY_MIDI_FILE_H__
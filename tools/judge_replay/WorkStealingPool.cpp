@@ -0,0 +1,112 @@
+#include "WorkStealingPool.h"
+
+namespace JudgeReplay {
+
+WorkStealingPool::WorkStealingPool(int threadCount) : _queued(0), _pending(0), _nextQueue(0), _stopping(false) {
+    if (threadCount <= 0) {
+        threadCount = (int)std::thread::hardware_concurrency();
+    }
+    if (threadCount <= 0) {
+        threadCount = 1;
+    }
+
+    for (int i = 0; i < threadCount; i++) {
+        _queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    }
+    for (int i = 0; i < threadCount; i++) {
+        _threads.push_back(std::thread(&WorkStealingPool::run, this, i));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _workAvailable.notify_all();
+    for (size_t i = 0; i < _threads.size(); i++) {
+        _threads[i].join();
+    }
+}
+
+int WorkStealingPool::getThreadCount() const {
+    return (int)_threads.size();
+}
+
+void WorkStealingPool::submit(const Task &task) {
+    // push the task before counting it: a worker that sees _queued > 0 always finds a task to take
+    size_t queue = 0;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        queue = _nextQueue;
+        _nextQueue = (_nextQueue + 1) % _queues.size();
+        _pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_queues[queue]->mutex);
+        _queues[queue]->tasks.push_back(task);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queued++;
+    }
+    _workAvailable.notify_one();
+}
+
+void WorkStealingPool::wait() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (_pending > 0) {
+        _allDone.wait(lock);
+    }
+}
+
+bool WorkStealingPool::take(int worker, Task *task) {
+    // own queue first (FIFO), then steal the newest task of the other workers
+    const size_t count = _queues.size();
+    for (size_t i = 0; i < count; i++) {
+        Queue &queue = *_queues[(worker + i) % count];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            continue;
+        }
+        if (i == 0) {
+            *task = queue.tasks.front();
+            queue.tasks.pop_front();
+        } else {
+            *task = queue.tasks.back();
+            queue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorkStealingPool::run(int worker) {
+    Task task;
+    while (true) {
+        {
+            // claim one of the queued tasks before taking it, so workers never race for the last task
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_queued == 0 && !_stopping) {
+                _workAvailable.wait(lock);
+            }
+            if (_queued == 0 && _stopping) {
+                return;
+            }
+            _queued--;
+        }
+
+        // every claimed task has already been pushed, and only claimed workers take tasks
+        take(worker, &task);
+
+        task(worker);
+        task = nullptr;
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_pending == 0) {
+            _allDone.notify_all();
+        }
+    }
+}
+
+} // namespace JudgeReplay
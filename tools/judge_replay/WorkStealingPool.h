@@ -0,0 +1,71 @@
+#ifndef __WORK_STEALING_POOL_H__
+#define __WORK_STEALING_POOL_H__
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace JudgeReplay {
+
+/**
+ * Fixed-size thread pool where every worker owns a task deque. Workers take work from the
+ * front of their own deque and steal from the back of the others when it runs dry, so
+ * uneven tasks (long songs, long recordings) still keep every core busy.
+ *
+ * Tasks receive the index of the worker running them, which lets callers keep per-worker
+ * state (e.g. one FollowJudgeCore per thread) without any locking.
+ */
+class WorkStealingPool {
+public:
+    typedef std::function<void(int worker)> Task;
+
+    /**
+     * @param threadCount number of workers, 0 for one per hardware thread
+     */
+    explicit WorkStealingPool(int threadCount);
+
+    ~WorkStealingPool();
+
+    int getThreadCount() const;
+
+    /**
+     * Queues the task on the workers round-robin.
+     */
+    void submit(const Task &task);
+
+    /**
+     * Blocks until every submitted task has finished.
+     */
+    void wait();
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    WorkStealingPool(const WorkStealingPool &);
+    WorkStealingPool &operator=(const WorkStealingPool &);
+
+    bool take(int worker, Task *task);
+    void run(int worker);
+
+    std::vector<std::unique_ptr<Queue> > _queues;
+    std::vector<std::thread> _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _workAvailable;
+    std::condition_variable _allDone;
+    int _queued;    // pushed but not claimed by a worker yet
+    int _pending;   // submitted but not finished
+    size_t _nextQueue;
+    bool _stopping;
+};
+
+} // namespace JudgeReplay
+
+#endif // __WORK_STEALING_POOL_H__
@@ -0,0 +1,145 @@
+// Re-scores many recorded performances of one song in parallel, e.g. all students of a PK class,
+// with the same judging rules as FollowGameEngine, and prints one CSV row per recording with the
+// getFinalScore breakdown.
+//
+//   judge_replay_batch [--mode scroll|time] [--fps 60] [--offset-ms 0] [--threads 0]
+//                      [--weights 0.5,0.25,0.25] [--list files.txt] song.mid result.mid...
+//
+// --list reads one recording path per line in addition to the ones on the command line.
+// --threads 0 uses one worker per hardware thread.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "JudgeReplay.h"
+#include "WorkStealingPool.h"
+
+using namespace JudgeReplay;
+
+struct BatchItem {
+    std::string path;
+    std::string error;
+    ReplayResult result;
+};
+
+static void printUsage(const char *program) {
+    fprintf(stderr, "usage: %s [--mode scroll|time] [--fps N] [--offset-ms N] [--threads N] [--weights a,b,c] [--list file] song.mid recording.mid...\n", program);
+}
+
+static bool readList(const char *path, std::vector<std::string> *files) {
+    std::ifstream list(path);
+    if (!list) {
+        return false;
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        while (!line.empty() && (line[line.size() - 1] == '\r' || line[line.size() - 1] == ' ')) {
+            line.erase(line.size() - 1);
+        }
+        if (!line.empty() && line[0] != '#') {
+            files->push_back(line);
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+    options.measureLatency = false;
+    long long offsetMicroseconds = 0;
+    int threadCount = 0;
+    std::string songPath;
+    std::vector<std::string> files;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--mode") == 0 && hasValue) {
+            options.mode = strcmp(argv[++i], "time") == 0 ? FollowJudgeCore::kJudgeModeTime : FollowJudgeCore::kJudgeModeScroll;
+        } else if (strcmp(arg, "--fps") == 0 && hasValue) {
+            options.fps = (float)atof(argv[++i]);
+        } else if (strcmp(arg, "--offset-ms") == 0 && hasValue) {
+            offsetMicroseconds = atoll(argv[++i]) * 1000;
+        } else if (strcmp(arg, "--threads") == 0 && hasValue) {
+            threadCount = atoi(argv[++i]);
+        } else if (strcmp(arg, "--weights") == 0 && hasValue) {
+            if (sscanf(argv[++i], "%f,%f,%f", &options.rightRatePercent, &options.durationPercent, &options.rhythmPercent) != 3) {
+                printUsage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(arg, "--list") == 0 && hasValue) {
+            if (!readList(argv[++i], &files)) {
+                fprintf(stderr, "%s: cannot read list\n", argv[i]);
+                return 1;
+            }
+        } else if (arg[0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        } else if (songPath.empty()) {
+            songPath = arg;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (songPath.empty() || files.empty() || options.fps <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string error;
+    Song song;
+    if (!song.load(songPath, &error)) {
+        fprintf(stderr, "%s: %s\n", songPath.c_str(), error.c_str());
+        return 1;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    std::vector<BatchItem> items(files.size());
+    {
+        WorkStealingPool pool(threadCount);
+
+        // one judge core per worker, filled once; runReplay resets it for every recording
+        std::vector<std::unique_ptr<FollowJudgeCore> > cores;
+        for (int i = 0; i < pool.getThreadCount(); i++) {
+            cores.push_back(std::unique_ptr<FollowJudgeCore>(new FollowJudgeCore()));
+            song.fillCore(cores.back().get());
+        }
+
+        for (size_t i = 0; i < files.size(); i++) {
+            BatchItem *item = &items[i];
+            item->path = files[i];
+            pool.submit([&song, &options, &cores, item, offsetMicroseconds](int worker) {
+                Recording recording;
+                if (!recording.load(item->path, offsetMicroseconds, &item->error)) {
+                    return;
+                }
+                runReplay(song, recording, options, cores[worker].get(), &item->result);
+            });
+        }
+        pool.wait();
+
+        fprintf(stderr, "%zu recordings of %s (%zu notes) on %d threads in %.3f s\n", files.size(), songPath.c_str(), song.notes.size(), pool.getThreadCount(),
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    int failed = 0;
+    printf("recording,notes,perfect,great,miss,longPress,longPressPoints,maxCombo,rightRate,duration,rhythm,final,error\n");
+    for (size_t i = 0; i < items.size(); i++) {
+        const BatchItem &item = items[i];
+        if (!item.error.empty()) {
+            printf("%s,,,,,,,,,,,,%s\n", item.path.c_str(), item.error.c_str());
+            failed++;
+            continue;
+        }
+        const ReplayResult &result = item.result;
+        printf("%s,%d,%d,%d,%d,%d,%d,%d,%d,%d,%d,%.2f,\n", item.path.c_str(), result.totalNotes, result.perfectCount, result.greatCount, result.missCount, result.longPressComboCount,
+               result.maxLongComboCount, result.maxCombo, result.rightRate, result.durationScore, result.rhythmScore, result.finalScore);
+    }
+    return failed > 0 ? 2 : 0;
+}
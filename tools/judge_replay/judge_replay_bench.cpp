@@ -0,0 +1,105 @@
+// Replays recorded key streams against a song through the headless FollowJudgeCore
+// at full speed and reports throughput, per-event latency percentiles and final scores.
+//
+//   judge_replay_bench [--mode scroll|time] [--fps 60] [--repeat 20] [--offset-ms 0] [--trace trace.json] song.mid result.mid...
+//
+// --trace only records anything when built with -DJUDGE_REPLAY_PROFILE=ON (WANAKA_PROFILE).
+//
+// The song is laid out exactly like WaterfallLayer::init and judged with the same
+// ranges and scoring as FollowGameEngine, so score changes here are score changes on device.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "JudgeReplay.h"
+#include "ProfileTrace.h"
+
+using namespace JudgeReplay;
+
+static void printUsage(const char *program) {
+    fprintf(stderr, "usage: %s [--mode scroll|time] [--fps N] [--repeat N] [--offset-ms N] [--trace path] song.mid recording.mid...\n", program);
+}
+
+static void printLatency(const char *name, std::vector<long long> &samples) {
+    printf("  %-6s latency ns: p50=%lld p90=%lld p99=%lld max=%lld (%zu samples)\n", name, percentile(samples, 50), percentile(samples, 90), percentile(samples, 99), percentile(samples, 100), samples.size());
+}
+
+int main(int argc, char **argv) {
+    ReplayOptions options;
+    int repeat = 20;
+    long long offsetMicroseconds = 0;
+    std::vector<std::string> files;
+    std::string tracePath;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (strcmp(arg, "--mode") == 0 && hasValue) {
+            options.mode = strcmp(argv[++i], "time") == 0 ? FollowJudgeCore::kJudgeModeTime : FollowJudgeCore::kJudgeModeScroll;
+        } else if (strcmp(arg, "--fps") == 0 && hasValue) {
+            options.fps = (float)atof(argv[++i]);
+        } else if (strcmp(arg, "--repeat") == 0 && hasValue) {
+            repeat = atoi(argv[++i]);
+        } else if (strcmp(arg, "--offset-ms") == 0 && hasValue) {
+            offsetMicroseconds = atoll(argv[++i]) * 1000;
+        } else if (strcmp(arg, "--trace") == 0 && hasValue) {
+            tracePath = argv[++i];
+        } else if (arg[0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            files.push_back(arg);
+        }
+    }
+    if (files.size() < 2 || repeat < 1 || options.fps <= 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    std::string error;
+    Song song;
+    if (!song.load(files[0], &error)) {
+        fprintf(stderr, "%s: %s\n", files[0].c_str(), error.c_str());
+        return 1;
+    }
+    printf("song %s: %zu notes, %.1f s, tempo %.1f\n", files[0].c_str(), song.notes.size(), song.endMicroseconds / 1e6, song.midi.getFirstTempo());
+
+    FollowJudgeCore core;
+    song.fillCore(&core);
+
+    for (size_t i = 1; i < files.size(); i++) {
+        Recording recording;
+        if (!recording.load(files[i], offsetMicroseconds, &error)) {
+            fprintf(stderr, "%s: %s\n", files[i].c_str(), error.c_str());
+            return 1;
+        }
+
+        ReplayResult result;
+        std::vector<long long> keyLatencies;
+        std::vector<long long> frameLatencies;
+        double wallSeconds = 0;
+        for (int run = 0; run < repeat; run++) {
+            runReplay(song, recording, options, &core, &result);
+            wallSeconds += result.wallSeconds;
+            keyLatencies.insert(keyLatencies.end(), result.keyLatencies.begin(), result.keyLatencies.end());
+            frameLatencies.insert(frameLatencies.end(), result.frameLatencies.begin(), result.frameLatencies.end());
+        }
+
+        const double judgments = (double)(result.keyEvents + result.frames) * repeat;
+        printf("%s: %d key events, %d frames x %d runs\n", files[i].c_str(), result.keyEvents, result.frames, repeat);
+        printf("  throughput: %.0f judgments/s (%.3f ms per run)\n", wallSeconds > 0 ? judgments / wallSeconds : 0.0, wallSeconds * 1000 / repeat);
+        printLatency("key", keyLatencies);
+        printLatency("frame", frameLatencies);
+        printf("  perfect=%d great=%d miss=%d longPress=%d/%d maxCombo=%d notes=%d\n", result.perfectCount, result.greatCount, result.missCount, result.longPressComboCount, result.maxLongComboCount, result.maxCombo, result.totalNotes);
+        printf("  rightRate=%d duration=%d rhythm=%d final=%.2f\n", result.rightRate, result.durationScore, result.rhythmScore, result.finalScore);
+    }
+
+    if (!tracePath.empty() && !PROFILE_DUMP(tracePath)) {
+        fprintf(stderr, "%s: trace not written (build with -DJUDGE_REPLAY_PROFILE=ON)\n", tracePath.c_str());
+        return 1;
+    }
+    return 0;
+}